@@ -6,11 +6,20 @@ Last Modified: 03.11.17
 """
 
 import socket
+import struct
 import sys
+import zlib
 
-from UserCommand import UserCommand
+from UserCommand import UserCommand, FLAG_CHUNKED, FLAG_CHECKSUM
+
+import filemgmt
 
 HEADER_LEN = 7
+EXT_REPLY_LEN = 15
+CHUNK_HDR_LEN = 4
+CHUNK_COMPRESSED = 0x80000000
+CHECKSUM_LEN = 4
+RECV_LEN = 65536       # Size of the reusable receive buffer.
 
 class ClientSocket:
 	
@@ -25,6 +34,12 @@ class ClientSocket:
 				 socket.SOCK_STREAM)
 		else:
 			self.sock = sock
+		# Streamed bodies are received into this buffer, a piece at
+		# a time, so memory use doesn't grow with the body.
+		self.buf = bytearray(RECV_LEN)
+		self.view = memoryview(self.buf)
+		# Bytes written to a file by the last receiveToFile() call.
+		self.written = 0
 
 	#        Method: connect()
 	#   Description: Attempts to connect to host:port.
@@ -59,18 +74,125 @@ class ClientSocket:
 	# Preconditions: The socket has been initialized.
 	#       Returns: The message body.
 	def receive(self):
-		uc = UserCommand()
 		body = ''
-		# Receive the header.
-		header = self._receive(HEADER_LEN)
-		# Unpack the header.
-		unpackedHeader = uc.unpack(header)
-		bodyLen = unpackedHeader[2]
+		bodyLen = self.receiveHeader()
 		# Receive the message body.
 		if bodyLen > 0:
 			body = self._receive(bodyLen)
 		return body
 
+	#        Method: receiveHeader()
+	#   Description: Attempts to receive a legacy message header.
+	#    Parameters: None.
+	# Preconditions: The socket has been initialized.
+	#       Returns: The length of the body that follows.
+	def receiveHeader(self):
+		uc = UserCommand()
+		# Receive and unpack the header.
+		unpackedHeader = uc.unpack(self._receive(HEADER_LEN))
+		return unpackedHeader[2]
+
+	#        Method: receiveReply()
+	#   Description: Attempts to receive one session reply.
+	#    Parameters: None.
+	# Preconditions: The socket has been initialized.
+	#       Returns: A (mode, request id, body) tuple.
+	def receiveReply(self):
+		mode, flags, reqId, bodyLen = self.receiveReplyHeader()
+		body = self.receiveReplyBody(flags, bodyLen)
+		return (mode, reqId, body)
+
+	#        Method: receiveReplyHeader()
+	#   Description: Attempts to receive one session reply header.
+	#    Parameters: None.
+	# Preconditions: The socket has been initialized.
+	#       Returns: A (mode, flags, request id, body length) tuple.
+	def receiveReplyHeader(self):
+		uc = UserCommand()
+		# Receive and unpack the extended header.
+		header = self._receive(EXT_REPLY_LEN)
+		mode, version, flags, reqId, bodyLen = uc.unpackReply(header)
+		return (chr(mode), flags, reqId, bodyLen)
+
+	#        Method: receiveReplyBody()
+	#   Description: Attempts to receive the body of a session reply. A
+	#                chunked body is reassembled from its chunks, which end
+	#                with an empty chunk.
+	#    Parameters: flags - The reply header flags.
+	#                bodyLen - The reply header body length.
+	# Preconditions: The reply header has been received.
+	#       Returns: The body.
+	def receiveReplyBody(self, flags, bodyLen):
+		body = ''
+		if flags & FLAG_CHUNKED:
+			body = ''.join(self.receiveChunks(flags))
+		elif bodyLen > 0:
+			body = self._receive(bodyLen)
+		return body
+
+	#        Method: receiveToFile()
+	#   Description: Receives a reply body straight into a file, writing
+	#                each piece as it arrives, so memory use stays constant
+	#                and the disk is written while the rest is in flight.
+	#    Parameters: fd - The file descriptor to write to.
+	#                flags - The reply header flags, or 0 for a legacy
+	#                        reply.
+	#                bodyLen - The body length from the header.
+	# Preconditions: The reply header has been received.
+	#       Returns: The number of bytes written. Raises RuntimeError if
+	#                the checksum does not match or the connection
+	#                breaks; self.written then holds the bytes written
+	#                before the failure.
+	def receiveToFile(self, fd, flags, bodyLen):
+		self.written = 0
+		if flags & FLAG_CHUNKED:
+			pieces = self.receiveChunks(flags, True)
+		else:
+			pieces = self._receivePieces(bodyLen)
+		for piece in pieces:
+			filemgmt.writeAll(fd, piece)
+			self.written += len(piece)
+		return self.written
+
+	#        Method: receiveChunks()
+	#   Description: Receives the body of a chunked reply a piece at a
+	#                time, so the caller can use each piece as it arrives.
+	#                Chunks marked as compressed belong to one deflate
+	#                stream per reply and are inflated on the way in. If
+	#                the reply is checksummed, a CRC-32 of the pieces is
+	#                kept as they arrive and checked against the trailer.
+	#    Parameters: flags - The reply header flags.
+	#                buffers - If true, uncompressed pieces are buffers
+	#                          over the receive buffer, which are only
+	#                          valid until the next piece is taken.
+	# Preconditions: A chunked reply header has been received.
+	#       Returns: A generator of the pieces. Raises RuntimeError if the
+	#                checksum does not match.
+	def receiveChunks(self, flags, buffers=False):
+		inflater = zlib.decompressobj()
+		checksum = 0
+		while True:
+			chunkLen = struct.unpack(">I",
+				self._receive(CHUNK_HDR_LEN))[0]
+			if chunkLen == 0:
+				break
+			compressed = chunkLen & CHUNK_COMPRESSED
+			chunkLen &= ~CHUNK_COMPRESSED
+			for piece in self._receivePieces(chunkLen):
+				if compressed:
+					piece = inflater.decompress(piece)
+				elif not buffers:
+					piece = str(piece)
+				checksum = zlib.crc32(piece, checksum)
+				if piece:
+					yield piece
+
+		if flags & FLAG_CHECKSUM:
+			expected = struct.unpack(">I",
+				self._receive(CHECKSUM_LEN))[0]
+			if checksum & 0xffffffff != expected:
+				raise RuntimeError("checksum mismatch")
+
 	#        Method: _receive()
 	#   Description: Receives msgLen bytes of a message.
 	#    Parameters: msgLen - The length of the message.
@@ -89,3 +211,20 @@ class ClientSocket:
 			bytesReceived = bytesReceived + len(chunk)
 
 		return ''.join(chunks)
+
+	#        Method: _receivePieces()
+	#   Description: Receives msgLen bytes of a message into the reusable
+	#                receive buffer, a piece at a time.
+	#    Parameters: msgLen - The length of the message.
+	# Preconditions: The socket has been initialized.
+	#       Returns: A generator of buffers over the received bytes. Each
+	#                is overwritten when the next piece is received.
+	def _receivePieces(self, msgLen):
+		while msgLen > 0:
+			received = self.sock.recv_into(self.view,
+						       min(msgLen, RECV_LEN))
+			if received == 0:
+				raise RuntimeError("ftclient: recv: socket " + \
+						"connection broken")
+			msgLen -= received
+			yield buffer(self.buf, 0, received)
@@ -5,11 +5,23 @@ Last Modified: 03.11.17
   Description: A class containing validation, packing, and unpacking utilities.
 """
 
+import os
 import struct
 import sys
 
 import validate
 
+EXT_MAGIC = 'x'       # First byte of an extended (session) header.
+EXT_VERSION = 2       # Extended header version.
+FLAG_CHUNKED = 0x01   # Request a reply framed in length-prefixed chunks.
+FLAG_RANGE = 0x02     # Request body starts with a byte range.
+FLAG_STRIPED = 0x04   # Request the file striped over data connections.
+FLAG_COMPRESS = 0x08  # Allow the reply to be compressed.
+FLAG_CHECKSUM = 0x10  # Request a checksum trailer on the reply.
+FLAG_RECURSIVE = 0x20 # Request a listing or archive of a whole tree.
+FLAG_IF_NONE_MATCH = 0x40 # Request body starts with the hash of the local
+                          # copy, which the file is only sent if it lacks.
+
 class UserCommand:
 
         #        Method: __init__()
@@ -27,7 +39,7 @@ class UserCommand:
         #       Returns: None. Sets class attributes.
 	def validate(self):
 		#If there are too few arguments, exit with error.
-		if len(sys.argv) < validate.MIN_OPTIONS:
+		if len(sys.argv) < validate.MIN_OPTIONS - 1:
 			print('ftclient: invalid number of args')
 			sys.exit(1)
 	
@@ -35,7 +47,9 @@ class UserCommand:
 		# Validate the ftclient mode.	
 		self.mode = validate.validateMode(sys.argv[3])
 		if self.mode == -1:	
-			print("ftclient: command must be '-g' or '-l'")
+			print("ftclient: command must be '-g', '-l', '-s', '-d', " + \
+			      "'-a', '-gr', '-lr', '-u', '-gc', '-p', '-m' " + \
+			      "or '-b'")
 			sys.exit(1)
 		# Validate the arguments length.
 		if not validate.validateLen(sys.argv):
@@ -46,6 +60,62 @@ class UserCommand:
 			print('ftclient: invalid server port')
 			sys.exit(1)
 		self.sPort = int(sys.argv[2])
+		self.recursive = sys.argv[3] in ('-gr', '-lr')
+		# A batch runs over the control connection alone, so it has
+		# no data port.
+		if self.mode == 'b':
+			self.validateBatch(sys.argv[4:])
+			return
+		# An archive get is a batch of name patterns, each of whose
+		# matching files arrive in one reply.
+		if self.mode == 'a' and self.recursive:
+			self.validateTrees(sys.argv[4:])
+			return
+		if self.mode == 'a':
+			self.validateArchive(sys.argv[4:])
+			return
+		# A conditional get is a batch of gets that leave current
+		# local copies alone.
+		if self.mode == 'c':
+			self.validateConditional(sys.argv[4:])
+			return
+		# A put is a batch of local files to send.
+		if self.mode == 'p':
+			self.validatePut(sys.argv[4:])
+			return
+		# A delta update names a file the client already has a copy
+		# of.
+		if self.mode == 'u':
+			if not validate.validateFileName(sys.argv[4]):
+				print('ftclient: invalid filename')
+				sys.exit(1)
+			if not os.path.isfile(sys.argv[4]):
+				print('ftclient: "{0}" has no local copy to '.format(
+				      sys.argv[4]) + 'update; use -g')
+				sys.exit(1)
+			self.fName = sys.argv[4]
+			return
+		# A stats request is a batch of one.
+		if self.mode == 'm':
+			self.validateBatch(['-m'])
+			return
+		# A detailed listing takes an optional name pattern and the
+		# cursor of an interrupted listing.
+		if self.mode == 'd':
+			self.fName = ''
+			self.cursor = 0
+			if len(sys.argv) > 4:
+				self.fName = sys.argv[4]
+			# A recursive listing names the tree's root
+			# directory instead of a pattern.
+			if self.recursive and self.fName:
+				self.fName = self.validateTree(self.fName)
+			if len(sys.argv) > 5:
+				self.cursor = validate.validateOffset(sys.argv[5])
+				if self.cursor == -1:
+					print('ftclient: invalid cursor')
+					sys.exit(1)
+			return
 		# Validate the data port.
 		if not validate.validatePort(sys.argv[-1]):
 			print('ftclient: invalid data port')
@@ -62,13 +132,157 @@ class UserCommand:
 			if not validate.validateFileName(sys.argv[4]):
 				print('ftclient: invalid filename')
 				sys.exit(1)
-			if not validate.validateFileExistence(sys.argv[4]):
-				print('ftclient: exiting ftclient')
-				sys.exit(0)
 			self.fName = sys.argv[4]
+			self.validateRange(sys.argv[5:-1])
+		# A striped get names the file and the number of data
+		# connections to use.
+		elif self.mode == 's':
+			if not validate.validateFileName(sys.argv[4]):
+				print('ftclient: invalid filename')
+				sys.exit(1)
+			if not validate.validateStripes(sys.argv[5]):
+				print('ftclient: stripes must be 1 to ' + \
+				      str(validate.MAX_STRIPES))
+				sys.exit(1)
+			self.fName = sys.argv[4]
+			self.stripes = int(sys.argv[5])
+			self.validateRange([])
 		else:
 			self.fName = ''
 
+	#        Method: validateRange()
+	#   Description: Validates the optional byte range of a get command.
+	#                Without one, an existing file may be resumed from its
+	#                current size.
+	#    Parameters: args - The offset and length arguments, if any.
+	# Preconditions: None.
+	#       Returns: None. Sets the offset and length attributes; an
+	#                offset of None means the whole file is fetched.
+	def validateRange(self, args):
+		self.offset = None
+		self.length = 0
+		if args:
+			self.offset = validate.validateOffset(args[0])
+			if len(args) > 1:
+				self.length = validate.validateOffset(args[1])
+			if self.offset == -1 or self.length == -1:
+				print('ftclient: invalid byte range')
+				sys.exit(1)
+			return
+		offset = validate.validateFileExistence(self.fName)
+		if offset == -1:
+			print('ftclient: exiting ftclient')
+			sys.exit(0)
+		if offset > 0:
+			self.offset = offset
+
+	#        Method: validateBatch()
+	#   Description: Validates the requests of a batch. Each request is
+	#                either '-l' for a listing or the name of a file to get.
+	#    Parameters: args - The batch request arguments.
+	# Preconditions: None.
+	#       Returns: None. Sets the batch attribute to a list of
+	#                (mode, file name, offset, length) tuples.
+	def validateBatch(self, args):
+		self.batch = []
+		self.fName = ''
+		for arg in args:
+			if arg == '-l':
+				self.batch.append(('l', '', None, 0))
+				continue
+			if arg == '-m':
+				self.batch.append(('s', '', None, 0))
+				continue
+			if not validate.validateFileName(arg):
+				print('ftclient: invalid filename')
+				sys.exit(1)
+			offset = validate.validateFileExistence(arg)
+			if offset == -1:
+				print('ftclient: skipping "{0}"'.format(arg))
+				continue
+			self.batch.append(('g', arg, offset or None, 0))
+
+	#        Method: validateArchive()
+	#   Description: Validates the name patterns of an archive get.
+	#    Parameters: args - The pattern arguments.
+	# Preconditions: None.
+	#       Returns: None. Sets the batch attribute to a list of
+	#                (mode, pattern, offset, length) tuples.
+	def validateArchive(self, args):
+		self.batch = []
+		self.fName = ''
+		for arg in args:
+			if not validate.validateFileName(arg):
+				print('ftclient: invalid name pattern')
+				sys.exit(1)
+			self.batch.append(('a', arg, None, 0))
+
+	#        Method: validateConditional()
+	#   Description: Validates the file names of a conditional get. Local
+	#                copies are replaced rather than resumed, so the user is
+	#                not asked about them.
+	#    Parameters: args - The file name arguments.
+	# Preconditions: None.
+	#       Returns: None. Sets the batch attribute to a list of
+	#                (mode, file name, offset, length) tuples, with the
+	#                mode 'c' for a conditional get.
+	def validateConditional(self, args):
+		self.batch = []
+		self.fName = ''
+		for arg in args:
+			if not validate.validateFileName(arg):
+				print('ftclient: invalid filename')
+				sys.exit(1)
+			self.batch.append(('c', arg, None, 0))
+
+	#        Method: validatePut()
+	#   Description: Validates the files of a put, which must be regular
+	#                files in the ftclient directory.
+	#    Parameters: args - The file name arguments.
+	# Preconditions: None.
+	#       Returns: None. Sets the batch attribute to a list of
+	#                (mode, file name, offset, length) tuples, with the
+	#                mode 'p' for a put.
+	def validatePut(self, args):
+		self.batch = []
+		self.fName = ''
+		for arg in args:
+			if not validate.validateFileName(arg):
+				print('ftclient: invalid filename')
+				sys.exit(1)
+			if not os.path.isfile(arg):
+				print('ftclient: "{0}" is not a file'.format(arg))
+				sys.exit(1)
+			self.batch.append(('p', arg, None, 0))
+
+	#        Method: validateTree()
+	#   Description: Validates the root directory of a tree, relative to
+	#                the server directory.
+	#    Parameters: arg - The directory argument.
+	# Preconditions: None.
+	#       Returns: The normalized path, or '' for the server directory.
+	def validateTree(self, arg):
+		path = os.path.normpath(arg)
+		if path == '.':
+			return ''
+		if not validate.validatePath(path):
+			print('ftclient: invalid directory "{0}"'.format(arg))
+			sys.exit(1)
+		return path
+
+	#        Method: validateTrees()
+	#   Description: Validates the root directories of a recursive get.
+	#    Parameters: args - The directory arguments.
+	# Preconditions: None.
+	#       Returns: None. Sets the batch attribute to a list of
+	#                (mode, directory, offset, length) tuples, with the
+	#                mode 'r' for a tree.
+	def validateTrees(self, args):
+		self.batch = []
+		self.fName = ''
+		for arg in args:
+			self.batch.append(('r', self.validateTree(arg), None, 0))
+
 	#        Method: pack()
         #   Description: Packs the user command into a byte array.
         #    Parameters: None.
@@ -80,6 +294,128 @@ class UserCommand:
 	        packed = bytearray(packed) + bytearray(self.fName, 'ascii')
 		return packed
 
+	#        Method: packRequest()
+	#   Description: Packs one session request into a byte array using the
+	#                extended header, which carries flags and a request id
+	#                instead of a data port. The hash of a local copy, a
+	#                byte range and a stripe spec, if given, are packed
+	#                ahead of the file name in that order.
+	#    Parameters: mode - The request mode character.
+	#                fName - The file name, or '' for a listing.
+	#                reqId - The request id echoed back in the reply.
+	#                flags - The request flags, e.g. FLAG_CHUNKED.
+	#                offset - The first byte wanted, or None for the whole
+	#                         file.
+	#                length - The number of bytes wanted, or 0 for the rest
+	#                         of the file.
+	#                stripes - The number of data connections to stripe
+	#                          the file over, or 0 to send it in the reply.
+	#                dPort - The data port the stripes connect to.
+	#                match - The MD5 of the local copy, which the server
+	#                        doesn't resend, or None.
+	# Preconditions: None.
+	#       Returns: The packed byte array.
+	def packRequest(self, mode, fName, reqId, flags=0, offset=None,
+			length=0, stripes=0, dPort=0, match=None):
+		body = bytearray(fName, 'ascii')
+		if stripes:
+			flags |= FLAG_STRIPED
+			body = bytearray(struct.pack(">HB", dPort, stripes)) + body
+		if offset is not None:
+			flags |= FLAG_RANGE
+			body = bytearray(struct.pack(">QQ", offset, length)) + body
+		if match is not None:
+			flags |= FLAG_IF_NONE_MATCH
+			body = bytearray(match) + body
+		packed = struct.pack(">bBbBII", ord(EXT_MAGIC), EXT_VERSION,
+				     ord(mode), flags, reqId, len(body))
+		packed = bytearray(packed) + body
+		return packed
+
+	#        Method: packListing()
+	#   Description: Packs a detailed listing request, whose body is the
+	#                listing cursor followed by the name pattern, or by the
+	#                root directory for a recursive listing.
+	#    Parameters: reqId - The request id echoed back in the reply.
+	# Preconditions: validate() has been called prior to this function.
+	#       Returns: The packed byte array.
+	def packListing(self, reqId):
+		body = bytearray(struct.pack(">Q", self.cursor)) + \
+		       bytearray(self.fName, 'ascii')
+		flags = FLAG_COMPRESS | FLAG_CHECKSUM
+		if self.recursive:
+			flags |= FLAG_RECURSIVE
+		packed = struct.pack(">bBbBII", ord(EXT_MAGIC), EXT_VERSION,
+				     ord('d'), flags, reqId, len(body))
+		packed = bytearray(packed) + body
+		return packed
+
+	#        Method: packDelta()
+	#   Description: Packs a delta request, whose body is the block length
+	#                and count, the block signatures of the local copy, and
+	#                then the file name.
+	#    Parameters: reqId - The request id echoed back in the reply.
+	#                blockLen - The length of each signed block.
+	#                count - The number of signed blocks.
+	#                sigs - The packed block signatures.
+	# Preconditions: validate() has been called prior to this function.
+	#       Returns: The packed byte array.
+	def packDelta(self, reqId, blockLen, count, sigs):
+		body = bytearray(struct.pack(">II", blockLen, count)) + sigs + \
+		       bytearray(self.fName, 'ascii')
+		packed = struct.pack(">bBbBII", ord(EXT_MAGIC), EXT_VERSION,
+				     ord('u'), FLAG_COMPRESS | FLAG_CHECKSUM,
+				     reqId, len(body))
+		packed = bytearray(packed) + body
+		return packed
+
+	#        Method: packPut()
+	#   Description: Packs a put request, whose body is the length of the
+	#                file followed by its name. The file's data follows the
+	#                request on the control connection.
+	#    Parameters: fName - The file name.
+	#                reqId - The request id echoed back in the reply.
+	#                size - The length of the file.
+	# Preconditions: None.
+	#       Returns: The packed byte array.
+	def packPut(self, fName, reqId, size):
+		body = bytearray(struct.pack(">Q", size)) + \
+		       bytearray(fName, 'ascii')
+		packed = struct.pack(">bBbBII", ord(EXT_MAGIC), EXT_VERSION,
+				     ord('p'), 0, reqId, len(body))
+		packed = bytearray(packed) + body
+		return packed
+
+	#        Method: unpackStripe()
+	#   Description: Unpacks the header that starts each stripe of a
+	#                striped reply.
+	#    Parameters: packed - The byte array to be deconstructed.
+	# Preconditions: None.
+	#       Returns: The unpacked (offset, length) tuple.
+	def unpackStripe(self, packed):
+		unpacked = struct.unpack(">QQ", packed)
+		return unpacked
+
+	#        Method: unpackMember()
+	#   Description: Unpacks the header that starts each member of an
+	#                archive reply.
+	#    Parameters: packed - The byte array to be deconstructed.
+	# Preconditions: None.
+	#       Returns: The unpacked (name length, size, mode) tuple.
+	def unpackMember(self, packed):
+		unpacked = struct.unpack(">HQI", packed)
+		return unpacked
+
+	#        Method: unpackReply()
+	#   Description: Unpacks an extended reply header.
+	#    Parameters: packed - The byte array to be deconstructed.
+	# Preconditions: None.
+	#       Returns: The unpacked (mode, version, flags, request id, length)
+	#                tuple.
+	def unpackReply(self, packed):
+		unpacked = struct.unpack(">bBBIQ", packed)
+		return unpacked
+
 	#        Method: unpack()
         #   Description: Unpacks the packed byte array.
         #    Parameters: packed - The byte array to be deconstructed.
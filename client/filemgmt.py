@@ -2,16 +2,156 @@
      Filename: filemgmt.py
        Author: Maxwell Goldberg
 Last Modified: 03.11.17
-  Description: Provides a utility to write a string to file.
+  Description: Provides utilities to write received files to disk, to
+               sign a local copy for a delta update, and to hash one for a
+               conditional get.
 """
 
-#        Method: strToFile()
-#   Description: Writes a string to file.
+import ctypes
+import ctypes.util
+import hashlib
+import math
+import os
+import struct
+import zlib
+
+DELTA_BLOCK_MIN = 2048    # Shortest block signed for a delta update.
+DELTA_BLOCK_MAX = 1048576 # Longest block the server accepts.
+DELTA_BLOCKS_MAX = 524288 # Most blocks the server accepts.
+HASH_READ_LEN = 1048576   # Bytes hashed at a time.
+
+# posix_fallocate() reserves disk blocks up front. Python 2 has no wrapper
+# for it, so it is called from the C library when one can be found.
+try:
+	_libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+	_fallocate = _libc.posix_fallocate
+	_fallocate.argtypes = [ctypes.c_int, ctypes.c_longlong,
+			       ctypes.c_longlong]
+except (OSError, AttributeError):
+	_fallocate = None
+
+#        Method: openFile()
+#   Description: Opens a file for a download in binary mode, positioned at
+#                the offset the received data starts at.
 #    Parameters: fname - The filename to be written to.
-#                data - The string to be written to file.
-# Preconditions: fname and data are both strings.
+#                offset - The file offset to write at, or None to replace
+#                         the file.
+# Preconditions: None.
+#       Returns: The file descriptor.
+def openFile(fname, offset=None):
+	flags = os.O_WRONLY | os.O_CREAT
+	if offset is None:
+		flags |= os.O_TRUNC
+	fd = os.open(fname, flags, 0644)
+	os.lseek(fd, offset or 0, os.SEEK_SET)
+	return fd
+
+#        Method: preallocate()
+#   Description: Reserves disk space for the data about to be received, so
+#                the file is laid out in one piece and a full disk is found
+#                before the transfer rather than during it. Failure is not
+#                an error; the file then grows as it is written.
+#    Parameters: fd - The file descriptor.
+#                offset - The file offset the data starts at.
+#                length - The expected length of the data.
+# Preconditions: fd is open for writing.
+#       Returns: The length of the file before any space was reserved.
+def preallocate(fd, offset, length):
+	size = os.fstat(fd).st_size
+	if _fallocate is not None and length > 0:
+		_fallocate(fd, offset, length)
+	return size
+
+#        Method: closeFile()
+#   Description: Closes a downloaded file, first trimming any reserved
+#                space that the received data did not fill.
+#    Parameters: fd - The file descriptor.
+#                size - The length the file should have.
+# Preconditions: fd is open for writing.
+#       Returns: None.
+def closeFile(fd, size):
+	try:
+		if os.fstat(fd).st_size > size:
+			os.ftruncate(fd, size)
+	finally:
+		os.close(fd)
+
+#        Method: blockLength()
+#   Description: Picks the block length for the signature of a file. The
+#                square root of the length balances the size of the
+#                signature against the data resent around each change.
+#    Parameters: size - The length of the file.
+# Preconditions: None.
+#       Returns: The block length, a multiple of 1 KiB.
+def blockLength(size):
+	blockLen = max(int(math.sqrt(size)), DELTA_BLOCK_MIN,
+		       -(-size // DELTA_BLOCKS_MAX))
+	blockLen = (blockLen + 1023) & ~1023
+	return min(blockLen, DELTA_BLOCK_MAX)
+
+#        Method: signFile()
+#   Description: Signs each whole block of a file with its Adler-32 and
+#                MD5 hashes. A short final block is left unsigned.
+#    Parameters: fd - The file descriptor, at the start of the file.
+#                blockLen - The block length.
+# Preconditions: fd is open for reading.
+#       Returns: The (signatures, block count) tuple.
+def signFile(fd, blockLen):
+	sigs = bytearray()
+	count = 0
+	while count < DELTA_BLOCKS_MAX:
+		block = os.read(fd, blockLen)
+		# A short read only happens at the end of the file.
+		while block and len(block) < blockLen:
+			more = os.read(fd, blockLen - len(block))
+			if not more:
+				break
+			block += more
+		if len(block) < blockLen:
+			break
+		sigs += struct.pack(">I", zlib.adler32(block) & 0xffffffff)
+		sigs += hashlib.md5(block).digest()
+		count += 1
+	return sigs, count
+
+#        Method: hashFile()
+#   Description: Computes the MD5 of a file's contents, which the server
+#                compares with its manifest in a conditional get.
+#    Parameters: fname - The file name.
+# Preconditions: The file exists.
+#       Returns: The 16-byte digest.
+def hashFile(fname):
+	md = hashlib.md5()
+	fd = os.open(fname, os.O_RDONLY)
+	try:
+		while True:
+			data = os.read(fd, HASH_READ_LEN)
+			if not data:
+				break
+			md.update(data)
+	finally:
+		os.close(fd)
+	return md.digest()
+
+#        Method: writeAll()
+#   Description: Writes a string or buffer to an open file at its current
+#                offset.
+#    Parameters: fd - The file descriptor to be written to.
+#                data - The string or buffer to be written.
+# Preconditions: fd is open for writing.
+#       Returns: None.
+def writeAll(fd, data):
+	while data:
+		written = os.write(fd, data)
+		data = data[written:]
+
+#        Method: writeAt()
+#   Description: Writes a string to an open file at a given offset.
+#    Parameters: fd - The file descriptor to be written to.
+#                offset - The file offset to write at.
+#                data - The string to be written.
+# Preconditions: fd is open for writing.
 #       Returns: None.
-def strToFile(fname, data):
-	fp = open(fname, "w+")
-	fp.write(data)
-	fp.close()
+def writeAt(fd, offset, data):
+	os.lseek(fd, offset, os.SEEK_SET)
+	writeAll(fd, data)
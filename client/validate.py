@@ -11,6 +11,7 @@ import sys
 MIN_OPTIONS = 5       # Minimum number of command line arguments.
 PORT_MAX = 65535      # Maximum port number.
 PORT_MIN = 1          # Minimum port number.
+MAX_STRIPES = 16      # Most data connections in a striped get.
 
 #        Method: validateMode()
 #   Description: Validates the command line mode argument.
@@ -22,6 +23,31 @@ def validateMode(inStr):
 		mode = 'l'
 	elif (inStr) == '-g':
 		mode = 'g'
+	elif (inStr) == '-b':
+		mode = 'b'
+	elif (inStr) == '-s':
+		mode = 's'
+	elif (inStr) == '-d':
+		mode = 'd'
+	elif (inStr) == '-m':
+		mode = 'm'
+	elif (inStr) == '-a':
+		mode = 'a'
+	# The recursive modes are a detailed listing and an archive get of
+	# a whole tree.
+	elif (inStr) == '-lr':
+		mode = 'd'
+	elif (inStr) == '-gr':
+		mode = 'a'
+	elif (inStr) == '-u':
+		mode = 'u'
+	# A conditional get only fetches files whose local copies are out
+	# of date.
+	elif (inStr) == '-gc':
+		mode = 'c'
+	# A put sends files to the server.
+	elif (inStr) == '-p':
+		mode = 'p'
 	else:
 		mode = -1
 	return mode
@@ -33,9 +59,27 @@ def validateMode(inStr):
 #       Returns: Returns True if valid, False otherwise.
 def validateLen(args):
 	if args[3] == '-g':
-		return len(args) == MIN_OPTIONS + 1
+		# An optional offset and length may follow the file name.
+		return len(args) >= MIN_OPTIONS + 1 and \
+		       len(args) <= MIN_OPTIONS + 3
 	elif args[3] == '-l':
 		return len(args) == MIN_OPTIONS	
+	elif args[3] == '-b':
+		return len(args) >= MIN_OPTIONS
+	elif args[3] == '-s':
+		return len(args) == MIN_OPTIONS + 2
+	elif args[3] == '-d':
+		return len(args) >= MIN_OPTIONS - 1 and \
+		       len(args) <= MIN_OPTIONS + 1
+	elif args[3] == '-m':
+		return len(args) == MIN_OPTIONS - 1
+	elif args[3] in ('-a', '-gr', '-gc', '-p'):
+		return len(args) >= MIN_OPTIONS
+	elif args[3] == '-u':
+		return len(args) == MIN_OPTIONS
+	elif args[3] == '-lr':
+		return len(args) >= MIN_OPTIONS - 1 and \
+		       len(args) <= MIN_OPTIONS
 
 #        Method: validatePort()
 #   Description: Validates the command line port argument.
@@ -60,31 +104,68 @@ def validateFileName(fname):
 		return True
 	return False
 
+#        Method: validatePath()
+#   Description: Validates a relative path within a directory tree.
+#    Parameters: path - The path argument.
+# Preconditions: None.
+#       Returns: Returns True if valid, False otherwise.
+def validatePath(path):
+	# The path must stay beneath the directory it is relative to.
+	if not path or path.startswith('/') or path.find('\x00') != -1:
+		return False
+	for part in path.split('/'):
+		if part in ('', '.', '..'):
+			return False
+	return True
+
+#        Method: validateStripes()
+#   Description: Validates the stripe count argument.
+#    Parameters: num - The argument string.
+# Preconditions: None.
+#       Returns: Returns True if valid, False otherwise.
+def validateStripes(num):
+	return num.isdigit() and int(num) >= 1 and int(num) <= MAX_STRIPES
+
+#        Method: validateOffset()
+#   Description: Validates a byte offset or length argument.
+#    Parameters: num - The argument string.
+# Preconditions: None.
+#       Returns: The value, or -1 if the argument is invalid.
+def validateOffset(num):
+	if not num.isdigit():
+		return -1
+	return int(num)
+
 #        Method: validateFileExistence()
-#   Description: Determines whether a file already exists in the directory.
+#   Description: Determines whether a file already exists in the directory,
+#                and if so whether to overwrite it, resume it or skip it.
 #    Parameters: fname - The file name argument.
 # Preconditions: None.
-#       Returns: True if the file does not exist (or the user wants to overwrite
-#                the file), False otherwise.
+#       Returns: The offset to write the file from: 0 if the file does not
+#                exist or the user wants to overwrite it, the current file
+#                size if the user wants to resume it, or -1 otherwise.
 def validateFileExistence(fname):
 	usrInput = ''
 	
 	# If the file already exists, prompt the user. 
 	if os.path.isfile('./' + fname):
 		print("Warning: A file with this name already exists.")
-		sys.stdout.write("Would you like to overwrite it? (y/n): ")
+		sys.stdout.write("Would you like to overwrite it, resume " + \
+				 "it, or cancel? (y/r/n): ")
 		sys.stdout.flush()
 		while True:
 			usrInput = raw_input().strip()	
 			if len(usrInput) > 0 and (usrInput[0] == "y" or
-				usrInput[0] == "n"):
+				usrInput[0] == "r" or usrInput[0] == "n"):
 				break
 			sys.stdout.write("Please enter a valid command: ")	
 			sys.stdout.flush()
-		# If the user opts to overwrite, return True. False otherwise.	
+		# Overwrite from the start, or resume from the end of the
+		# partial file.
 		if usrInput[0] == "y":
-			return True
+			return 0
+		elif usrInput[0] == "r":
+			return os.path.getsize('./' + fname)
 		else:
-			return False
-	return True
-	
+			return -1
+	return 0
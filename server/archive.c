@@ -0,0 +1,257 @@
+/*******************************************************************************
+*      Filename: archive.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Produces the 'a' archive reply one page at a time. Every
+*                regular file in the directory whose name matches the
+*                request's pattern is sent back to back, each preceded by a
+*                member header: the 2-byte name length, the 8-byte size, the
+*                4-byte mode and the name itself. A member larger than the
+*                rest of a page carries on in the next one, and the directory
+*                walk resumes from its cursor. A recursive archive covers the
+*                whole tree below a directory in depth-first order, with a
+*                member for each directory and paths for names.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include "archive.h"
+
+/*******************************************************************************
+*      Function: _addContents()
+*   Description: Reads as much of the current member as fits into a page,
+*                closing the member once it has all been read. If the file
+*                shrank since its header was sent, the rest is zero filled
+*                so the archive stays in step.
+*    Parameters: struct ClientCmd *cmd - The archive command.
+*                struct DynBuf *page - The page being built.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _addContents(struct ClientCmd *cmd, struct DynBuf *page) {
+    ssize_t status;
+    size_t len;
+
+    while (cmd->archFD != -1 && page->size < PAGE_LEN) {
+        len = PAGE_LEN - page->size;
+        if ((off_t) len > cmd->archLeft) {
+            len = cmd->archLeft;
+        }
+        dynBufReserve(page, page->size + len);
+        status = len ? read(cmd->archFD, page->buffer + page->size, len) : 0;
+        if (status <= 0 && len) {
+            if (status == -1) {
+                perror("ftserver: read");
+            }
+            memset(page->buffer + page->size, 0, len);
+            status = len;
+        }
+        page->size += status;
+        cmd->archLeft -= status;
+        if (cmd->archLeft == 0) {
+            close(cmd->archFD);
+            cmd->archFD = -1;
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _addHeader()
+*   Description: Adds a member header and name to a page.
+*    Parameters: struct DynBuf *page - The page being built.
+*                const char *name - The member name.
+*                off_t size - The member size.
+*                mode_t mode - The member's file type and mode.
+* Preconditions: The name is shorter than 64 KiB.
+*       Returns: None.
+*******************************************************************************/
+
+void _addHeader(struct DynBuf *page, const char *name, off_t size,
+                mode_t mode) {
+    char header[ARCH_HDR_LEN];
+    size_t nameLen = strlen(name);
+
+    intToBytes(header, 2, nameLen);
+    intToBytes(header + 2, 8, size);
+    intToBytes(header + 10, 4, mode & (S_IFMT | 07777));
+    dynBufAddBytes(page, header, ARCH_HDR_LEN);
+    dynBufAddBytes(page, name, nameLen);
+}
+
+/*******************************************************************************
+*      Function: _addMember()
+*   Description: Starts a directory entry as the next archive member if it
+*                is a regular file whose name matches the command's pattern,
+*                and adds as much of its contents as fits.
+*    Parameters: struct ClientCmd *cmd - The archive command.
+*                struct LinuxDirent64 *d - The directory entry.
+*                struct DynBuf *page - The page being built.
+* Preconditions: cmd->dirFD is open and no member is being read.
+*       Returns: None.
+*******************************************************************************/
+
+void _addMember(struct ClientCmd *cmd, struct LinuxDirent64 *d,
+                struct DynBuf *page) {
+    struct stat st;
+    int fd;
+
+    if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN) {
+        return;
+    }
+    if (reservedName(d->d_name) ||
+        (cmd->fName[0] && fnmatch(cmd->fName, d->d_name, 0) != 0)) {
+        return;
+    }
+    if (strlen(d->d_name) >= FNAME_MAX) {
+        return;
+    }
+    fd = openat(cmd->dirFD, d->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    _addHeader(page, d->d_name, st.st_size, st.st_mode);
+    cmd->archFD = fd;
+    cmd->archLeft = st.st_size;
+    _addContents(cmd, page);
+}
+
+/*******************************************************************************
+*      Function: _treePage()
+*   Description: Reads the next page of a recursive archive. The walk of the
+*                tree is started on the first call, and the root directory
+*                is the first member unless it is the server directory. A
+*                file that can't be opened, or is no longer a regular file,
+*                is left out.
+*    Parameters: struct ClientCmd *cmd - The archive command. cmd->fName
+*                                        holds the tree's root directory.
+*                struct DynBuf *page - The buffer to hold the page.
+* Preconditions: page has been initialized and is empty.
+*       Returns: 'r' on success, 'e' if the root isn't a directory.
+*******************************************************************************/
+
+char _treePage(struct ClientCmd *cmd, struct DynBuf *page) {
+    struct TreeEnt *e;
+    struct stat st;
+    int fd;
+
+    if (!cmd->walk) {
+        cmd->archFD = -1;
+        cmd->walk = initTreeWalk(cmd->fName);
+        if (!cmd->walk) {
+            clearDynBuf(page);
+            dynBufAddStr(page, "FILE NOT FOUND");
+            cmd->pagesDone = 1;
+            return 'e';
+        }
+        /* The root comes first, so the client can create it */
+        fd = cmd->fName[0] ? treeOpen(cmd->fName, O_RDONLY | O_DIRECTORY) :
+                             -1;
+        if (fd != -1) {
+            if (fstat(fd, &st) == 0) {
+                _addHeader(page, cmd->fName, 0, st.st_mode);
+            }
+            close(fd);
+        }
+    }
+
+    _addContents(cmd, page);
+
+    while (page->size + ARCH_HDR_LEN + PATH_MAX <= PAGE_LEN) {
+        e = treeWalkNext(cmd->walk);
+        if (!e) {
+            cmd->pagesDone = 1;
+            break;
+        }
+        if (S_ISDIR(e->mode)) {
+            _addHeader(page, e->path, 0, e->mode);
+            continue;
+        }
+        fd = treeOpen(e->path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            continue;
+        }
+        _addHeader(page, e->path, st.st_size, st.st_mode);
+        cmd->archFD = fd;
+        cmd->archLeft = st.st_size;
+        _addContents(cmd, page);
+    }
+
+    return 'r';
+}
+
+/*******************************************************************************
+*      Function: archivePage()
+*   Description: Reads the next page of an archive, or of a recursive archive
+*                if the client asked for one. The directory is opened on the
+*                first call. A page is filled with the rest of any
+*                member cut off by the last page, then with further members,
+*                until it is full or the directory has been walked.
+*    Parameters: struct ClientCmd *cmd - The archive command. cmd->fName
+*                                        holds the name pattern, if any.
+*                struct DynBuf *page - The buffer to hold the page.
+* Preconditions: page has been initialized and is empty. cmd->dirFD is -1 or
+*                was opened by an earlier call.
+*       Returns: 'r' on success, 'e' if the directory can't be read. Sets
+*                cmd->pagesDone once the last member has been read.
+*******************************************************************************/
+
+char archivePage(struct ClientCmd *cmd, struct DynBuf *page) {
+    char buf[DIRENT_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct LinuxDirent64))));
+    struct LinuxDirent64 *d;
+    long status;
+    long pos;
+
+    if (cmd->flags & FLAG_RECURSIVE) {
+        return _treePage(cmd, page);
+    }
+    if (cmd->dirFD == -1) {
+        cmd->archFD = -1;
+        cmd->dirFD = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cmd->dirFD == -1) {
+            clearDynBuf(page);
+            dynBufAddStr(page, "NO DIRECTORY CONTENTS");
+            cmd->pagesDone = 1;
+            return 'e';
+        }
+    }
+
+    _addContents(cmd, page);
+
+    /* Stop while there is still room for a member header, so a page never
+     * outgrows a chunk */
+    while (page->size + ARCH_HDR_LEN + FNAME_MAX <= PAGE_LEN &&
+           !cmd->pagesDone) {
+        status = syscall(SYS_getdents64, cmd->dirFD, buf, sizeof(buf));
+        if (status <= 0) {
+            if (status == -1) {
+                perror("ftserver: getdents64");
+            }
+            cmd->pagesDone = 1;
+            break;
+        }
+        for (pos = 0; pos < status &&
+             page->size + ARCH_HDR_LEN + FNAME_MAX <= PAGE_LEN;
+             pos += d->d_reclen) {
+            d = (struct LinuxDirent64 *) (buf + pos);
+            _addMember(cmd, d, page);
+            cmd->cursor = d->d_off;
+        }
+        /* Entries past the end of a full page are read again next time */
+        if (pos < status && lseek(cmd->dirFD, cmd->cursor, SEEK_SET) == -1) {
+            perror("ftserver: lseek");
+            cmd->pagesDone = 1;
+        }
+    }
+
+    return 'r';
+}
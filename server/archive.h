@@ -0,0 +1,16 @@
+/*******************************************************************************
+*      Filename: archive.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for archive.c. Please see archive.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "dirlist.h"
+
+char archivePage(struct ClientCmd *, struct DynBuf *);
+
+#endif
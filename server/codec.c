@@ -0,0 +1,124 @@
+/*******************************************************************************
+*      Filename: codec.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: On-the-fly deflate compression of reply pages. Each page is
+*                compressed with a sync flush so the client can inflate it as
+*                soon as it arrives. A sample of every page is checked for
+*                entropy first: pages that look random, such as media or data
+*                that is already compressed, are left alone and never enter
+*                the deflate stream.
+*******************************************************************************/
+
+#include "codec.h"
+
+/*******************************************************************************
+*      Function: _sampleEntropy()
+*   Description: Estimates the entropy of a buffer from evenly spaced slices.
+*    Parameters: const char *buf - The buffer.
+*                size_t len - The buffer length.
+* Preconditions: len is positive.
+*       Returns: The Shannon entropy of the sample, in bits per byte.
+*******************************************************************************/
+
+double _sampleEntropy(const char *buf, size_t len) {
+    unsigned int counts[256] = { 0 };
+    size_t i, j, start, sliceLen, total = 0;
+    double p, entropy = 0;
+
+    sliceLen = len < SAMPLE_SLICE_LEN ? len : SAMPLE_SLICE_LEN;
+    for (i = 0; i < SAMPLE_SLICES; i++) {
+        start = (len - sliceLen) / (SAMPLE_SLICES - 1) * i;
+        for (j = 0; j < sliceLen; j++) {
+            counts[(unsigned char) buf[start + j]]++;
+        }
+        total += sliceLen;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (counts[i]) {
+            p = (double) counts[i] / total;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+/*******************************************************************************
+*      Function: initCodec()
+*   Description: Creates the compression state for a reply.
+*    Parameters: struct BufPool *bufs - The pool the output buffer comes from.
+* Preconditions: None.
+*       Returns: The codec.
+*******************************************************************************/
+
+struct Codec *initCodec(struct BufPool *bufs) {
+    struct Codec *codec;
+
+    codec = calloc(1, sizeof(struct Codec));
+    assert(codec);
+    if (deflateInit(&codec->zs, CODEC_LEVEL) != Z_OK) {
+        fprintf(stderr, "ftserver: deflateInit failed\n");
+        exit(2);
+    }
+    bufPoolGet(bufs, &codec->out);
+
+    return codec;
+}
+
+/*******************************************************************************
+*      Function: codecCompress()
+*   Description: Compresses a page in place, unless its entropy shows it
+*                won't shrink.
+*    Parameters: struct Codec *codec - The reply's codec.
+*                struct DynBuf *page - The page.
+* Preconditions: None.
+*       Returns: 1 if the page now holds compressed data, 0 if it was left
+*                as it was.
+*******************************************************************************/
+
+int codecCompress(struct Codec *codec, struct DynBuf *page) {
+    struct DynBuf swap;
+    size_t bound;
+
+    if (page->size == 0 ||
+        _sampleEntropy(page->buffer, page->size) > ENTROPY_MAX) {
+        return 0;
+    }
+
+    /* A sync flush can add a few bytes beyond the deflate bound */
+    bound = deflateBound(&codec->zs, page->size) + 16;
+    clearDynBuf(&codec->out);
+    dynBufReserve(&codec->out, bound);
+
+    codec->zs.next_in = (unsigned char *) page->buffer;
+    codec->zs.avail_in = page->size;
+    codec->zs.next_out = (unsigned char *) codec->out.buffer;
+    codec->zs.avail_out = codec->out.cap;
+    if (deflate(&codec->zs, Z_SYNC_FLUSH) != Z_OK ||
+        codec->zs.avail_in != 0) {
+        fprintf(stderr, "ftserver: deflate failed\n");
+        exit(2);
+    }
+    codec->out.size = codec->out.cap - codec->zs.avail_out;
+
+    /* Hand the compressed bytes to the page and keep its buffer for reuse */
+    swap = *page;
+    *page = codec->out;
+    codec->out = swap;
+    return 1;
+}
+
+/*******************************************************************************
+*      Function: freeCodec()
+*   Description: Releases a codec.
+*    Parameters: struct Codec *codec - The codec.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void freeCodec(struct Codec *codec) {
+    deflateEnd(&codec->zs);
+    freeDynBuf(&codec->out);
+    free(codec);
+}
@@ -0,0 +1,37 @@
+/*******************************************************************************
+*      Filename: codec.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for codec.c. Please see codec.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "dyn_buffer.h"
+
+#define CODEC_LEVEL     Z_BEST_SPEED /* Deflate compression level */
+#define SAMPLE_SLICES   4       /* Slices of a page sampled for entropy */
+#define SAMPLE_SLICE_LEN 1024   /* Bytes per sampled slice */
+#define ENTROPY_MAX     7.2     /* Bits per byte above which pages are sent
+                                 * uncompressed */
+
+/* The compression state of one reply. Pages are fed to a single deflate
+ * stream, so later pages can refer back to earlier ones. */
+struct Codec {
+    z_stream zs;           /* The deflate stream */
+    struct DynBuf out;     /* Compressed output of the latest page */
+};
+
+struct Codec *initCodec(struct BufPool *);
+int codecCompress(struct Codec *, struct DynBuf *);
+void freeCodec(struct Codec *);
+
+#endif
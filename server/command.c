@@ -9,21 +9,25 @@
 #include <stdio.h>
 
 #include "command.h"
+#include "archive.h"
+#include "delta.h"
+#include "dirlist.h"
+#include "upload.h"
 
 /*******************************************************************************
 *      Function: bytesToInt()
 *   Description: Converts a byte string to its big-endian integer value.
 *    Parameters: char *c - The byte string to be converted.
 *                int len - The length (in bytes) of the string.
-* Preconditions: The length of the string is in 1-4 inclusive. The byte string
+* Preconditions: The length of the string is in 1-8 inclusive. The byte string
 *                is of length len.
 *       Returns: The integer value.
 *******************************************************************************/
 
-int bytesToInt(char *c, int len) {
-    assert(len > 0 && len <= 4);
+unsigned long long bytesToInt(char *c, int len) {
+    assert(len > 0 && len <= 8);
 
-    int result = 0;
+    unsigned long long result = 0;
     int i;
 
     /* Shift result values left by one byte and fill in the gap */
@@ -40,17 +44,18 @@ int bytesToInt(char *c, int len) {
 *   Description: Converts an integer into a big-endian byte string.
 *    Parameters: char *c - The byte string to hold the final string.
 *                int wordSize - The number of elements in the byte string.
-*                int val - The value to convert.
-* Preconditions: c is able to hold wordSize elements. val is positive, and can
-*                be contained in wordSize * 8 bytes.
+*                unsigned long long val - The value to convert.
+* Preconditions: c is able to hold wordSize elements. val can be contained in
+*                wordSize * 8 bits.
 *       Returns: None.
 *******************************************************************************/
 
-void intToBytes(char *c, int wordSize, int val) {
-    assert(wordSize >0 && wordSize <= 4);
+void intToBytes(char *c, int wordSize, unsigned long long val) {
+    assert(wordSize >0 && wordSize <= 8);
 
-    int i, current;
-    int mask = 255; /* All bits in the lowest byte are set */
+    int i;
+    unsigned long long current;
+    unsigned long long mask = 255; /* All bits in the lowest byte are set */
 
     /* Obtain 8 bits by ANDing with the mask, and shift off the obtained
      * portion. */  
@@ -61,9 +66,31 @@ void intToBytes(char *c, int wordSize, int val) {
     }
 }
 
+/*******************************************************************************
+*      Function: requestHeaderLen()
+*   Description: Determines the length of a client header from its first
+*                bytes. A header starting with EXT_MAGIC is an extended
+*                header, which carries a request id and puts the connection in
+*                session mode; its second byte gives its version.
+*    Parameters: const char *hdr - The start of the header.
+* Preconditions: At least HEADER_LEN bytes of the header are available.
+*       Returns: The header length in bytes.
+*******************************************************************************/
+
+int requestHeaderLen(const char *hdr) {
+    if (hdr[0] != EXT_MAGIC) {
+        return HEADER_LEN;
+    }
+    return hdr[1] == 1 ? EXT_V1_HEADER_LEN : EXT_HEADER_LEN;
+}
+
 /*******************************************************************************
 *      Function: processHeader()
-*   Description: Unpacks a client command into a struct ClientCmd.
+*   Description: Unpacks a client command into a struct ClientCmd. Legacy
+*                headers hold the mode, data port and body length. Extended
+*                headers hold the magic byte, version, mode, flags (from
+*                version 2), request id and body length; their replies travel
+*                on the control connection, so there is no data port.
 *    Parameters: char *hdr - The header byte string.
 *                struct ClientCmd *cmd - The struct to hold the result.
 * Preconditions: The struct has been initialized. The header byte string 
@@ -72,6 +99,27 @@ void intToBytes(char *c, int wordSize, int val) {
 *******************************************************************************/
 
 void processHeader(char *hdr, struct ClientCmd *cmd) {
+    if (hdr[0] == EXT_MAGIC) {
+        cmd->dataPort = 0;
+        cmd->mode = hdr[2];
+        /* Reply in the client's version when it is older than ours */
+        if (hdr[1] == 1) {
+            cmd->version = 1;
+            cmd->flags = 0;
+            cmd->reqId = bytesToInt(&hdr[3], 4);
+            cmd->len = bytesToInt(&hdr[7], 4);
+        } else {
+            cmd->version = EXT_VERSION;
+            cmd->flags = hdr[3];
+            cmd->reqId = bytesToInt(&hdr[4], 4);
+            cmd->len = bytesToInt(&hdr[8], 4);
+        }
+        return;
+    }
+
+    cmd->version = 0;
+    cmd->flags = 0;
+    cmd->reqId = 0;
     /* Get the mode. */
     cmd->mode = hdr[0];
     /* Get the data port number */
@@ -80,23 +128,162 @@ void processHeader(char *hdr, struct ClientCmd *cmd) {
     cmd->len = bytesToInt(&hdr[3], 4);
 }
 
+/*******************************************************************************
+*      Function: processBody()
+*   Description: Unpacks a client command body into a struct ClientCmd. The
+*                body is the file name, preceded by a byte range when the
+*                request has FLAG_RANGE set, a listing cursor for a 'd'
+*                request and a stripe spec when it has FLAG_STRIPED set. A
+*                'u' request has a delta spec and the block signatures of
+*                the client's copy instead. A 'g' request with
+*                FLAG_IF_NONE_MATCH set starts with the hash of the client's
+*                copy. A 'p' request starts with the length of the file
+*                data that follows it. The file name of a 'd' request is its
+*                name pattern.
+*    Parameters: char *body - The body byte string.
+*                struct ClientCmd *cmd - The struct to hold the result.
+* Preconditions: processHeader() has filled in cmd. The body byte string is
+*                cmd->len bytes long.
+*       Returns: 0 on success, -1 if the body is malformed.
+*******************************************************************************/
+
+int processBody(char *body, struct ClientCmd *cmd) {
+    unsigned long long off = 0, len = 0;
+    unsigned int nameLen = cmd->len;
+
+    /* A delta body is a spec and the block signatures, then the name */
+    cmd->blockLen = 0;
+    cmd->nSigs = 0;
+    if (cmd->mode == 'u' && cmd->version >= 2) {
+        if (nameLen < DELTA_SPEC_LEN ||
+            (cmd->flags & (FLAG_RANGE | FLAG_STRIPED))) {
+            return -1;
+        }
+        cmd->blockLen = bytesToInt(body, 4);
+        cmd->nSigs = bytesToInt(body + 4, 4);
+        if (cmd->blockLen < DELTA_BLOCK_MIN ||
+            cmd->blockLen > DELTA_BLOCK_MAX ||
+            cmd->nSigs > DELTA_BLOCKS_MAX ||
+            nameLen - DELTA_SPEC_LEN < cmd->nSigs * DELTA_SIG_LEN) {
+            return -1;
+        }
+        body += DELTA_SPEC_LEN + cmd->nSigs * DELTA_SIG_LEN;
+        nameLen -= DELTA_SPEC_LEN + cmd->nSigs * DELTA_SIG_LEN;
+    }
+    /* A put body is the length of the data, then the name */
+    cmd->putLen = 0;
+    if (cmd->mode == 'p' && cmd->version >= 2) {
+        if (nameLen < PUT_SPEC_LEN ||
+            (cmd->flags & (FLAG_RANGE | FLAG_STRIPED))) {
+            return -1;
+        }
+        len = bytesToInt(body, PUT_SPEC_LEN);
+        if (len > (unsigned long long) LLONG_MAX) {
+            return -1;
+        }
+        cmd->putLen = len;
+        len = 0;
+        body += PUT_SPEC_LEN;
+        nameLen -= PUT_SPEC_LEN;
+    }
+    if (cmd->flags & FLAG_IF_NONE_MATCH) {
+        if (cmd->mode != 'g' || nameLen < MATCH_LEN) {
+            return -1;
+        }
+        memcpy(cmd->match, body, MATCH_LEN);
+        body += MATCH_LEN;
+        nameLen -= MATCH_LEN;
+    }
+    if (cmd->flags & FLAG_RANGE) {
+        if (nameLen < RANGE_LEN) {
+            return -1;
+        }
+        off = bytesToInt(body, 8);
+        len = bytesToInt(body + 8, 8);
+        /* Reject ranges that don't fit in an off_t */
+        if (off > (unsigned long long) LLONG_MAX ||
+            len > (unsigned long long) LLONG_MAX - off) {
+            return -1;
+        }
+        body += RANGE_LEN;
+        nameLen -= RANGE_LEN;
+    }
+    /* A detailed listing body is a cursor and an optional name pattern */
+    cmd->cursor = 0;
+    if (cmd->mode == 'd' && cmd->version >= 2) {
+        if (nameLen < CURSOR_LEN) {
+            return -1;
+        }
+        cmd->cursor = bytesToInt(body, CURSOR_LEN);
+        if (cmd->cursor < 0) {
+            return -1;
+        }
+        body += CURSOR_LEN;
+        nameLen -= CURSOR_LEN;
+    }
+    cmd->stripes = 0;
+    if (cmd->flags & FLAG_STRIPED) {
+        if (nameLen < STRIPE_SPEC_LEN) {
+            return -1;
+        }
+        cmd->dataPort = bytesToInt(body, 2);
+        cmd->stripes = bytesToInt(body + 2, 1);
+        if (cmd->dataPort == 0 || cmd->stripes == 0 ||
+            cmd->stripes > MAX_STRIPES) {
+            return -1;
+        }
+        body += STRIPE_SPEC_LEN;
+        nameLen -= STRIPE_SPEC_LEN;
+    }
+    if (nameLen >= FNAME_MAX) {
+        return -1;
+    }
+
+    cmd->rangeOff = off;
+    cmd->rangeLen = len;
+    memset(cmd->fName, 0, sizeof(cmd->fName));
+    memcpy(cmd->fName, body, nameLen);
+    return 0;
+}
+
 /*******************************************************************************
 *      Function: packHeader()
-*   Description: Packs a header string.
+*   Description: Packs a header string. Commands that arrived with an extended
+*                header get an extended reply carrying their request id; from
+*                version 2 the reply also carries flags and a 64-bit length.
 *    Parameters: struct ClientCmd *cmd - The struct containing a client cmd.
 *                char mode - The returning mode of the struct (r for a reply,
 *                            or e for an error message).
+*                char flags - The reply flags. With FLAG_CHUNKED the body
+*                             follows in chunks and the length is only a
+*                             hint, or zero.
 *                char *header - The header string to be packed.
-*                char *body - The data string reply.
+*                unsigned long long bodyLen - The length of the data reply.
 * Preconditions: cmd contains a client command. Mode contains the reply mode.
-*                header is a string long enough to contain the header. body
-*                contains the application data to be sent back.
-*       Returns: None.
+*                header is a string long enough to contain the header. Legacy
+*                and version 1 replies have bodyLen <= BODY_LEN_MAX and no
+*                flags.
+*       Returns: The length of the packed header.
 *******************************************************************************/
 
-void packHeader(struct ClientCmd *cmd, char mode, char *header, char *body,
-                int bodyLen) {
+int packHeader(struct ClientCmd *cmd, char mode, char flags, char *header,
+               unsigned long long bodyLen) {
     header[0] = mode;
+
+    if (cmd->version == 1) {
+        header[1] = 1;
+        intToBytes(&header[2], 4, cmd->reqId);
+        intToBytes(&header[6], 4, bodyLen);
+        return EXT_V1_REPLY_LEN;
+    }
+    if (cmd->version) {
+        header[1] = EXT_VERSION;
+        header[2] = flags;
+        intToBytes(&header[3], 4, cmd->reqId);
+        intToBytes(&header[7], 8, bodyLen);
+        return EXT_REPLY_LEN;
+    }
+
     /* If the mode is a reply, return the data port number. This isn't strictly
      * necessary, but could be used for additional verification on the client 
      * side. */
@@ -106,6 +293,69 @@ void packHeader(struct ClientCmd *cmd, char mode, char *header, char *body,
 
     /* Pack the data length */
     intToBytes(&header[3], 4, bodyLen);
+
+    return HEADER_LEN;
+}
+
+/*******************************************************************************
+*      Function: packChunkHeader()
+*   Description: Packs the length prefix of one chunk of a chunked reply. A
+*                zero-length chunk terminates the reply.
+*    Parameters: char *header - The CHUNK_HDR_LEN byte prefix to be packed.
+*                unsigned int chunkLen - The length of the chunk.
+* Preconditions: header can hold CHUNK_HDR_LEN bytes.
+*       Returns: None.
+*******************************************************************************/
+
+void packChunkHeader(char *header, unsigned int chunkLen) {
+    intToBytes(header, CHUNK_HDR_LEN, chunkLen);
+}
+
+/*******************************************************************************
+*      Function: packChecksum()
+*   Description: Packs the trailer that follows the terminating chunk of a
+*                checksummed reply.
+*    Parameters: char *trailer - The CHECKSUM_LEN byte trailer to be packed.
+*                unsigned long checksum - The CRC-32 of the reply body.
+* Preconditions: trailer can hold CHECKSUM_LEN bytes.
+*       Returns: None.
+*******************************************************************************/
+
+void packChecksum(char *trailer, unsigned long checksum) {
+    intToBytes(trailer, CHECKSUM_LEN, checksum);
+}
+
+/*******************************************************************************
+*      Function: packStripeHeader()
+*   Description: Packs the header that starts each data connection of a
+*                striped reply, giving the file range the connection carries.
+*    Parameters: char *header - The STRIPE_HDR_LEN byte header to be packed.
+*                off_t off - The offset of the stripe in the file.
+*                off_t len - The length of the stripe.
+* Preconditions: header can hold STRIPE_HDR_LEN bytes.
+*       Returns: The length of the packed header.
+*******************************************************************************/
+
+int packStripeHeader(char *header, off_t off, off_t len) {
+    intToBytes(header, 8, off);
+    intToBytes(header + 8, 8, len);
+    return STRIPE_HDR_LEN;
+}
+
+/*******************************************************************************
+*      Function: reservedName()
+*   Description: Checks whether a name in the server directory belongs to
+*                one of the server's own files: the manifest, its temporary
+*                file, or a file being stored by a put. These are never
+*                listed or served.
+*    Parameters: const char *name - The file name.
+* Preconditions: None.
+*       Returns: 1 if the name is reserved, 0 otherwise.
+*******************************************************************************/
+
+int reservedName(const char *name) {
+    return strcmp(name, MF_FILE) == 0 || strcmp(name, MF_TMP_FILE) == 0 ||
+           strncmp(name, UP_TMP_PREFIX, strlen(UP_TMP_PREFIX)) == 0;
 }
 
 /*******************************************************************************
@@ -120,6 +370,7 @@ void packHeader(struct ClientCmd *cmd, char mode, char *header, char *body,
 char generateList(struct DynBuf *msgBuf) {
     DIR *dirp;
     struct dirent *ep;
+    struct stat st;
     const char *dirName;
     int count = 0;
     
@@ -127,19 +378,33 @@ char generateList(struct DynBuf *msgBuf) {
     dirp = opendir("./");
     if (!dirp) {
         perror("ftserver: opendir");
-        exit(3);
+        clearDynBuf(msgBuf);
+        dynBufAddStr(msgBuf, "UNABLE TO READ DIRECTORY");
+        return 'e';
     } 
 
     /* Read every entry in the directory and add all regular file names to 
      * the DynBuf string */
     while (ep = readdir(dirp)) {
         dirName = ep->d_name;
-        if (ep->d_type == DT_REG) {
+        if (reservedName(dirName)) {
+            continue;
+        }
+        /* Some filesystems don't report entry types */
+        if (ep->d_type == DT_REG ||
+            (ep->d_type == DT_UNKNOWN &&
+             fstatat(dirfd(dirp), dirName, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+             S_ISREG(st.st_mode))) {
             dynBufAddStr(msgBuf, dirName);
             dynBufAdd(msgBuf, '\n');
             count++;
         }
     }
+
+    /* Close the directory */
+    if (closedir(dirp) != 0) {
+        perror("ftserver: closedir");
+    }
    
     /* If we're unable to read anything into the buffer, exit with an error. */
     if (count == 0) {
@@ -148,96 +413,330 @@ char generateList(struct DynBuf *msgBuf) {
         return 'e';
     }
 
-    /* Close the directory */
-    if (closedir(dirp) != 0) {
-        perror("ftserver: closedir");
-        exit(3);
-    }
-
     return 'r';
 }
 
 /*******************************************************************************
-*      Function: retrieveFile()
-*   Description: Performs the '-g' mode user command by attempting to read a
-*                file's contents into a byte string.
-*    Parameters: struct DynBuf *msgBug - The buffer to hold the file data.
-*                const char *fName - The file name.
+*      Function: _fileError()
+*   Description: Abandons a '-g' request, closing or releasing its file and
+*                placing an error message in the buffer.
+*    Parameters: struct DynBuf *msgBuf - The buffer to hold the message.
+*                struct ClientCmd *cmd - The client command struct.
+*                int fd - The open file, or -1.
+*                const char *msg - The error message.
 * Preconditions: msgBuf has been initialized.
-*       Returns: 'r' if the command succeeds, 'e' otherwise.
+*       Returns: 'e'.
 *******************************************************************************/
 
-char retrieveFile(struct DynBuf *msgBuf, const char *fName) {
-    FILE *fp;
-    int i, len;
- 
-    /* Open the file for reading */
-    fp = fopen(fName, "r");
-    /* If the file can't be opened, return an error and place the error 
-     * message in the buffer */
-    if (!fp) {
+char _fileError(struct DynBuf *msgBuf, struct ClientCmd *cmd, int fd,
+                const char *msg) {
+    if (fd != -1) {
+        close(fd);
+    }
+    if (cmd->cached) {
+        fileCacheRelease(cmd->cached);
+        cmd->cached = NULL;
+    }
+    clearDynBuf(msgBuf);
+    dynBufAddStr(msgBuf, msg);
+    return 'e';
+}
+
+/*******************************************************************************
+*      Function: _readSmallFile()
+*   Description: Opens, reads and closes a small file with a single
+*                io_uring_enter() call. The contents are added to the file
+*                cache if they fit, and otherwise kept in the message buffer
+*                to be sent from there.
+*    Parameters: struct DynBuf *msgBuf - The buffer to hold the contents.
+*                struct ClientCmd *cmd - The client command struct.
+*                struct FileCache *files - The hot file cache.
+*                struct Uring *uring - The io_uring backend.
+*                struct stat *st - The file's status.
+* Preconditions: The file is a regular file of at most UR_BUF_LEN bytes.
+*       Returns: 1 if the file was read, 0 if it must be opened instead.
+*******************************************************************************/
+
+int _readSmallFile(struct DynBuf *msgBuf, struct ClientCmd *cmd,
+                   struct FileCache *files, struct Uring *uring,
+                   struct stat *st) {
+    struct Ring *ring;
+    ssize_t len;
+
+    ring = uringGet(uring);
+    if (!ring) {
+        return 0;
+    }
+    /* A file that changed size since it was examined is opened normally */
+    len = uringReadFile(ring, cmd->fName);
+    if (len != st->st_size) {
+        uringPut(uring, ring);
+        return 0;
+    }
+    cmd->cached = fileCacheAdd(files, cmd->fName, -1, ring->buf, st);
+    if (!cmd->cached) {
         clearDynBuf(msgBuf);
-        dynBufAddStr(msgBuf, "FILE NOT FOUND");
-        return 'e';    
+        dynBufAddBytes(msgBuf, ring->buf, len);
+    }
+    uringPut(uring, ring);
+    return 1;
+}
+
+/*******************************************************************************
+*      Function: retrieveFile()
+*   Description: Performs the '-g' mode user command by opening the requested
+*                file for streaming. The file contents are not read here; the
+*                open descriptor and length are stored in the command struct
+*                and the data is sent straight from the file by the event
+*                loop. Hot files are served from the file cache instead,
+*                without being opened. With the io_uring backend, small files
+*                are read whole here and served from memory. Only the
+*                requested byte range is served. A client whose copy has the
+*                hash the manifest holds for the file is sent nothing.
+*    Parameters: struct DynBuf *msgBuf - The buffer to hold any error message.
+*                struct ClientCmd *cmd - The client command struct.
+*                struct FileCache *files - The hot file cache.
+*                struct Uring *uring - The io_uring backend, or NULL.
+*                struct Manifest *manifest - The content hash manifest.
+* Preconditions: msgBuf has been initialized. cmd->fName holds the file name.
+*       Returns: 'r' if the command succeeds, 'n' if the client's copy is
+*                current, 'e' otherwise. If the file is served from memory,
+*                msgBuf holds the requested range.
+*******************************************************************************/
+
+char retrieveFile(struct DynBuf *msgBuf, struct ClientCmd *cmd,
+                  struct FileCache *files, struct Uring *uring,
+                  struct Manifest *manifest) {
+    struct stat st;
+    int fd = -1, inBuf = 0;
+
+    if (reservedName(cmd->fName)) {
+        return _fileError(msgBuf, cmd, fd, "FILE NOT FOUND");
+    }
+
+    /* Look for the file's current version in the cache */
+    if (stat(cmd->fName, &st) == 0 && S_ISREG(st.st_mode)) {
+        if ((cmd->flags & FLAG_IF_NONE_MATCH) &&
+            manifestMatch(manifest, cmd->fName, &st, cmd->match)) {
+            clearDynBuf(msgBuf);
+            return 'n';
+        }
+        cmd->cached = fileCacheGet(files, cmd->fName, &st);
+        if (!cmd->cached && uring && !cmd->stripes &&
+            st.st_size <= UR_BUF_LEN &&
+            _readSmallFile(msgBuf, cmd, files, uring, &st)) {
+            inBuf = !cmd->cached;
+        }
+    }
+
+    if (!cmd->cached && !inBuf) {
+        /* Open the file for reading */
+        fd = open(cmd->fName, O_RDONLY);
+        /* If the file can't be opened, return an error and place the error 
+         * message in the buffer */
+        if (fd == -1) {
+            return _fileError(msgBuf, cmd, fd, "FILE NOT FOUND");
+        }
+        /* Only regular files can be streamed */
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            return _fileError(msgBuf, cmd, fd, "FILE NOT FOUND");
+        }
+        /* Cache the file if it fits; the mapping outlives the descriptor */
+        cmd->cached = fileCacheAdd(files, cmd->fName, fd, NULL, &st);
+        if (cmd->cached) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    /* Only version 2 replies have a 64-bit length field. Ranges are only
+     * sent by version 2 clients. */
+    if (cmd->version < 2 && (unsigned long long) st.st_size > BODY_LEN_MAX) {
+        return _fileError(msgBuf, cmd, fd, "FILE TOO LARGE");
+    }
+
+    /* Serve only the requested range, which may run up to the end of the
+     * file but not start past it */
+    if (cmd->rangeOff > st.st_size) {
+        return _fileError(msgBuf, cmd, fd, "INVALID RANGE");
     }
 
-    /* Seek to the end of the file, get the end position, and rewind to the
-     * beginning of the file */
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    rewind(fp);  
-  
-    /* Add the file data to the buffer */ 
-    for (i = 0; i < len; i++) {
-        dynBufAdd(msgBuf, (unsigned char) fgetc(fp));
+    cmd->fileFD = fd;
+    cmd->fileLen = st.st_size - cmd->rangeOff;
+    if (cmd->rangeLen && cmd->rangeLen < cmd->fileLen) {
+        cmd->fileLen = cmd->rangeLen;
+    }
+    if (cmd->cached) {
+        fileCachePrefetch(cmd->cached, cmd->rangeOff, cmd->fileLen);
     }
 
-    /* Close the file */
-    if (fclose(fp) != 0) {
-        perror("ftserver: fclose");
-        exit(3);
+    /* A file held in the buffer is trimmed to the range */
+    if (inBuf) {
+        memmove(msgBuf->buffer, msgBuf->buffer + cmd->rangeOff, cmd->fileLen);
+        msgBuf->size = cmd->fileLen;
     }
-    fp = NULL;
 
     return 'r'; 
 }
 
+/*******************************************************************************
+*      Function: filePage()
+*   Description: Reads the next page of a '-g' reply into a buffer, for
+*                replies that are processed before they are sent. The page
+*                is copied from the file cache if the file is cached.
+*    Parameters: struct ClientCmd *cmd - The client command struct.
+*                struct DynBuf *page - The buffer to hold the page.
+*                off_t off - The offset of the page within the served range.
+* Preconditions: retrieveFile() has succeeded. page is empty.
+*       Returns: The number of bytes read. Sets cmd->pagesDone once the end
+*                of the range is reached.
+*******************************************************************************/
+
+size_t filePage(struct ClientCmd *cmd, struct DynBuf *page, off_t off) {
+    size_t len = PAGE_LEN;
+    ssize_t status;
+
+    if ((off_t) len > cmd->fileLen - off) {
+        len = cmd->fileLen - off;
+    }
+    dynBufReserve(page, len);
+
+    if (cmd->cached) {
+        status = fileCacheCopy(cmd->cached, page->buffer, cmd->rangeOff + off,
+                               len);
+    } else {
+        status = pread(cmd->fileFD, page->buffer, len, cmd->rangeOff + off);
+    }
+    /* A read error or a truncated file ends the reply early */
+    if (status <= 0) {
+        if (status == -1) {
+            perror("ftserver: pread");
+        }
+        status = 0;
+    }
+
+    page->size = status;
+    if (status == 0 || off + status >= cmd->fileLen) {
+        cmd->pagesDone = 1;
+    }
+    return status;
+}
+
 /*******************************************************************************
 *      Function: handleCmd()
 *   Description: Performs the client's requested command.
 *    Parameters: struct ClientCmd *cmd - The client command struct.
 *                struct DynBuf *msgBuf - The outgoing message buffer.
+*                struct ListCache *lists - The directory listing cache.
+*                struct FileCache *files - The hot file cache.
+*                struct Uring *uring - The io_uring backend, or NULL.
+*                struct Manifest *manifest - The content hash manifest.
+*                struct Metrics *metrics - The server metrics.
 *                const char *clientHost - The client hostname.
 *                const char *serverPort - The server listening port.
 * Preconditions: The client hostname and server port are correct. The message
 *                buffer has been initialized. The client command struct contains
-*                the client command.
-*       Returns: 'r' if the command succeeds, 'e' otherwise.
+*                the client command, and a put command has its upload.
+*       Returns: 'r' if the command succeeds, 'n' if a conditional get
+*                finds the client's copy current, 'e' otherwise.
 *******************************************************************************/
 
 char handleCmd(struct ClientCmd *cmd, struct DynBuf *msgBuf, 
-               const char *clientHost, const char *serverPort) {
+               struct ListCache *lists, struct FileCache *files,
+               struct Uring *uring, struct Manifest *manifest,
+               struct Metrics *metrics, const char *clientHost,
+               const char *serverPort) {
+    struct FileCacheStats stats;
+    unsigned long long hashed;
     char returnMode;
+    char line[256];
+    int hashedFiles;
 
     assert(cmd);
     assert(msgBuf);
+    cmd->fileFD = -1;
+    cmd->cached = NULL;
+    cmd->fileLen = 0;
+    cmd->dirFD = -1;
+    cmd->archFD = -1;
+    cmd->walk = NULL;
+    cmd->delta = NULL;
+    cmd->pagesDone = 0;
     /* Process a 'get file' client request */
     if (cmd->mode == 'g') {
-        returnMode = retrieveFile(msgBuf, cmd->fName);
+        metricsAdd(metrics, M_GET_REQS, 1);
+        returnMode = retrieveFile(msgBuf, cmd, files, uring, manifest);
         /* If the request succeeds, output this. */
         if (returnMode == 'r') {
-            printf("Sending \"%s\" requested on port %d.\n", cmd->fName, 
-                   cmd->dataPort);
+            metricsAdd(metrics, M_FILES, 1);
+            printf("Sending \"%s\" requested on port %d%s.\n", cmd->fName, 
+                   cmd->dataPort, cmd->cached ? " from the file cache" : "");
+        /* A current copy is only told so */
+        } else if (returnMode == 'n') {
+            metricsAdd(metrics, M_UNCHANGED, 1);
+            printf("\"%s\" not modified. Sending no body to %s.\n",
+                   cmd->fName, clientHost);
         /* Otherwise, output failure */
         } else {
             printf("File not found. Sending error message to %s:%s.\n", 
                    clientHost, serverPort);
         }
+    /* Process the first page of a detailed listing, which only sessions
+     * can receive */
+    } else if (cmd->mode == 'd' && cmd->version >= 2) {
+        metricsAdd(metrics, M_DETAIL_REQS, 1);
+        returnMode = dirListPage(cmd, msgBuf);
+        if (returnMode == 'r') {
+            metricsAdd(metrics, M_LISTINGS, 1);
+            printf("Streaming directory details to %s.\n", clientHost);
+        } else {
+            printf("No directory contents. Sending error message to %s:%s.\n",
+                   clientHost, serverPort);
+        }
+    /* Process the first page of an archive, which only sessions can
+     * receive */
+    } else if (cmd->mode == 'a' && cmd->version >= 2) {
+        metricsAdd(metrics, M_GET_REQS, 1);
+        returnMode = archivePage(cmd, msgBuf);
+        if (returnMode == 'r') {
+            printf("Streaming archive of \"%s\" to %s.\n", cmd->fName,
+                   clientHost);
+        } else {
+            printf("No directory contents. Sending error message to %s:%s.\n",
+                   clientHost, serverPort);
+        }
+    /* Process the first page of a delta against the client's copy of a
+     * file, which only sessions can receive */
+    } else if (cmd->mode == 'u' && cmd->version >= 2) {
+        metricsAdd(metrics, M_GET_REQS, 1);
+        returnMode = deltaPage(cmd, msgBuf);
+        if (returnMode == 'r') {
+            metricsAdd(metrics, M_FILES, 1);
+            printf("Sending changes to \"%s\" in %u-byte blocks to %s.\n",
+                   cmd->fName, cmd->blockLen, clientHost);
+        } else {
+            printf("File not found. Sending error message to %s:%s.\n",
+                   clientHost, serverPort);
+        }
+    /* Process the first half of a put, which only sessions can send:
+     * the file is created and its data is received by the event loop */
+    } else if (cmd->mode == 'p' && cmd->version >= 2) {
+        metricsAdd(metrics, M_PUT_REQS, 1);
+        returnMode = openUpload(cmd, msgBuf);
+        if (returnMode == 'r') {
+            printf("Receiving \"%s\", %lld bytes, from %s.\n", cmd->fName,
+                   (long long) cmd->putLen, clientHost);
+        } else {
+            printf("Cannot store file. Sending error message to %s:%s.\n",
+                   clientHost, serverPort);
+        }
     /* Process a 'list directory' request */
     } else if (cmd->mode == 'l') {
-        returnMode = generateList(msgBuf);
+        metricsAdd(metrics, M_LIST_REQS, 1);
+        returnMode = listCacheGet(lists, msgBuf);
         /* If the request succeeds, output this. */
         if (returnMode == 'r') {
+            metricsAdd(metrics, M_LISTINGS, 1);
             printf("Sending directory contents to %s:%d.\n", clientHost, 
                    cmd->dataPort);
         /* Otherwise, report failure */
@@ -245,6 +744,22 @@ char handleCmd(struct ClientCmd *cmd, struct DynBuf *msgBuf,
             printf("No directory contents. Sending error message to %s:%s.\n", 
                    clientHost, serverPort);
         }
+    /* Process a 'stats' request */
+    } else if (cmd->mode == 's') {
+        metricsAdd(metrics, M_STATS_REQS, 1);
+        clearDynBuf(msgBuf);
+        metricsDump(metrics, msgBuf);
+        fileCacheStats(files, &stats);
+        snprintf(line, sizeof(line), "File cache: %llu hits, %llu misses, "
+                 "%llu evictions, %zu of %zu bytes used\n", stats.hits,
+                 stats.misses, stats.evictions, stats.used, stats.budget);
+        dynBufAddStr(msgBuf, line);
+        manifestStats(manifest, &hashedFiles, &hashed);
+        snprintf(line, sizeof(line), "Manifest: %d files, %llu bytes "
+                 "hashed\n", hashedFiles, hashed);
+        dynBufAddStr(msgBuf, line);
+        returnMode = 'r';
+        printf("Sending server stats to %s.\n", clientHost);
     /* Process any other command as an error */
     } else {
         /* Add error text to the buffer */
@@ -268,11 +783,40 @@ char handleCmd(struct ClientCmd *cmd, struct DynBuf *msgBuf,
 *******************************************************************************/
 
 void printClientReq(struct ClientCmd *cmd) {
-    if (cmd->mode == 'g') {
+    if (cmd->version) {
+        printf("Session request %u: ", cmd->reqId);
+    }
+    if (cmd->mode == 'g' && cmd->stripes) {
+        printf("File \"%s\" requested in %d stripes on port %d.\n",
+               cmd->fName, cmd->stripes, cmd->dataPort);
+    } else if (cmd->mode == 'g' && (cmd->rangeOff || cmd->rangeLen)) {
+        printf("File \"%s\" bytes %lld+%lld requested on port %d.\n",
+               cmd->fName, (long long) cmd->rangeOff,
+               (long long) cmd->rangeLen, cmd->dataPort);
+    } else if (cmd->mode == 'g' && (cmd->flags & FLAG_IF_NONE_MATCH)) {
+        printf("File \"%s\" requested unless unchanged.\n", cmd->fName);
+    } else if (cmd->mode == 'g') {
         printf("File \"%s\" requested on port %d.\n", cmd->fName, 
                                                       cmd->dataPort); 
     } else if (cmd->mode == 'l') {
         printf("List directory requested on port %d.\n", cmd->dataPort);
+    } else if (cmd->mode == 'd' && (cmd->flags & FLAG_RECURSIVE)) {
+        printf("Recursive listing of \"%s\" requested.\n", cmd->fName);
+    } else if (cmd->mode == 'd') {
+        printf("Detailed listing requested from cursor %lld.\n",
+               (long long) cmd->cursor);
+    } else if (cmd->mode == 'a' && (cmd->flags & FLAG_RECURSIVE)) {
+        printf("Tree \"%s\" requested.\n", cmd->fName);
+    } else if (cmd->mode == 'a') {
+        printf("Archive of \"%s\" requested.\n", cmd->fName);
+    } else if (cmd->mode == 'u') {
+        printf("Changes to \"%s\" requested against %u blocks.\n",
+               cmd->fName, cmd->nSigs);
+    } else if (cmd->mode == 'p') {
+        printf("File \"%s\" of %lld bytes to be stored.\n", cmd->fName,
+               (long long) cmd->putLen);
+    } else if (cmd->mode == 's') {
+        printf("Server stats requested.\n");
     } else {
         printf("Unrecognized command requested on port %d.\n", cmd->dataPort);
     }
@@ -11,14 +11,71 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "dyn_buffer.h"
+#include "filecache.h"
+#include "listcache.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "treewalk.h"
+#include "uring.h"
 
 #define FNAME_MAX 255   /* Maximum filename length in bytes */
 #define HEADER_LEN 7    /* Application level header length */
+#define EXT_MAGIC 'x'   /* First byte of an extended (session) header */
+#define EXT_VERSION 2   /* Extended header version spoken by the server */
+#define EXT_V1_HEADER_LEN 11 /* Version 1 extended request header length */
+#define EXT_V1_REPLY_LEN 10  /* Version 1 extended reply header length */
+#define EXT_HEADER_LEN 12 /* Version 2 extended request header length */
+#define EXT_REPLY_LEN 15  /* Version 2 extended reply header length */
+#define STRIPE_HDR_LEN 16 /* Stripe header: 8-byte offset, 8-byte length */
+#define REPLY_HEADER_MAX STRIPE_HDR_LEN /* Longest reply or stripe header */
+#define BODY_LEN_MAX 0xFFFFFFFFULL /* Largest body a 4-byte length can carry */
+
+#define FLAG_CHUNKED 0x01 /* Request or reply uses chunked framing */
+#define FLAG_RANGE 0x02   /* Request body starts with a byte range */
+#define RANGE_LEN 16      /* Byte range length: 8-byte offset, 8-byte length */
+#define FLAG_STRIPED 0x04 /* Request body holds a stripe spec; the reply
+                           * body is striped over data connections */
+#define STRIPE_SPEC_LEN 3 /* Stripe spec: 2-byte data port, 1-byte count */
+#define MAX_STRIPES 16    /* Most data connections used by one reply */
+#define FLAG_COMPRESS 0x08 /* Request or reply uses deflated chunks */
+#define FLAG_CHECKSUM 0x10 /* Chunked reply ends with a checksum trailer */
+#define FLAG_RECURSIVE 0x20 /* Listing or archive covers the whole tree */
+#define FLAG_IF_NONE_MATCH 0x40 /* Request body starts with the hash of the
+                                 * client's copy of the file */
+#define MATCH_LEN MF_HASH_LEN /* Hash of the client's copy */
+#define CHECKSUM_LEN 4    /* CRC-32 of the body after the final chunk */
+#define CURSOR_LEN 8      /* Listing cursor at the start of a 'd' body */
+#define BODY_MAX (MATCH_LEN + RANGE_LEN + CURSOR_LEN + STRIPE_SPEC_LEN + \
+                  FNAME_MAX - 1)
+                          /* Longest request body */
+#define CHUNK_HDR_LEN 4   /* Length prefix of each chunk */
+#define CHUNK_LEN_MAX 1048576 /* Largest chunk the server sends */
+#define CHUNK_COMPRESSED 0x80000000U /* Chunk length bit marking deflated
+                                     * chunk data */
+#define PAGE_LEN CHUNK_LEN_MAX /* File bytes read per page of a paged reply */
+#define ARCH_HDR_LEN 14   /* Archive member header: 2-byte name length,
+                           * 8-byte size, 4-byte mode */
+#define DELTA_SPEC_LEN 8  /* Delta spec: 4-byte block length, 4-byte block
+                           * count */
+#define DELTA_SIG_LEN 20  /* Block signature: 4-byte weak hash, 16-byte
+                           * strong hash */
+#define DELTA_BLOCK_MIN 512     /* Shortest delta block */
+#define DELTA_BLOCK_MAX 1048576 /* Longest delta block */
+#define DELTA_BLOCKS_MAX 524288 /* Most blocks signed by a client */
+#define DELTA_BODY_MAX (DELTA_SPEC_LEN + DELTA_BLOCKS_MAX * DELTA_SIG_LEN + \
+                        FNAME_MAX - 1) /* Longest 'u' request body */
+#define PUT_SPEC_LEN 8    /* Put spec: 8-byte length of the data that follows
+                           * the request */
 
 /* Struct representing unpacked client command values */
 struct ClientCmd {
@@ -26,11 +83,50 @@ struct ClientCmd {
     unsigned int len;      /* Length of the data segment to follow the header */
     char mode;             /* Command mode */
     char fName[FNAME_MAX]; /* Requested file name */
+    char version;          /* Extended header version, 0 for a legacy header */
+    char flags;            /* Extended request flags */
+    unsigned int reqId;    /* Request id echoed back in extended replies */
+    int fileFD;            /* Open file to stream for a 'g' reply, or -1 */
+    struct FileEntry *cached; /* Cached file to send instead, or NULL */
+    off_t fileLen;         /* Length of the file to stream */
+    off_t rangeOff;        /* First file byte requested */
+    off_t rangeLen;        /* Bytes requested, or 0 for the rest of the file */
+    unsigned char match[MATCH_LEN]; /* Hash of the client's copy, with
+                            * FLAG_IF_NONE_MATCH */
+    int stripes;           /* Data connections requested, 0 if not striped */
+    off_t cursor;          /* Directory position a 'd' listing resumes at */
+    int dirFD;             /* Directory being listed for a 'd' reply, or
+                            * walked for an 'a' reply, or -1 */
+    struct TreeWalk *walk; /* Tree walked for a recursive reply, or NULL */
+    int archFD;            /* Archive member being read, or -1 */
+    off_t archLeft;        /* Bytes of the member still to be read */
+    struct DynBuf sigBody; /* Pooled copy of a 'u' request body, holding
+                            * the block signatures, or a NULL buffer */
+    unsigned int blockLen; /* Length of each signed block */
+    unsigned int nSigs;    /* Number of signed blocks */
+    struct Delta *delta;   /* Delta being sent for a 'u' reply, or NULL */
+    off_t putLen;          /* Bytes following a 'p' request */
+    struct Upload *upload; /* File being received for a 'p' request, or
+                            * NULL */
+    int pagesDone;         /* Nonzero once a paged reply has read its last
+                            * page */
 };
 
+unsigned long long bytesToInt(char *, int);
+void intToBytes(char *, int, unsigned long long);
+int requestHeaderLen(const char *);
 void processHeader(char *, struct ClientCmd *);
-void packHeader(struct ClientCmd *, char, char *, char *, int);
-char handleCmd(struct ClientCmd *, struct DynBuf *, const char *, const char *);
+int processBody(char *, struct ClientCmd *);
+int packHeader(struct ClientCmd *, char, char, char *, unsigned long long);
+void packChunkHeader(char *, unsigned int);
+void packChecksum(char *, unsigned long);
+int packStripeHeader(char *, off_t, off_t);
+size_t filePage(struct ClientCmd *, struct DynBuf *, off_t);
+int reservedName(const char *);
+char generateList(struct DynBuf *);
+char handleCmd(struct ClientCmd *, struct DynBuf *, struct ListCache *,
+               struct FileCache *, struct Uring *, struct Manifest *,
+               struct Metrics *, const char *, const char *);
 
 void printClientReq(struct ClientCmd *);
 
@@ -0,0 +1,373 @@
+/*******************************************************************************
+*      Filename: delta.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Produces the 'u' delta reply one page at a time. The client
+*                sends a signature of each whole block of its old copy of a
+*                file: an Adler-32 weak hash and an MD5 strong hash. A window
+*                of one block slides over the server's copy with the weak
+*                hash rolled a byte at a time; where it matches a block whose
+*                strong hash also matches, a copy of that block is sent in
+*                place of the data. Everything else is sent as literal bytes.
+*                Adjacent copies are merged into one op, and the reply ends
+*                with the file's size and MD5 so the client can check the
+*                file it rebuilt.
+*******************************************************************************/
+
+#include "delta.h"
+
+/*******************************************************************************
+*      Function: _hashWeak()
+*   Description: Picks the hash bucket of a weak hash.
+*    Parameters: struct Delta *d - The delta.
+*                unsigned long weak - The weak hash.
+* Preconditions: None.
+*       Returns: The bucket index.
+*******************************************************************************/
+
+unsigned int _hashWeak(struct Delta *d, unsigned long weak) {
+    return (unsigned int) ((weak ^ (weak >> 15)) * 2654435761UL) & d->mask;
+}
+
+/*******************************************************************************
+*      Function: _initDelta()
+*   Description: Opens the file and indexes the client's signatures by weak
+*                hash.
+*    Parameters: struct ClientCmd *cmd - The delta command.
+* Preconditions: processBody() has checked the signatures.
+*       Returns: The delta, or NULL if the file can't be opened.
+*******************************************************************************/
+
+struct Delta *_initDelta(struct ClientCmd *cmd) {
+    struct Delta *d;
+    struct stat st;
+    unsigned int i, bucket;
+    int fd;
+
+    if (reservedName(cmd->fName)) {
+        return NULL;
+    }
+    fd = open(cmd->fName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    d = calloc(1, sizeof(struct Delta));
+    assert(d);
+    d->fd = fd;
+    d->blockLen = cmd->blockLen;
+    d->nSigs = cmd->nSigs;
+    d->sigs = cmd->sigBody.buffer + DELTA_SPEC_LEN;
+    cmd->fileLen = st.st_size;
+
+    /* Most windows match no block. A bitmap small enough to stay in cache
+     * rules nearly all of them out before the buckets are looked at. */
+    for (d->mask = 1; d->mask < DELTA_FILTER_BITS * d->nSigs; d->mask <<= 1) {
+    }
+    d->filter = calloc(d->mask / 8 + 1, 1);
+    d->heads = calloc(d->mask, sizeof(unsigned int));
+    d->chain = calloc(d->nSigs ? d->nSigs : 1, sizeof(unsigned int));
+    d->weaks = calloc(d->nSigs ? d->nSigs : 1, sizeof(unsigned int));
+    assert(d->filter && d->heads && d->chain && d->weaks);
+    d->mask--;
+    /* Link in reverse, so each chain lists the earliest blocks first */
+    for (i = d->nSigs; i-- > 0;) {
+        d->weaks[i] = bytesToInt((char *) d->sigs + i * DELTA_SIG_LEN, 4);
+        bucket = _hashWeak(d, d->weaks[i]);
+        d->chain[i] = d->heads[bucket];
+        d->heads[bucket] = i + 1;
+        d->filter[bucket / 8] |= 1 << (bucket % 8);
+    }
+
+    for (i = 0; i < 256; i++) {
+        d->outWeak[i] = (unsigned long) d->blockLen * i % DELTA_WEAK_MOD;
+    }
+
+    /* Room for the held literal, a window and the next read */
+    d->cap = DELTA_LIT_MAX + 2 * (size_t) d->blockLen + DELTA_READ_LEN;
+    d->buf = malloc(d->cap);
+    assert(d->buf);
+    d->md = EVP_MD_CTX_new();
+    assert(d->md);
+    EVP_DigestInit_ex(d->md, EVP_md5(), NULL);
+
+    return d;
+}
+
+/*******************************************************************************
+*      Function: _fill()
+*   Description: Drops the file data that has already been sent and reads
+*                more behind the window.
+*    Parameters: struct Delta *d - The delta.
+* Preconditions: The window is shorter than a block plus a byte.
+*       Returns: None. Sets d->eof at the end of the file or on an error.
+*******************************************************************************/
+
+void _fill(struct Delta *d) {
+    ssize_t status;
+
+    memmove(d->buf, d->buf + d->lit, d->len - d->lit);
+    d->len -= d->lit;
+    d->pos -= d->lit;
+    d->lit = 0;
+
+    status = read(d->fd, d->buf + d->len, d->cap - d->len);
+    if (status <= 0) {
+        if (status == -1) {
+            perror("ftserver: read");
+        }
+        d->eof = 1;
+        return;
+    }
+    EVP_DigestUpdate(d->md, d->buf + d->len, status);
+    d->len += status;
+    d->size += status;
+}
+
+/*******************************************************************************
+*      Function: _addOp()
+*   Description: Adds an op header to a page.
+*    Parameters: struct DynBuf *page - The page being built.
+*                char op - The op.
+*                unsigned long long a - The op's first field.
+*                int aLen - The length of the first field.
+*                unsigned long long b - The op's second field.
+*                int bLen - The length of the second field, or 0.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _addOp(struct DynBuf *page, char op, unsigned long long a, int aLen,
+            unsigned long long b, int bLen) {
+    char hdr[1 + 8 + 8];
+
+    hdr[0] = op;
+    intToBytes(hdr + 1, aLen, a);
+    if (bLen) {
+        intToBytes(hdr + 1 + aLen, bLen, b);
+    }
+    dynBufAddBytes(page, hdr, 1 + aLen + bLen);
+}
+
+/*******************************************************************************
+*      Function: _flushCopy()
+*   Description: Adds the pending run of copied blocks to a page.
+*    Parameters: struct Delta *d - The delta.
+*                struct DynBuf *page - The page being built.
+* Preconditions: The page has room for an op header.
+*       Returns: None.
+*******************************************************************************/
+
+void _flushCopy(struct Delta *d, struct DynBuf *page) {
+    if (d->runLen) {
+        _addOp(page, DOP_COPY, d->runStart, 4, d->runLen, 4);
+        d->runLen = 0;
+    }
+}
+
+/*******************************************************************************
+*      Function: _flushLiteral()
+*   Description: Adds as many of the literal bytes before the window as fit
+*                to a page, after any pending copy.
+*    Parameters: struct Delta *d - The delta.
+*                struct DynBuf *page - The page being built.
+* Preconditions: The page has room for two op headers.
+*       Returns: Nonzero if every literal byte was added.
+*******************************************************************************/
+
+int _flushLiteral(struct Delta *d, struct DynBuf *page) {
+    size_t len = d->pos - d->lit;
+
+    if (len == 0) {
+        return 1;
+    }
+    _flushCopy(d, page);
+    if (len > PAGE_LEN - page->size - DELTA_OP_MAX) {
+        len = PAGE_LEN - page->size - DELTA_OP_MAX;
+    }
+    _addOp(page, DOP_LITERAL, len, 4, 0, 0);
+    dynBufAddBytes(page, d->buf + d->lit, len);
+    d->lit += len;
+
+    return d->lit == d->pos;
+}
+
+/*******************************************************************************
+*      Function: _findBlock()
+*   Description: Looks for a block of the client's copy that matches the
+*                window. A block continuing the pending copy is preferred,
+*                so runs of blocks stay in one op.
+*    Parameters: struct Delta *d - The delta.
+* Preconditions: d->weak is the hash of a whole-block window.
+*       Returns: The block index, or -1 if no block matches.
+*******************************************************************************/
+
+long _findBlock(struct Delta *d) {
+    unsigned char strong[EVP_MAX_MD_SIZE];
+    const char *sig;
+    unsigned int i;
+    long found = -1;
+    int hashed = 0;
+
+    for (i = d->heads[_hashWeak(d, d->weak)]; i; i = d->chain[i - 1]) {
+        if (d->weaks[i - 1] != d->weak) {
+            continue;
+        }
+        sig = d->sigs + (size_t) (i - 1) * DELTA_SIG_LEN;
+        /* The strong hash is only worked out once a weak hash matches */
+        if (!hashed) {
+            EVP_Digest(d->buf + d->pos, d->blockLen, strong, NULL, EVP_md5(),
+                       NULL);
+            hashed = 1;
+        }
+        if (memcmp(sig + 4, strong, DELTA_STRONG_LEN) != 0) {
+            continue;
+        }
+        if (d->runLen && i - 1 == d->runStart + d->runLen) {
+            return i - 1;
+        }
+        if (found == -1) {
+            found = i - 1;
+        }
+    }
+
+    return found;
+}
+
+/*******************************************************************************
+*      Function: _roll()
+*   Description: Slides the window one byte forward, updating its weak hash.
+*    Parameters: struct Delta *d - The delta.
+* Preconditions: The byte after the window has been read.
+*       Returns: None.
+*******************************************************************************/
+
+void _roll(struct Delta *d) {
+    long a = d->weak & 0xffff, b = d->weak >> 16;
+    unsigned char out = d->buf[d->pos];
+    unsigned char in = d->buf[d->pos + d->blockLen];
+
+    /* Both sums stay within one modulus of range, so they are corrected
+     * without division or a loop, either of which is slow next to the
+     * rest of the roll */
+    a += in - out;
+    a += a < 0 ? DELTA_WEAK_MOD : 0;
+    a -= a >= DELTA_WEAK_MOD ? DELTA_WEAK_MOD : 0;
+    b += a - 1 - (long) d->outWeak[out];
+    b += b < 0 ? DELTA_WEAK_MOD : 0;
+    b -= b >= DELTA_WEAK_MOD ? DELTA_WEAK_MOD : 0;
+    d->weak = ((unsigned long) b << 16) | a;
+    d->pos++;
+}
+
+/*******************************************************************************
+*      Function: deltaPage()
+*   Description: Reads the next page of a delta reply. The file is opened on
+*                the first call. A page holds DOP_COPY and DOP_LITERAL ops in
+*                file order, and the last page ends with DOP_END.
+*    Parameters: struct ClientCmd *cmd - The delta command.
+*                struct DynBuf *page - The buffer to hold the page.
+* Preconditions: page has been initialized and is empty.
+*       Returns: 'r' on success, 'e' if the file can't be opened. Sets
+*                cmd->pagesDone once the end op has been added.
+*******************************************************************************/
+
+char deltaPage(struct ClientCmd *cmd, struct DynBuf *page) {
+    unsigned char md5[EVP_MAX_MD_SIZE];
+    struct Delta *d = cmd->delta;
+    unsigned int bucket;
+    long block;
+
+    if (!d) {
+        d = cmd->delta = _initDelta(cmd);
+        if (!d) {
+            clearDynBuf(page);
+            dynBufAddStr(page, "FILE NOT FOUND");
+            cmd->pagesDone = 1;
+            return 'e';
+        }
+    }
+
+    while (page->size + 2 * DELTA_OP_MAX <= PAGE_LEN) {
+        /* Keep a block and the byte after it in the window */
+        if (d->len - d->pos <= d->blockLen && !d->eof) {
+            _fill(d);
+            continue;
+        }
+        /* The tail, shorter than a block, is sent as it is */
+        if (d->len - d->pos < d->blockLen) {
+            d->pos = d->len;
+            if (!_flushLiteral(d, page)) {
+                continue;
+            }
+            _flushCopy(d, page);
+            EVP_DigestFinal_ex(d->md, md5, NULL);
+            _addOp(page, DOP_END, d->size, 8, 0, 0);
+            dynBufAddBytes(page, (char *) md5, DELTA_STRONG_LEN);
+            cmd->pagesDone = 1;
+            break;
+        }
+
+        if (!d->summed) {
+            d->weak = adler32(1, (unsigned char *) d->buf + d->pos,
+                              d->blockLen);
+            d->summed = 1;
+        }
+        bucket = _hashWeak(d, d->weak);
+        block = d->filter[bucket / 8] & (1 << (bucket % 8)) ?
+                _findBlock(d) : -1;
+        if (block != -1) {
+            if (!_flushLiteral(d, page)) {
+                continue;
+            }
+            if (d->runLen && block != d->runStart + d->runLen) {
+                _flushCopy(d, page);
+            }
+            if (!d->runLen) {
+                d->runStart = block;
+            }
+            d->runLen++;
+            d->pos += d->blockLen;
+            d->lit = d->pos;
+            d->summed = 0;
+            continue;
+        }
+
+        /* No block matches here; the byte joins the literal */
+        if (d->pos - d->lit >= DELTA_LIT_MAX && !_flushLiteral(d, page)) {
+            continue;
+        }
+        if (d->len - d->pos > d->blockLen) {
+            _roll(d);
+        } else {
+            d->pos++;
+            d->summed = 0;
+        }
+    }
+
+    return 'r';
+}
+
+/*******************************************************************************
+*      Function: freeDelta()
+*   Description: Closes and frees a delta.
+*    Parameters: struct Delta *d - The delta.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void freeDelta(struct Delta *d) {
+    close(d->fd);
+    EVP_MD_CTX_free(d->md);
+    free(d->buf);
+    free(d->filter);
+    free(d->heads);
+    free(d->chain);
+    free(d->weaks);
+    free(d);
+}
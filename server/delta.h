@@ -0,0 +1,58 @@
+/*******************************************************************************
+*      Filename: delta.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for delta.c. Please see delta.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "command.h"
+
+#define DELTA_WEAK_MOD 65521    /* Adler-32 modulus of the rolling hash */
+#define DELTA_STRONG_LEN 16     /* MD5 of a block */
+#define DELTA_FILTER_BITS 8     /* Hash buckets per signature, at least */
+#define DELTA_LIT_MAX 262144    /* Most literal bytes held before they are
+                                 * added to a page */
+#define DELTA_READ_LEN 1048576  /* Bytes read from the file at a time */
+#define DELTA_OP_MAX 25         /* Longest op header: the end op */
+#define DOP_LITERAL 'L'         /* 4-byte length, then the bytes */
+#define DOP_COPY 'C'            /* 4-byte first block, 4-byte block count */
+#define DOP_END 'E'             /* 8-byte file size, then the file's MD5 */
+
+/* The state of a delta reply */
+struct Delta {
+    int fd;                /* The server's copy of the file */
+    unsigned int blockLen;
+    unsigned int nSigs;
+    const char *sigs;      /* The client's block signatures */
+    unsigned char *filter; /* Bit set for each hash bucket in use */
+    unsigned int *heads;   /* First signature + 1 in each hash bucket */
+    unsigned int *chain;   /* Next signature + 1 in the same bucket */
+    unsigned int *weaks;   /* Weak hash of each signature */
+    unsigned int mask;     /* Hash bucket count - 1 */
+    char *buf;             /* File data around the window */
+    size_t cap;            /* Length of buf */
+    size_t len;            /* Bytes held in buf */
+    size_t lit;            /* Start of the literal bytes not yet sent */
+    size_t pos;            /* Start of the window */
+    int eof;               /* Nonzero once the file has been read */
+    unsigned long weak;    /* Rolling hash of the window */
+    unsigned long outWeak[256]; /* What each byte leaving the window
+                            * takes off the hash's second sum */
+    int summed;            /* Nonzero if weak matches the window */
+    unsigned int runStart; /* First block of the copy not yet sent */
+    unsigned int runLen;   /* Blocks in that copy, or 0 */
+    off_t size;            /* Bytes read from the file */
+    EVP_MD_CTX *md;        /* MD5 of the whole file */
+};
+
+char deltaPage(struct ClientCmd *, struct DynBuf *);
+void freeDelta(struct Delta *);
+
+#endif
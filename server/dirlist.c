@@ -0,0 +1,165 @@
+/*******************************************************************************
+*      Filename: dirlist.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Produces the '-d' detailed directory listing one page at a
+*                time. Each page is a single large getdents64 batch, with the
+*                size and modification time of every regular file fetched by
+*                statx. Pages end with a cursor line, so a listing can be
+*                continued from the last page a client received. Entries
+*                whose type the filesystem doesn't report are typed by statx.
+*                A recursive listing covers every regular file in the tree
+*                below a directory, named by path, and has no cursor; a walk
+*                can't be resumed in a later session.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include "dirlist.h"
+
+/*******************************************************************************
+*      Function: _addEntry()
+*   Description: Adds one directory entry to a page if it is a regular file
+*                whose name matches the command's pattern.
+*    Parameters: struct ClientCmd *cmd - The listing command.
+*                struct LinuxDirent64 *d - The directory entry.
+*                struct DynBuf *page - The page being built.
+* Preconditions: cmd->dirFD is open.
+*       Returns: None.
+*******************************************************************************/
+
+void _addEntry(struct ClientCmd *cmd, struct LinuxDirent64 *d,
+               struct DynBuf *page) {
+    struct statx stx;
+    char line[ENTRY_LINE_MAX];
+    int len;
+
+    if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN) {
+        return;
+    }
+    if (reservedName(d->d_name) ||
+        (cmd->fName[0] && fnmatch(cmd->fName, d->d_name, 0) != 0)) {
+        return;
+    }
+    if (statx(cmd->dirFD, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == -1 ||
+        !S_ISREG(stx.stx_mode)) {
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "%llu\t%lld\t%s\n",
+                   (unsigned long long) stx.stx_size,
+                   (long long) stx.stx_mtime.tv_sec, d->d_name);
+    dynBufAddBytes(page, line, len);
+}
+
+/*******************************************************************************
+*      Function: _treeListPage()
+*   Description: Reads the next page of a recursive listing, one
+*                "size<TAB>mtime<TAB>path" line per regular file. The walk of
+*                the tree is started on the first call, and a page ends once
+*                it holds about a getdents64 batch worth of lines.
+*    Parameters: struct ClientCmd *cmd - The listing command. cmd->fName
+*                                        holds the tree's root directory.
+*                struct DynBuf *page - The buffer to hold the page.
+* Preconditions: page has been initialized and is empty.
+*       Returns: 'r' on success, 'e' if the root isn't a directory.
+*******************************************************************************/
+
+char _treeListPage(struct ClientCmd *cmd, struct DynBuf *page) {
+    char line[TREE_LINE_MAX];
+    struct TreeEnt *e;
+    int len;
+
+    if (!cmd->walk) {
+        cmd->walk = initTreeWalk(cmd->fName);
+        if (!cmd->walk) {
+            clearDynBuf(page);
+            dynBufAddStr(page, "NO DIRECTORY CONTENTS");
+            cmd->pagesDone = 1;
+            return 'e';
+        }
+    }
+
+    while (page->size < DIRENT_BUF_LEN) {
+        e = treeWalkNext(cmd->walk);
+        if (!e) {
+            cmd->pagesDone = 1;
+            break;
+        }
+        if (!S_ISREG(e->mode)) {
+            continue;
+        }
+        len = snprintf(line, sizeof(line), "%llu\t%lld\t%s\n",
+                       (unsigned long long) e->size, (long long) e->mtime,
+                       e->path);
+        dynBufAddBytes(page, line, len);
+    }
+
+    return 'r';
+}
+
+/*******************************************************************************
+*      Function: dirListPage()
+*   Description: Reads the next page of a detailed directory listing. The
+*                directory is opened and positioned at the command's cursor
+*                on the first call. Each page holds one line per regular file,
+*                "size<TAB>mtime<TAB>name", followed by "#cursor <n>"; batches
+*                with no matching files are skipped so pages are never empty
+*                before the end of the directory. A recursive listing is
+*                handed to _treeListPage().
+*    Parameters: struct ClientCmd *cmd - The listing command. cmd->fName
+*                                        holds the name pattern, if any.
+*                struct DynBuf *page - The buffer to hold the page.
+* Preconditions: page has been initialized and is empty. cmd->dirFD is -1 or
+*                was opened by an earlier call.
+*       Returns: 'r' on success, 'e' if the directory can't be read. Sets
+*                cmd->pagesDone once the end of the directory is reached.
+*******************************************************************************/
+
+char dirListPage(struct ClientCmd *cmd, struct DynBuf *page) {
+    char buf[DIRENT_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct LinuxDirent64))));
+    struct LinuxDirent64 *d;
+    char line[ENTRY_LINE_MAX];
+    long status;
+    long pos;
+    int len;
+
+    if (cmd->flags & FLAG_RECURSIVE) {
+        return _treeListPage(cmd, page);
+    }
+    if (cmd->dirFD == -1) {
+        cmd->dirFD = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cmd->dirFD == -1 ||
+            (cmd->cursor && lseek(cmd->dirFD, cmd->cursor, SEEK_SET) == -1)) {
+            clearDynBuf(page);
+            dynBufAddStr(page, "NO DIRECTORY CONTENTS");
+            cmd->pagesDone = 1;
+            return 'e';
+        }
+    }
+
+    while (page->size == 0) {
+        status = syscall(SYS_getdents64, cmd->dirFD, buf, sizeof(buf));
+        if (status == -1) {
+            perror("ftserver: getdents64");
+            cmd->pagesDone = 1;
+            break;
+        }
+        if (status == 0) {
+            cmd->pagesDone = 1;
+            break;
+        }
+        for (pos = 0; pos < status; pos += d->d_reclen) {
+            d = (struct LinuxDirent64 *) (buf + pos);
+            _addEntry(cmd, d, page);
+            cmd->cursor = d->d_off;
+        }
+    }
+
+    len = snprintf(line, sizeof(line), "#cursor %lld\n",
+                   (long long) cmd->cursor);
+    dynBufAddBytes(page, line, len);
+
+    return 'r';
+}
@@ -0,0 +1,32 @@
+/*******************************************************************************
+*      Filename: dirlist.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for dirlist.c. Please see dirlist.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <fnmatch.h>
+#include <sys/syscall.h>
+
+#include "command.h"
+
+#define DIRENT_BUF_LEN 65536    /* Bytes of entries read per getdents64 */
+#define ENTRY_LINE_MAX (FNAME_MAX + 64) /* Longest listing line */
+#define TREE_LINE_MAX (PATH_MAX + 64)   /* Longest recursive listing line */
+
+/* The layout of an entry returned by getdents64 */
+struct LinuxDirent64 {
+    unsigned long long d_ino;
+    long long d_off;       /* Cursor that resumes after this entry */
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+char dirListPage(struct ClientCmd *, struct DynBuf *);
+
+#endif
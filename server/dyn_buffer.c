@@ -4,10 +4,14 @@
 * Last Modified: 03.11.17
 *   Description: Functions for initializing, deallocating, and adding to a 
 *                dynamic array data structure that holds character data,
+*                and a pool that recycles DynBuf buffers between replies and
+*                keeps account of the memory they hold.
 *******************************************************************************/
 
 #include "dyn_buffer.h"
 
+void _poolPut(struct BufPool *, struct DynBuf *);
+
 /*******************************************************************************
 *      Function: initDynBuf()
 *   Description: Initializes a DynBuf struct.
@@ -23,37 +27,36 @@ void initDynBuf(struct DynBuf *db) {
     db->cap = DB_START_LEN;
     db->buffer = malloc(sizeof(char) * DB_START_LEN);
     assert(db->buffer);
-
-    memset(db->buffer, 0, sizeof(db->buffer));
+    db->buffer[0] = '\0';
+    db->pool = NULL;
 }
 
 /*******************************************************************************
 *      Function: _resizeBuf()
-*   Description: Resizes a DynBuf struct buffer.
+*   Description: Grows a DynBuf struct buffer by the resize factor until it
+*                holds more than len bytes, so that a terminator still fits.
 *    Parameters: struct DynBuf *db - A pointer to the struct to resize.
+*                size_t len - The number of bytes it must hold.
 * Preconditions: The DynBuf has been initialized.
 *       Returns: None.
 *******************************************************************************/
 
-void _resizeBuf(struct DynBuf *db) {
+void _resizeBuf(struct DynBuf *db, size_t len) {
     assert(db);
     assert(db->cap > 0);
 
-    /* Allocate a new buffer */ 
-    int i;
-    char *temp = malloc(sizeof(char) * db->cap * DB_RESIZE_FACTOR);
-    assert(temp);
-    memset(temp, 0, sizeof(temp));
- 
-    /* Copy existing data to the new buffer */
-    for (i = 0; i < db->size; i++) {
-        temp[i] = db->buffer[i];
-    } 
-    
-    /* Free the old buffer and replace it with the new buffer */
-    free(db->buffer);
-    db->buffer = temp; 
-    db->cap *= DB_RESIZE_FACTOR;
+    size_t cap = db->cap;
+    while (len >= cap) {
+        cap *= DB_RESIZE_FACTOR;
+    }
+
+    /* realloc() can often grow in place, and copies in bulk otherwise */
+    db->buffer = realloc(db->buffer, cap);
+    assert(db->buffer);
+    if (db->pool) {
+        atomic_fetch_add(&db->pool->used, cap - db->cap);
+    }
+    db->cap = cap;
 }
 
 /*******************************************************************************
@@ -69,8 +72,8 @@ void dynBufAdd(struct DynBuf *db, char c) {
     assert(db);
 
     /* Resize if necessary */
-    if (db->size  >= db->cap-1) {
-        _resizeBuf(db);
+    if (db->size + 1 >= db->cap) {
+        _resizeBuf(db, db->size + 1);
     }
 
     /* Add the character and increment the size */
@@ -89,16 +92,51 @@ void dynBufAdd(struct DynBuf *db, char c) {
 void dynBufAddStr(struct DynBuf *db, const char *str) {
     assert(db);
 
-    int i;
-    int len = strlen(str);
-    for (i = 0; i < len; i++) {
-        dynBufAdd(db, str[i]);
+    dynBufAddBytes(db, str, strlen(str));
+}
+
+/*******************************************************************************
+*      Function: dynBufAddBytes()
+*   Description: Appends a block of bytes to the DynBuf with a single copy.
+*    Parameters: struct DynBuf *db - A pointer to the struct.
+*                const char *bytes - The bytes to append.
+*                size_t len - The number of bytes.
+* Preconditions: The DynBuf has been initialized.
+*       Returns: None.
+*******************************************************************************/
+
+void dynBufAddBytes(struct DynBuf *db, const char *bytes, size_t len) {
+    assert(db);
+
+    /* Resize so the bytes fit, keeping room for a terminator */
+    if (db->size + len >= db->cap) {
+        _resizeBuf(db, db->size + len);
+    }
+
+    memcpy(db->buffer + db->size, bytes, len);
+    db->size += len;
+}
+
+/*******************************************************************************
+*      Function: dynBufReserve()
+*   Description: Grows the DynBuf until it can hold a number of bytes.
+*    Parameters: struct DynBuf *db - A pointer to the struct.
+*                size_t len - The number of bytes it must hold.
+* Preconditions: The DynBuf has been initialized.
+*       Returns: None.
+*******************************************************************************/
+
+void dynBufReserve(struct DynBuf *db, size_t len) {
+    assert(db);
+
+    if (len >= db->cap) {
+        _resizeBuf(db, len);
     }
 }
 
 /*******************************************************************************
 *      Function: clearDynBuf()
-*   Description: Replaces all characters in the buffer with null terminators.
+*   Description: Empties the buffer, keeping its memory for reuse.
 *    Parameters: struct DynBuf *db - A pointer to the struct.
 * Preconditions: The DynBuf has been initialized.
 *       Returns: None.
@@ -107,14 +145,15 @@ void dynBufAddStr(struct DynBuf *db, const char *str) {
 void clearDynBuf(struct DynBuf *db) {
     assert(db);
 
-    memset(db->buffer, 0, sizeof(db->buffer));
+    db->buffer[0] = '\0';
     db->size = 0;
 }
 
 /*******************************************************************************
 *      Function: freeDynBuf()
-*   Description: Deallocates memory allocated within the struct. Note that if 
-*                the struct is on the heap, it must be freed separately.
+*   Description: Deallocates memory allocated within the struct, or returns
+*                it to its pool. Note that if the struct is on the heap, it
+*                must be freed separately.
 *    Parameters: struct DynBuf *db - A pointer to the struct.
 * Preconditions: The DynBuf has been initialized.
 *       Returns: None.
@@ -124,7 +163,114 @@ void freeDynBuf(struct DynBuf *db) {
     assert(db);
     assert(db->buffer);
 
-    free(db->buffer);
+    if (db->pool) {
+        _poolPut(db->pool, db);
+    } else {
+        free(db->buffer);
+    }
+    db->buffer = NULL;
     db->size = 0;
     db->cap = 0;
 }
+
+/*******************************************************************************
+*      Function: initBufPool()
+*   Description: Creates a buffer pool.
+*    Parameters: size_t budget - The memory the pool's buffers may hold
+*                                before bufPoolFull() reports it full.
+* Preconditions: None.
+*       Returns: The pool.
+*******************************************************************************/
+
+struct BufPool *initBufPool(size_t budget) {
+    struct BufPool *pool;
+
+    pool = calloc(1, sizeof(struct BufPool));
+    assert(pool);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->budget = budget;
+    atomic_init(&pool->used, 0);
+
+    return pool;
+}
+
+/*******************************************************************************
+*      Function: bufPoolGet()
+*   Description: Initializes a DynBuf with a buffer from the pool, reusing
+*                the most recently returned buffer if there is one.
+*    Parameters: struct BufPool *pool - The pool.
+*                struct DynBuf *db - A pointer to the struct to initialize.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void bufPoolGet(struct BufPool *pool, struct DynBuf *db) {
+    struct FreeBuf *fb;
+
+    assert(pool && db);
+
+    pthread_mutex_lock(&pool->lock);
+    fb = pool->free;
+    if (fb) {
+        pool->free = fb->next;
+        pool->freeBytes -= fb->cap;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (fb) {
+        db->cap = fb->cap;
+        db->buffer = (char *) fb;
+        db->buffer[0] = '\0';
+        db->size = 0;
+    } else {
+        initDynBuf(db);
+    }
+    db->pool = pool;
+    atomic_fetch_add(&pool->used, db->cap);
+}
+
+/*******************************************************************************
+*      Function: _poolPut()
+*   Description: Takes a buffer back into its pool. Buffers that have grown
+*                past BP_KEEP_MAX, or that would take the free list past
+*                BP_FREE_MAX bytes, are freed instead.
+*    Parameters: struct BufPool *pool - The pool.
+*                struct DynBuf *db - The DynBuf holding the buffer.
+* Preconditions: The buffer came from bufPoolGet().
+*       Returns: None.
+*******************************************************************************/
+
+void _poolPut(struct BufPool *pool, struct DynBuf *db) {
+    struct FreeBuf *fb = (struct FreeBuf *) db->buffer;
+
+    atomic_fetch_sub(&pool->used, db->cap);
+    if (db->cap > BP_KEEP_MAX) {
+        free(db->buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freeBytes + db->cap > BP_FREE_MAX) {
+        pthread_mutex_unlock(&pool->lock);
+        free(db->buffer);
+        return;
+    }
+    fb->cap = db->cap;
+    fb->next = pool->free;
+    pool->free = fb;
+    pool->freeBytes += db->cap;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*******************************************************************************
+*      Function: bufPoolFull()
+*   Description: Reports whether the buffers handed out by a pool have
+*                reached its memory budget.
+*    Parameters: struct BufPool *pool - The pool.
+* Preconditions: None.
+*       Returns: Nonzero if the pool is at or over its budget.
+*******************************************************************************/
+
+int bufPoolFull(struct BufPool *pool) {
+    return pool->budget && atomic_load(&pool->used) >= pool->budget;
+}
@@ -10,22 +10,51 @@
 #define DYN_BUFFER_H
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define DB_START_LEN     256    /* Dynamic buffer starting length */
 #define DB_RESIZE_FACTOR   2    /* Dynamic resizing factor */
+#define BP_KEEP_MAX  4194304    /* Largest buffer a pool keeps for reuse */
+#define BP_FREE_MAX  33554432   /* Most memory a pool keeps for reuse */
 
 struct DynBuf {
-    int size;
-    int cap;
+    size_t size;
+    size_t cap;
     char *buffer;
+    struct BufPool *pool;  /* The pool the buffer returns to, or NULL */
+};
+
+/* A pooled buffer waiting for reuse. The list is threaded through the free
+ * buffers themselves. */
+struct FreeBuf {
+    struct FreeBuf *next;
+    size_t cap;
+};
+
+/* Recycles DynBuf buffers and accounts for the memory held by those in use.
+ * Buffers are taken and returned from any thread. */
+struct BufPool {
+    pthread_mutex_t lock;  /* Guards the free list */
+    struct FreeBuf *free;  /* Buffers waiting for reuse, newest first */
+    size_t freeBytes;      /* Memory held by the free list */
+    atomic_size_t used;    /* Memory held by buffers in use */
+    size_t budget;         /* Memory in use at which the pool is full, or 0
+                            * for no limit */
 };
 
 void initDynBuf(struct DynBuf *);
 void dynBufAdd(struct DynBuf *, char);
 void dynBufAddStr(struct DynBuf *, const char *);
+void dynBufAddBytes(struct DynBuf *, const char *, size_t);
+void dynBufReserve(struct DynBuf *, size_t);
 void clearDynBuf(struct DynBuf *);
 void freeDynBuf(struct DynBuf *);
 
+struct BufPool *initBufPool(size_t);
+void bufPoolGet(struct BufPool *, struct DynBuf *);
+int bufPoolFull(struct BufPool *);
+
 #endif
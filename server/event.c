@@ -0,0 +1,1951 @@
+/*******************************************************************************
+*      Filename: event.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The epoll event loop that drives every client connection.
+*                Each control connection is a small state machine that
+*                receives a command header and body, runs the command on the
+*                worker pool, connects back to the client's data port and
+*                sends the reply. All sockets are non-blocking and all disk
+*                access happens on the workers, so a slow client or a cold
+*                file only ever holds up its own connection.
+*
+*                A connection whose first header is an extended header is a
+*                session: it may pipeline any number of commands, and every
+*                reply is sent back on the control connection tagged with the
+*                request id of the command it answers. The data of a put
+*                follows its command on the control connection; the loop
+*                only receives it into a pipe or buffer, and a worker
+*                writes each batch to the file before more is received.
+*******************************************************************************/
+
+#include "event.h"
+
+/* Event loop state shared by the handlers */
+struct EventLoop {
+    int epfd;                  /* The epoll instance */
+    struct Handle listen;      /* The listening socket */
+    struct Handle poolDone;    /* The worker pool's completion eventfd */
+    struct Handle listChanged; /* The listing cache's inotify descriptor */
+    struct Handle statsSignal; /* signalfd reporting SIGUSR1 */
+    struct Pool *pool;         /* Worker pool that runs client commands */
+    const char *serverPort;    /* Server port string, used in error replies */
+    struct Conn *graveyard;    /* Connections closed during this batch */
+    struct ListCache *lists;   /* Directory listing cache */
+    struct FileCache *files;   /* Hot file cache */
+    struct Uring *uring;       /* io_uring backend, or NULL */
+    struct Manifest *manifest; /* Content hash manifest */
+    struct Resolver *resolver; /* Client hostname cache, or NULL if hostnames
+                                * are not looked up */
+    struct Metrics *metrics;   /* Server metrics */
+    struct BufPool *bufs;      /* Reply buffer pool */
+    struct Conn *memWait;      /* Connections waiting for buffer memory */
+    struct Reply *poolWait;    /* Replies waiting for a worker, oldest first */
+    struct Reply *poolWaitTail;
+    struct Scheduler sched;    /* Sockets ready to send, and rate limits */
+    char *upBuf;               /* UP_BUF_LEN bytes for receiving puts */
+};
+
+void _recvCmd(struct EventLoop *, struct Conn *);
+
+/*******************************************************************************
+*      Function: _watch()
+*   Description: Adds, modifies or removes a handle in the epoll interest list.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Handle *h - The handle.
+*                int op - EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL.
+*                unsigned int events - The requested epoll events.
+* Preconditions: h->fd is open.
+*       Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int _watch(struct EventLoop *loop, struct Handle *h, int op,
+           unsigned int events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(loop->epfd, op, h->fd, &ev) == -1) {
+        perror("ftserver: epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _closeHandle()
+*   Description: Closes a handle's file descriptor, which also removes it from
+*                the epoll interest list.
+*    Parameters: struct Handle *h - The handle.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _closeHandle(struct Handle *h) {
+    if (h->fd == -1) {
+        return;
+    }
+    if (close(h->fd) != 0) {
+        perror("ftserver: close");
+    }
+    h->fd = -1;
+}
+
+/*******************************************************************************
+*      Function: _freeReply()
+*   Description: Releases a reply, closing its data connection and any file
+*                or directory still open for streaming.
+*    Parameters: struct Reply *rep - The reply.
+* Preconditions: The reply is not in a connection's reply list.
+*       Returns: None.
+*******************************************************************************/
+
+void _freeReply(struct Reply *rep) {
+    _closeHandle(&rep->data);
+    if (rep->cmd.fileFD != -1) {
+        close(rep->cmd.fileFD);
+        rep->cmd.fileFD = -1;
+    }
+    if (rep->cmd.dirFD != -1) {
+        close(rep->cmd.dirFD);
+        rep->cmd.dirFD = -1;
+    }
+    if (rep->cmd.archFD != -1) {
+        close(rep->cmd.archFD);
+        rep->cmd.archFD = -1;
+    }
+    if (rep->cmd.walk) {
+        freeTreeWalk(rep->cmd.walk);
+        rep->cmd.walk = NULL;
+    }
+    if (rep->cmd.delta) {
+        freeDelta(rep->cmd.delta);
+        rep->cmd.delta = NULL;
+    }
+    if (rep->cmd.upload) {
+        freeUpload(rep->cmd.upload);
+        rep->cmd.upload = NULL;
+    }
+    if (rep->cmd.sigBody.buffer) {
+        freeDynBuf(&rep->cmd.sigBody);
+    }
+    if (rep->cmd.cached) {
+        fileCacheRelease(rep->cmd.cached);
+        rep->cmd.cached = NULL;
+    }
+    if (rep->codec) {
+        freeCodec(rep->codec);
+    }
+    freeDynBuf(&rep->body);
+    free(rep);
+}
+
+/*******************************************************************************
+*      Function: _unlinkReply()
+*   Description: Removes a reply from its connection's reply list.
+*    Parameters: struct Reply *rep - The reply.
+* Preconditions: rep->conn is set and the reply is in its list.
+*       Returns: None.
+*******************************************************************************/
+
+void _unlinkReply(struct Reply *rep) {
+    struct Conn *conn = rep->conn;
+
+    if (rep->prev) {
+        rep->prev->next = rep->next;
+    } else {
+        conn->replies = rep->next;
+    }
+    if (rep->next) {
+        rep->next->prev = rep->prev;
+    }
+    rep->prev = rep->next = NULL;
+    conn->nReplies--;
+}
+
+/*******************************************************************************
+*      Function: _submit()
+*   Description: Hands a reply's work to the worker pool. While the pool is
+*                saturated, or other replies are already waiting for it, the
+*                reply waits its turn in the RS_WORKING state instead.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+*                void (*task)(void *) - The work to run on the reply.
+* Preconditions: The reply is in the RS_WORKING state and isn't waiting.
+*       Returns: 1 if the work was submitted, 0 if it is waiting.
+*******************************************************************************/
+
+int _submit(struct EventLoop *loop, struct Reply *rep, void (*task)(void *)) {
+    if (!loop->poolWait && poolSubmit(loop->pool, task, rep) == 0) {
+        return 1;
+    }
+    rep->task = task;
+    rep->poolNext = NULL;
+    if (loop->poolWaitTail) {
+        loop->poolWaitTail->poolNext = rep;
+    } else {
+        loop->poolWait = rep;
+    }
+    loop->poolWaitTail = rep;
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _cancelSubmit()
+*   Description: Takes a reply out of the queue waiting for the pool.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+* Preconditions: The reply is waiting for a worker.
+*       Returns: None.
+*******************************************************************************/
+
+void _cancelSubmit(struct EventLoop *loop, struct Reply *rep) {
+    struct Reply **pp, *prev = NULL;
+
+    for (pp = &loop->poolWait; *pp != rep; pp = &(*pp)->poolNext) {
+        prev = *pp;
+    }
+    *pp = rep->poolNext;
+    if (loop->poolWaitTail == rep) {
+        loop->poolWaitTail = prev;
+    }
+    rep->task = NULL;
+}
+
+/*******************************************************************************
+*      Function: _closeConn()
+*   Description: Closes a control connection and its data connections. The
+*                structs themselves are placed on the graveyard and freed once
+*                the current batch of events has been handled, since later
+*                events in the batch may still point at them. Replies still
+*                owned by a worker are detached and freed when reaped, and
+*                replies waiting for a worker are never started.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _closeConn(struct EventLoop *loop, struct Conn *conn) {
+    struct Reply *rep, *next;
+    struct Conn **pp;
+
+    if (conn->ctrl.fd == -1) {
+        return;
+    }
+    if (conn->memWaiting) {
+        for (pp = &loop->memWait; *pp != conn; pp = &(*pp)->waitNext) {
+        }
+        *pp = conn->waitNext;
+        conn->memWaiting = 0;
+    }
+    schedRemove(&loop->sched, &conn->flow);
+    for (rep = conn->replies; rep; rep = next) {
+        next = rep->next;
+        schedRemove(&loop->sched, &rep->flow);
+        if (rep->state == RS_WORKING && !rep->task) {
+            _unlinkReply(rep);
+            rep->conn = NULL;
+        } else {
+            if (rep->task) {
+                _cancelSubmit(loop, rep);
+            }
+            _closeHandle(&rep->data);
+        }
+    }
+    _closeHandle(&conn->ctrl);
+
+    conn->next = loop->graveyard;
+    loop->graveyard = conn;
+}
+
+/*******************************************************************************
+*      Function: _updateCtrl()
+*   Description: Sets the control socket's epoll interest from the connection
+*                state: readable while more commands may be accepted or a
+*                put's file is ready for its data, and writable while
+*                replies are queued on it.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: The connection is open.
+*       Returns: 0 on success, -1 if the connection had to be closed.
+*******************************************************************************/
+
+int _updateCtrl(struct EventLoop *loop, struct Conn *conn) {
+    unsigned int events = 0;
+
+    if ((conn->state == CS_RECV_HDR || conn->state == CS_RECV_BODY) &&
+        conn->nReplies < SESSION_DEPTH && !conn->memWaiting &&
+        !conn->poolWaiting) {
+        events |= EPOLLIN;
+    }
+    if (conn->state == CS_RECV_DATA && conn->upload->state != RS_WORKING) {
+        events |= EPOLLIN;
+    }
+    if (conn->state == CS_LINGER) {
+        events |= EPOLLIN;
+    }
+    /* A reply waiting on its next listing page has nothing to send, and
+     * one the scheduler holds needn't be told the socket is writable */
+    if (conn->sendHead && conn->sendHead->state != RS_WORKING &&
+        !conn->flow.active) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        if (_watch(loop, &conn->ctrl, EPOLL_CTL_MOD, events) == -1) {
+            _closeConn(loop, conn);
+            return -1;
+        }
+        conn->events = events;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _clientHost()
+*   Description: Refreshes a connection's client hostname from the resolver.
+*                The IP address stands in until a lookup has completed.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: conn->addr and conn->inetAddr have been set.
+*       Returns: None.
+*******************************************************************************/
+
+void _clientHost(struct EventLoop *loop, struct Conn *conn) {
+    if (loop->resolver) {
+        resolverLookup(loop->resolver, &conn->addr, conn->addrLen,
+                       conn->inetAddr, conn->host, sizeof(conn->host));
+    } else {
+        strcpy(conn->host, conn->inetAddr);
+    }
+}
+
+/*******************************************************************************
+*      Function: _acceptConns()
+*   Description: Accepts every pending inbound connection and starts each one
+*                receiving its command header.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: The listening socket is non-blocking.
+*       Returns: None.
+*******************************************************************************/
+
+void _acceptConns(struct EventLoop *loop) {
+    struct sockaddr_storage clientAddr;
+    socklen_t clientAddrSize;
+    struct Conn *conn;
+    int ctrlFD;
+
+    while (1) {
+        clientAddrSize = sizeof(clientAddr);
+        ctrlFD = accept(loop->listen.fd, (struct sockaddr *) &clientAddr,
+                        &clientAddrSize);
+        if (ctrlFD == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("ftserver: accept");
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        if (setNonBlocking(ctrlFD) == -1) {
+            close(ctrlFD);
+            continue;
+        }
+
+        conn = calloc(1, sizeof(struct Conn));
+        assert(conn);
+        conn->ctrl.fd = ctrlFD;
+        conn->ctrl.kind = H_CTRL;
+        conn->ctrl.owner = conn;
+        conn->state = CS_RECV_HDR;
+        conn->events = EPOLLIN;
+        conn->flow.h = &conn->ctrl;
+        conn->flow.bucket = &conn->bucket;
+        initBucket(&conn->bucket, loop->sched.connRate);
+        clock_gettime(CLOCK_MONOTONIC, &conn->accepted);
+        metricsAdd(loop->metrics, M_CONNS, 1);
+
+        /* Get the client IP, and its hostname if already known */
+        conn->addr = clientAddr;
+        conn->addrLen = clientAddrSize;
+        obtainClientCredentials(&clientAddr, clientAddrSize, conn->inetAddr);
+        _clientHost(loop, conn);
+        printf("----------------------\n");
+        printf("Connection from %s\n", conn->host);
+
+        if (_watch(loop, &conn->ctrl, EPOLL_CTL_ADD, conn->events) == -1) {
+            close(ctrlFD);
+            free(conn);
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _bodyData()
+*   Description: Finds the unsent part of a reply body held in memory: the
+*                body buffer if the reply is paged or has no file, or the
+*                file's mapping if it is cached. A send from the mapping of
+*                a file truncated in place fails with EFAULT rather than
+*                faulting.
+*    Parameters: struct Reply *rep - The reply.
+* Preconditions: None.
+*       Returns: The next body byte to send, or NULL if the body is sent
+*                straight from an open file.
+*******************************************************************************/
+
+char *_bodyData(struct Reply *rep) {
+    if (rep->paged || (rep->cmd.fileFD == -1 && !rep->cmd.cached)) {
+        return rep->body.buffer + rep->bodySent;
+    }
+    if (rep->cmd.fileFD == -1) {
+        return rep->cmd.cached->map + rep->cmd.rangeOff + rep->bodySent;
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: _sendBody()
+*   Description: Sends the next part of a reply body: from memory if it is
+*                held there, and straight from the file otherwise.
+*    Parameters: struct Reply *rep - The reply.
+*                int fd - The socket the reply is sent on.
+*                off_t len - The most bytes to send.
+* Preconditions: len is positive and within the body.
+*       Returns: The number of bytes sent, or -1 with errno set on failure.
+*******************************************************************************/
+
+ssize_t _sendBody(struct Reply *rep, int fd, off_t len) {
+    ssize_t currSent;
+    off_t offset = rep->cmd.rangeOff + rep->bodySent;
+    char *data = _bodyData(rep);
+
+    if (data) {
+        return sendSome(fd, data, len);
+    }
+    currSent = sendFileSome(fd, rep->cmd.fileFD, &offset, len);
+    if (currSent == 0) {
+        fprintf(stderr, "ftserver: file truncated during send\n");
+        errno = EIO;
+        return -1;
+    }
+    return currSent;
+}
+
+/*******************************************************************************
+*      Function: _sendWithData()
+*   Description: Sends the rest of a header together with as much of the
+*                body after it as is held in memory, so both can leave in
+*                the same packets. If the body is sent from a file instead,
+*                the kernel is told more is coming so the header waits to
+*                share a packet with the file's first bytes.
+*    Parameters: struct Reply *rep - The reply.
+*                int fd - The socket the reply is sent on.
+*                const char *hdr - The unsent part of the header.
+*                size_t hdrLen - Its length.
+*                off_t dataLen - The most body bytes that may follow it.
+*                off_t *dataSent - Set to the body bytes sent.
+* Preconditions: hdrLen is positive.
+*       Returns: The number of header bytes sent, or -1 with errno set.
+*******************************************************************************/
+
+ssize_t _sendWithData(struct Reply *rep, int fd, const char *hdr,
+                      size_t hdrLen, off_t dataLen, off_t *dataSent) {
+    struct iovec iov[2];
+    ssize_t currSent;
+    int iovcnt = 1;
+
+    iov[0].iov_base = (char *) hdr;
+    iov[0].iov_len = hdrLen;
+    iov[1].iov_base = dataLen > 0 ? _bodyData(rep) : NULL;
+    if (iov[1].iov_base) {
+        iov[1].iov_len = dataLen < REPLY_SLICE ? dataLen : REPLY_SLICE;
+        iovcnt = 2;
+    }
+
+    currSent = sendVecSome(fd, iov, iovcnt, dataLen > 0 && iovcnt == 1);
+    *dataSent = 0;
+    if (currSent > (ssize_t) hdrLen) {
+        *dataSent = currSent - hdrLen;
+        currSent = hdrLen;
+        metricsAdd(rep->metrics, M_BYTES_SENT, *dataSent);
+    }
+    return currSent;
+}
+
+/*******************************************************************************
+*      Function: _pumpChunked()
+*   Description: Sends as much of a chunked reply as its socket will accept,
+*                up to the scheduler's budget. Each chunk is sized when it
+*                starts, so a file that grows while it is being sent is
+*                streamed to its new end. A paged reply stops in RS_WORKING
+*                after each page until the next one has been read. Chunks of
+*                deflated pages are marked with CHUNK_COMPRESSED. A
+*                zero-length chunk ends the reply, followed by the checksum
+*                trailer if the client asked for one.
+*    Parameters: struct Reply *rep - The reply.
+*                int fd - The socket the reply is sent on.
+*                off_t budget - The most body bytes to send.
+*                off_t *slice - Body bytes sent so far, which this adds to.
+* Preconditions: The reply header has been sent.
+*       Returns: 1 when the reply has been sent, 0 if more remains, -1 on
+*                failure.
+*******************************************************************************/
+
+int _pumpChunked(struct Reply *rep, int fd, off_t budget, off_t *slice) {
+    struct stat st;
+    ssize_t currSent;
+    off_t dataSent, len;
+
+    while (*slice < budget) {
+        len = rep->chunkLeft < budget - *slice ? rep->chunkLeft :
+                                                 budget - *slice;
+        /* Send the current chunk's length prefix */
+        if (rep->chunkHdrSent < rep->chunkHdrLen) {
+            currSent = _sendWithData(rep, fd, rep->chunkHdr + rep->chunkHdrSent,
+                                     rep->chunkHdrLen - rep->chunkHdrSent,
+                                     len, &dataSent);
+            if (currSent == -1) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            rep->chunkHdrSent += currSent;
+            rep->bodySent += dataSent;
+            rep->chunkLeft -= dataSent;
+            *slice += dataSent;
+            continue;
+        }
+
+        /* Send the current chunk's data */
+        if (rep->chunkLeft > 0) {
+            currSent = _sendBody(rep, fd, len);
+            if (currSent == -1) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            rep->bodySent += currSent;
+            rep->chunkLeft -= currSent;
+            metricsAdd(rep->metrics, M_BYTES_SENT, currSent);
+            *slice += currSent;
+            continue;
+        }
+
+        if (rep->state == RS_SEND_END) {
+            return 1;
+        }
+
+        /* A paged reply fetches its next page once this one is sent */
+        if (rep->paged && !rep->cmd.pagesDone &&
+            rep->bodySent == rep->bodyLen) {
+            rep->state = RS_WORKING;
+            return 0;
+        }
+
+        /* Start the next chunk from whatever the file holds now, unless
+         * the client asked for a fixed range */
+        if (!rep->paged && rep->cmd.fileFD != -1 && !rep->cmd.rangeLen &&
+            fstat(rep->cmd.fileFD, &st) == 0 &&
+            st.st_size - rep->cmd.rangeOff > rep->bodyLen) {
+            rep->bodyLen = st.st_size - rep->cmd.rangeOff;
+        }
+        rep->chunkLeft = rep->bodyLen - rep->bodySent;
+        if (rep->chunkLeft > CHUNK_LEN_MAX) {
+            rep->chunkLeft = CHUNK_LEN_MAX;
+        }
+        packChunkHeader(rep->chunkHdr, rep->chunkLeft |
+                        (rep->chunkLeft && rep->pageCompressed ?
+                         CHUNK_COMPRESSED : 0));
+        rep->chunkHdrLen = CHUNK_HDR_LEN;
+        rep->chunkHdrSent = 0;
+        if (rep->chunkLeft == 0) {
+            rep->state = RS_SEND_END;
+            if (rep->flags & FLAG_CHECKSUM) {
+                packChecksum(rep->chunkHdr + CHUNK_HDR_LEN, rep->checksum);
+                rep->chunkHdrLen += CHECKSUM_LEN;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _pumpReply()
+*   Description: Sends as much of a reply as its socket will accept, up to
+*                the budget the scheduler gave it, so that one large transfer
+*                can't starve the other connections. Chunked bodies are
+*                handed to _pumpChunked().
+*    Parameters: struct Reply *rep - The reply.
+*                int fd - The socket the reply is sent on.
+*                off_t budget - The most body bytes to send.
+*                off_t *sent - Set to the body bytes sent.
+* Preconditions: The reply header has been packed.
+*       Returns: 1 when the reply has been sent, 0 if more remains, -1 on
+*                failure.
+*******************************************************************************/
+
+int _pumpReply(struct Reply *rep, int fd, off_t budget, off_t *sent) {
+    struct iovec hdrVec;
+    ssize_t currSent;
+    off_t slice = 0, dataSent, len;
+    int status;
+
+    /* Send the header, and with it the start of an unchunked body. A
+     * chunked body always follows, so the header waits to share a packet
+     * with the first chunk. */
+    while (rep->hdrSent < rep->hdrLen) {
+        if (rep->flags & FLAG_CHUNKED) {
+            hdrVec.iov_base = rep->header + rep->hdrSent;
+            hdrVec.iov_len = rep->hdrLen - rep->hdrSent;
+            currSent = sendVecSome(fd, &hdrVec, 1, 1);
+            dataSent = 0;
+        } else {
+            len = rep->bodyLen - rep->bodySent;
+            currSent = _sendWithData(rep, fd, rep->header + rep->hdrSent,
+                                     rep->hdrLen - rep->hdrSent,
+                                     len < budget - slice ? len :
+                                     budget - slice, &dataSent);
+        }
+        if (currSent == -1) {
+            *sent = slice;
+            rep->totalSent += slice;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        rep->hdrSent += currSent;
+        rep->bodySent += dataSent;
+        slice += dataSent;
+        /* The first byte sent on a connection ends its accept latency */
+        if (!rep->conn->firstByteSent) {
+            rep->conn->firstByteSent = 1;
+            metricsRecord(&rep->metrics->firstByte,
+                          metricsSince(&rep->conn->accepted));
+        }
+    }
+    if (rep->state == RS_SEND_HDR) {
+        rep->state = RS_SEND_BODY;
+    }
+    if (rep->flags & FLAG_CHUNKED) {
+        status = _pumpChunked(rep, fd, budget, &slice);
+        *sent = slice;
+        rep->totalSent += slice;
+        return status;
+    }
+
+    /* Send the body */
+    status = 0;
+    while (rep->bodySent < rep->bodyLen && slice < budget) {
+        len = rep->bodyLen - rep->bodySent;
+        currSent = _sendBody(rep, fd, len < budget - slice ? len :
+                                                             budget - slice);
+        if (currSent == -1) {
+            status = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            break;
+        }
+        rep->bodySent += currSent;
+        slice += currSent;
+        metricsAdd(rep->metrics, M_BYTES_SENT, currSent);
+    }
+
+    *sent = slice;
+    rep->totalSent += slice;
+    return status == -1 ? -1 : rep->bodySent == rep->bodyLen;
+}
+
+/*******************************************************************************
+*      Function: _finishReply()
+*   Description: Releases a fully sent reply. A legacy control connection is
+*                left open until the client hangs up, since the client may
+*                still be selecting on it. A session goes on receiving
+*                commands, or closes once it has drained.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+* Preconditions: The reply has been sent and is no longer queued for sending.
+*       Returns: None.
+*******************************************************************************/
+
+void _finishReply(struct EventLoop *loop, struct Reply *rep) {
+    struct Conn *conn = rep->conn;
+
+    if (rep->start.tv_sec || rep->start.tv_nsec) {
+        metricsRecord(&loop->metrics->request, metricsSince(&rep->start));
+    }
+    schedRemove(&loop->sched, &rep->flow);
+    _unlinkReply(rep);
+    _freeReply(rep);
+
+    if (!conn->session) {
+        conn->state = CS_LINGER;
+    } else if (conn->state == CS_DRAINING && conn->nReplies == 0) {
+        _closeConn(loop, conn);
+        return;
+    }
+
+    if (_updateCtrl(loop, conn) == -1) {
+        return;
+    }
+    /* Commands held back by the pipelining limit may now be parsed */
+    if (conn->session && conn->state != CS_DRAINING &&
+        conn->inEnd > conn->inStart) {
+        _recvCmd(loop, conn);
+    }
+}
+
+/*******************************************************************************
+*      Function: _sealPage()
+*   Description: Adds a page of a reply body to the reply's checksum while it
+*                is still in cache, then compresses it, as the client asked.
+*    Parameters: struct Reply *rep - The reply holding the page in its body.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _sealPage(struct Reply *rep) {
+    if (rep->cmd.flags & FLAG_CHECKSUM) {
+        rep->checksum = crc32(rep->checksum,
+                              (const Bytef *) rep->body.buffer,
+                              rep->body.size);
+    }
+    if (rep->codec) {
+        rep->pageCompressed = codecCompress(rep->codec, &rep->body);
+    }
+    rep->bodyLen = rep->body.size;
+}
+
+/*******************************************************************************
+*      Function: _runPage()
+*   Description: Reads the next page of a paged reply, from the directory or
+*                tree for a detailed listing or an archive and from the file
+*                otherwise. Runs on a worker thread, so it touches nothing
+*                but the reply itself.
+*    Parameters: void *arg - The struct Reply to fill in.
+* Preconditions: The reply's body has been sent and cleared.
+*       Returns: None.
+*******************************************************************************/
+
+void _runPage(void *arg) {
+    struct Reply *rep = arg;
+
+    if (rep->cmd.mode == 'a') {
+        archivePage(&rep->cmd, &rep->body);
+    } else if (rep->cmd.mode == 'd') {
+        dirListPage(&rep->cmd, &rep->body);
+    } else if (rep->cmd.mode == 'u') {
+        deltaPage(&rep->cmd, &rep->body);
+    } else {
+        rep->pageOff += filePage(&rep->cmd, &rep->body, rep->pageOff);
+    }
+    _sealPage(rep);
+}
+
+/*******************************************************************************
+*      Function: _nextPage()
+*   Description: Starts reading the next page of a paged reply once the
+*                last one has been sent. The reply stays at the head of the
+*                control connection's send queue meanwhile, and waits there
+*                for a worker if the pool is saturated, so no page is read
+*                on the event loop thread.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+* Preconditions: The reply is in the RS_WORKING state.
+*       Returns: None.
+*******************************************************************************/
+
+void _nextPage(struct EventLoop *loop, struct Reply *rep) {
+    clearDynBuf(&rep->body);
+    rep->bodySent = 0;
+    rep->bodyLen = 0;
+    if (_updateCtrl(loop, rep->conn) == -1) {
+        return;
+    }
+
+    _submit(loop, rep, _runPage);
+}
+
+/*******************************************************************************
+*      Function: _pumpCtrl()
+*   Description: Sends the replies queued on a control connection in order.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+*                off_t budget - The most body bytes to send.
+* Preconditions: None.
+*       Returns: The number of body bytes sent.
+*******************************************************************************/
+
+off_t _pumpCtrl(struct EventLoop *loop, struct Conn *conn, off_t budget) {
+    struct Reply *rep;
+    off_t sent, total = 0;
+    int status;
+
+    while (conn->ctrl.fd != -1 && conn->sendHead && total < budget) {
+        rep = conn->sendHead;
+        status = _pumpReply(rep, conn->ctrl.fd, budget - total, &sent);
+        total += sent;
+        if (status == -1) {
+            perror("ftserver: send");
+            _closeConn(loop, conn);
+            break;
+        }
+        if (status == 0) {
+            if (rep->state == RS_WORKING) {
+                _nextPage(loop, rep);
+            }
+            break;
+        }
+        conn->sendHead = rep->sendNext;
+        if (!conn->sendHead) {
+            conn->sendTail = NULL;
+        }
+        _finishReply(loop, rep);
+    }
+    return total;
+}
+
+/*******************************************************************************
+*      Function: _pumpData()
+*   Description: Sends the reply on a data connection.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+*                off_t budget - The most body bytes to send.
+*                off_t *sent - Set to the body bytes sent.
+* Preconditions: The data connection is connected.
+*       Returns: 1 if the reply was sent and freed, 0 if more remains, -1 if
+*                the connection had to be closed.
+*******************************************************************************/
+
+int _pumpData(struct EventLoop *loop, struct Reply *rep, off_t budget,
+              off_t *sent) {
+    int status;
+
+    status = _pumpReply(rep, rep->data.fd, budget, sent);
+    if (status == -1) {
+        perror("ftserver: send");
+        _closeConn(loop, rep->conn);
+    } else if (status == 1) {
+        _finishReply(loop, rep);
+    }
+    return status;
+}
+
+/*******************************************************************************
+*      Function: _updateData()
+*   Description: Sets a data socket's epoll interest: writable unless the
+*                scheduler already holds it as ready to send.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply sent on the data connection.
+* Preconditions: The data connection is connected.
+*       Returns: None.
+*******************************************************************************/
+
+void _updateData(struct EventLoop *loop, struct Reply *rep) {
+    unsigned int events = rep->flow.active ? 0 : EPOLLOUT;
+
+    if (events != rep->flow.events &&
+        _watch(loop, &rep->data, EPOLL_CTL_MOD, events) == 0) {
+        rep->flow.events = events;
+    }
+}
+
+/*******************************************************************************
+*      Function: _flowClass()
+*   Description: Chooses the scheduling class of a flow from the reply it is
+*                sending. Errors, listings, stats and small files are
+*                interactive until they have sent SC_SMALL bytes; anything
+*                larger is a bulk transfer.
+*    Parameters: struct Flow *f - The flow.
+* Preconditions: The flow's socket is open.
+*       Returns: One of enum FlowClass.
+*******************************************************************************/
+
+int _flowClass(struct Flow *f) {
+    struct Reply *rep;
+
+    if (f->h->kind == H_CTRL) {
+        rep = ((struct Conn *) f->h->owner)->sendHead;
+    } else {
+        rep = f->h->owner;
+    }
+    if (!rep || rep->totalSent >= SC_SMALL) {
+        return SC_BULK;
+    }
+    if (rep->mode != 'r' || rep->cmd.mode == 'l' || rep->cmd.mode == 'd' ||
+        rep->cmd.mode == 's') {
+        return SC_INTERACTIVE;
+    }
+    if (rep->cmd.mode == 'g' && !rep->cmd.stripes &&
+        rep->cmd.fileLen <= SC_SMALL) {
+        return SC_INTERACTIVE;
+    }
+    return SC_BULK;
+}
+
+/*******************************************************************************
+*      Function: _readyFlow()
+*   Description: Hands a socket that has become writable to the scheduler.
+*                The socket stops being watched for writability until the
+*                scheduler finds it blocked or idle again.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Flow *f - The socket's flow.
+* Preconditions: The socket is open.
+*       Returns: None.
+*******************************************************************************/
+
+void _readyFlow(struct EventLoop *loop, struct Flow *f) {
+    if (f->active) {
+        return;
+    }
+    schedAdd(&loop->sched, f, _flowClass(f));
+    if (f->h->kind == H_CTRL) {
+        _updateCtrl(loop, f->h->owner);
+    } else {
+        _updateData(loop, f->h->owner);
+    }
+}
+
+/*******************************************************************************
+*      Function: _serveFlow()
+*   Description: Gives a flow its turn, letting it send up to its deficit as
+*                far as the token buckets allow. A flow that didn't use its
+*                whole allowance is blocked or has nothing to send, so it
+*                leaves the scheduler and its socket is watched again.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Flow *f - The flow, just taken off its list.
+*                off_t allow - The most body bytes it may send.
+* Preconditions: allow is positive.
+*       Returns: The number of body bytes sent.
+*******************************************************************************/
+
+off_t _serveFlow(struct EventLoop *loop, struct Flow *f, off_t allow) {
+    struct Conn *conn;
+    struct Reply *rep;
+    off_t sent;
+    int status;
+
+    if (f->h->kind == H_CTRL) {
+        conn = f->h->owner;
+        sent = _pumpCtrl(loop, conn, allow);
+        if (sent == allow && conn->ctrl.fd != -1 && conn->sendHead &&
+            conn->sendHead->state != RS_WORKING) {
+            f->deficit -= sent;
+            schedAdd(&loop->sched, f, _flowClass(f));
+        } else {
+            f->deficit = 0;
+            if (conn->ctrl.fd != -1) {
+                _updateCtrl(loop, conn);
+            }
+        }
+        return sent;
+    }
+
+    /* A finished reply has been freed along with its flow */
+    rep = f->h->owner;
+    status = _pumpData(loop, rep, allow, &sent);
+    if (status == 0 && sent == allow) {
+        f->deficit -= sent;
+        schedAdd(&loop->sched, f, _flowClass(f));
+    } else if (status == 0) {
+        f->deficit = 0;
+        _updateData(loop, rep);
+    }
+    return sent;
+}
+
+/*******************************************************************************
+*      Function: _runScheduler()
+*   Description: Sends from the flows that are ready, in deficit round robin
+*                order within each class and interactive flows first, until
+*                every flow is blocked, throttled or idle or SC_BATCH bytes
+*                have been sent. A flow whose connection, or the server, is
+*                out of tokens waits its turn until they are earned.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: None.
+*       Returns: The epoll_wait() timeout: -1 if no flow is ready, 0 if flows
+*                can send straight away, or the milliseconds until the next
+*                throttled flow may send.
+*******************************************************************************/
+
+int _runScheduler(struct EventLoop *loop) {
+    struct Scheduler *sc = &loop->sched;
+    unsigned long long now, wait = 0, w;
+    off_t batch = SC_BATCH, allow, sent;
+    struct Flow *f;
+    int cls, n, progress, throttled = 0;
+    long long avail;
+
+    now = shaperNow();
+    bucketRefill(&sc->global, now);
+    for (cls = 0; cls < SC_CLASSES && batch > 0; cls++) {
+        do {
+            progress = 0;
+            for (n = sc->count[cls]; n > 0 && batch > 0; n--) {
+                /* Out of server tokens, every flow keeps its place */
+                w = bucketWait(&sc->global);
+                if (w && sc->head[cls]) {
+                    wait = throttled && wait < w ? wait : w;
+                    throttled = 1;
+                    break;
+                }
+                f = schedPop(sc, cls);
+                if (!f) {
+                    break;
+                }
+                /* Out of connection tokens, the flow lets the others go */
+                bucketRefill(f->bucket, now);
+                w = bucketWait(f->bucket);
+                if (w) {
+                    wait = throttled && wait < w ? wait : w;
+                    throttled = 1;
+                    schedAdd(sc, f, cls);
+                    continue;
+                }
+                avail = bucketAvail(&sc->global);
+                if (bucketAvail(f->bucket) < avail) {
+                    avail = bucketAvail(f->bucket);
+                }
+
+                /* A throttled flow carries over no more than a quantum */
+                f->deficit += SC_QUANTUM;
+                if (f->deficit > 2 * SC_QUANTUM) {
+                    f->deficit = 2 * SC_QUANTUM;
+                }
+                allow = f->deficit < batch ? f->deficit : batch;
+                if (avail < allow) {
+                    allow = avail;
+                }
+                sent = _serveFlow(loop, f, allow);
+                bucketTake(&sc->global, sent);
+                bucketTake(f->bucket, sent);
+                batch -= sent;
+                progress = 1;
+            }
+        } while (progress && batch > 0 && sc->head[cls]);
+    }
+
+    /* Flows left over with bytes to spare in the batch are all throttled */
+    if (!sc->head[SC_INTERACTIVE] && !sc->head[SC_BULK]) {
+        return -1;
+    }
+    if (batch <= 0 || !throttled) {
+        return 0;
+    }
+    return (wait + 999999) / 1000000;
+}
+
+/*******************************************************************************
+*      Function: _runCmd()
+*   Description: Performs a client command. Runs on a worker thread, so it
+*                touches nothing but the reply itself.
+*    Parameters: void *arg - The struct Reply to fill in.
+* Preconditions: The reply holds the client command.
+*       Returns: None.
+*******************************************************************************/
+
+void _runCmd(void *arg) {
+    struct Reply *rep = arg;
+
+    /* Generate return message body */
+    rep->mode = handleCmd(&rep->cmd, &rep->body, rep->lists, rep->files,
+                          rep->uring, rep->manifest, rep->metrics, rep->host,
+                          rep->serverPort);
+    rep->bodyLen = rep->cmd.fileFD != -1 || rep->cmd.cached ?
+                   rep->cmd.fileLen : (off_t) rep->body.size;
+    if (rep->mode != 'r') {
+        return;
+    }
+    if (rep->cmd.dirFD != -1 || rep->cmd.walk || rep->cmd.delta) {
+        rep->paged = 1;
+    }
+
+    /* Compressed or checksummed files are read a page at a time, so each
+     * page is processed while it is in cache. Striped files are sent raw,
+     * since each stripe would need its own stream. */
+    if (rep->cmd.stripes ||
+        !(rep->cmd.flags & (FLAG_COMPRESS | FLAG_CHECKSUM))) {
+        return;
+    }
+    if (rep->cmd.flags & FLAG_COMPRESS) {
+        rep->codec = initCodec(rep->bufs);
+    }
+    if (rep->cmd.fileFD != -1 || rep->cmd.cached) {
+        rep->paged = 1;
+        _runPage(rep);
+    } else {
+        _sealPage(rep);
+    }
+}
+
+/*******************************************************************************
+*      Function: _startStripes()
+*   Description: Starts the data connections of a striped reply. The file
+*                range is split into disjoint stripes, each sent over its own
+*                connection to the client's data port after a header giving
+*                its offset and length. Stripes are never smaller than
+*                STRIPE_MIN, so small files use fewer connections.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply whose file is striped.
+* Preconditions: rep->cmd.fileFD is open or rep->cmd.cached is set, and
+*                rep->bodyLen is the length of the range to send.
+*       Returns: 0 on success, -1 if the connection had to be closed.
+*******************************************************************************/
+
+int _startStripes(struct EventLoop *loop, struct Reply *rep) {
+    struct Conn *conn = rep->conn;
+    struct Reply *stripe;
+    char dataPort[6];
+    off_t stripeLen, off = 0;
+    int i, n;
+
+    n = (rep->bodyLen + STRIPE_MIN - 1) / STRIPE_MIN;
+    if (n > rep->cmd.stripes) {
+        n = rep->cmd.stripes;
+    }
+    memset(dataPort, 0, sizeof(dataPort));
+    sprintf(dataPort, "%d", rep->cmd.dataPort);
+
+    for (i = 0; i < n; i++) {
+        stripeLen = (rep->bodyLen - off) / (n - i);
+
+        stripe = calloc(1, sizeof(struct Reply));
+        assert(stripe);
+        stripe->conn = conn;
+        stripe->cmd = rep->cmd;
+        stripe->cmd.rangeOff = rep->cmd.rangeOff + off;
+        /* Stripes share a cached file, or each get their own descriptor */
+        if (rep->cmd.cached) {
+            fileCacheHold(rep->cmd.cached);
+        } else {
+            stripe->cmd.fileFD = dup(rep->cmd.fileFD);
+        }
+        stripe->mode = 'r';
+        stripe->bodyLen = stripeLen;
+        stripe->hdrLen = packStripeHeader(stripe->header,
+                                          stripe->cmd.rangeOff, stripeLen);
+        stripe->data.kind = H_DATA;
+        stripe->data.owner = stripe;
+        stripe->flow.h = &stripe->data;
+        stripe->flow.bucket = &conn->bucket;
+        stripe->flow.events = EPOLLOUT;
+        stripe->state = RS_CONNECTING;
+        stripe->serverPort = loop->serverPort;
+        stripe->metrics = loop->metrics;
+        bufPoolGet(loop->bufs, &stripe->body);
+
+        stripe->next = conn->replies;
+        if (conn->replies) {
+            conn->replies->prev = stripe;
+        }
+        conn->replies = stripe;
+        conn->nReplies++;
+
+        stripe->data.fd = initDataConn(conn->inetAddr, dataPort);
+        if ((!stripe->cmd.cached && stripe->cmd.fileFD == -1) ||
+            stripe->data.fd == -1 ||
+            _watch(loop, &stripe->data, EPOLL_CTL_ADD, EPOLLOUT) == -1) {
+            _closeConn(loop, conn);
+            return -1;
+        }
+        off += stripeLen;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _startReply()
+*   Description: Starts sending a reply whose command has been performed.
+*                Session replies and legacy errors are queued on the control
+*                connection, while successful legacy replies start a
+*                connection to the client's data port. Striped replies do
+*                both.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+* Preconditions: rep->mode, rep->body and rep->bodyLen have been set.
+*       Returns: None.
+*******************************************************************************/
+
+void _startReply(struct EventLoop *loop, struct Reply *rep) {
+    struct Conn *conn = rep->conn;
+    char dataPort[6];
+    char msg[64];
+
+    /* Count errors by their message */
+    if (rep->mode == 'e') {
+        snprintf(msg, sizeof(msg), "%.*s", (int) rep->body.size,
+                 rep->body.buffer);
+        metricsErrorMsg(loop->metrics, msg);
+    }
+    /* Legacy error messages carry the server port */
+    if (rep->mode == 'e' && !rep->cmd.version) {
+        rep->cmd.dataPort = strtol(loop->serverPort, NULL, 10);
+    }
+    /* A striped file is sent over data connections, and the reply on the
+     * control connection only gives its length */
+    if (rep->mode == 'r' && rep->cmd.stripes &&
+        (rep->cmd.fileFD != -1 || rep->cmd.cached)) {
+        rep->hdrLen = packHeader(&rep->cmd, rep->mode, FLAG_STRIPED,
+                                 rep->header, rep->bodyLen);
+        if (_startStripes(loop, rep) == -1) {
+            return;
+        }
+        if (rep->cmd.fileFD != -1) {
+            close(rep->cmd.fileFD);
+            rep->cmd.fileFD = -1;
+        }
+        if (rep->cmd.cached) {
+            fileCacheRelease(rep->cmd.cached);
+            rep->cmd.cached = NULL;
+        }
+        rep->bodyLen = 0;
+    } else {
+        /* Successful replies to chunked requests, paged replies and
+         * compressed or checksummed replies are framed in chunks. Their
+         * header carries no length, except that a file's length when it
+         * was opened is given as a hint for the client to reserve space. */
+        if (rep->mode == 'r' && ((rep->cmd.flags & FLAG_CHUNKED) ||
+                                 rep->paged || rep->codec ||
+                                 (rep->cmd.flags & FLAG_CHECKSUM))) {
+            rep->flags = FLAG_CHUNKED | (rep->codec ? FLAG_COMPRESS : 0) |
+                         (rep->cmd.flags & FLAG_CHECKSUM);
+            rep->chunkHdrLen = CHUNK_HDR_LEN;
+            rep->chunkHdrSent = CHUNK_HDR_LEN;
+        }
+        rep->hdrLen = packHeader(&rep->cmd, rep->mode, rep->flags,
+                                 rep->header, !rep->flags ? rep->bodyLen :
+                                 (rep->cmd.mode == 'g' ||
+                                  rep->cmd.mode == 'u') && rep->mode == 'r' ?
+                                 rep->cmd.fileLen : 0);
+    }
+
+    /* Queue the reply on the ctrl conn */
+    if (rep->mode == 'e' || conn->session) {
+        rep->state = RS_SEND_HDR;
+        if (conn->sendTail) {
+            conn->sendTail->sendNext = rep;
+        } else {
+            conn->sendHead = rep;
+        }
+        conn->sendTail = rep;
+        _updateCtrl(loop, conn);
+        return;
+    }
+
+    /* Otherwise, connect to the client's data port */
+    memset(dataPort, 0, sizeof(dataPort));
+    sprintf(dataPort, "%d", rep->cmd.dataPort);
+    rep->data.fd = initDataConn(conn->inetAddr, dataPort);
+    rep->state = RS_CONNECTING;
+    rep->flow.events = EPOLLOUT;
+    if (rep->data.fd == -1 ||
+        _watch(loop, &rep->data, EPOLL_CTL_ADD, EPOLLOUT) == -1) {
+        _closeConn(loop, conn);
+    }
+}
+
+/*******************************************************************************
+*      Function: _dispatch()
+*   Description: Hands a fully received client command to the worker pool.
+*                If the pool is saturated the command waits for a worker,
+*                and no more commands are read from the connection until
+*                it has one.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection holding the command.
+* Preconditions: conn->cmd holds the complete client command.
+*       Returns: None.
+*******************************************************************************/
+
+void _dispatch(struct EventLoop *loop, struct Conn *conn) {
+    struct Reply *rep;
+
+    /* Output user requested action */
+    printClientReq(&conn->cmd);
+
+    rep = calloc(1, sizeof(struct Reply));
+    assert(rep);
+    rep->conn = conn;
+    rep->cmd = conn->cmd;
+    rep->cmd.fileFD = -1;
+    rep->cmd.cached = NULL;
+    rep->cmd.dirFD = -1;
+    rep->cmd.archFD = -1;
+    rep->cmd.walk = NULL;
+    rep->cmd.delta = NULL;
+    rep->cmd.upload = NULL;
+    /* The reply takes over a body held on the heap */
+    conn->cmd.sigBody.buffer = NULL;
+    rep->data.fd = -1;
+    rep->data.kind = H_DATA;
+    rep->data.owner = rep;
+    rep->flow.h = &rep->data;
+    rep->flow.bucket = &conn->bucket;
+    rep->state = RS_WORKING;
+    rep->serverPort = loop->serverPort;
+    rep->lists = loop->lists;
+    rep->files = loop->files;
+    rep->uring = loop->uring;
+    rep->manifest = loop->manifest;
+    rep->metrics = loop->metrics;
+    rep->bufs = loop->bufs;
+    clock_gettime(CLOCK_MONOTONIC, &rep->start);
+    _clientHost(loop, conn);
+    strcpy(rep->host, conn->host);
+    bufPoolGet(loop->bufs, &rep->body);
+
+    rep->next = conn->replies;
+    if (conn->replies) {
+        conn->replies->prev = rep;
+    }
+    conn->replies = rep;
+    conn->nReplies++;
+
+    /* A legacy connection carries a single command, and a put's data
+     * follows it before the next one */
+    conn->state = conn->session ? CS_RECV_HDR : CS_REPLYING;
+    if (rep->cmd.mode == 'p' && rep->cmd.version >= 2) {
+        rep->cmd.upload = initUpload(rep->cmd.putLen);
+        conn->upload = rep;
+        conn->state = CS_RECV_DATA;
+    }
+    if (_updateCtrl(loop, conn) == -1) {
+        return;
+    }
+
+    if (!_submit(loop, rep, _runCmd)) {
+        conn->poolWaiting = 1;
+        _updateCtrl(loop, conn);
+    }
+}
+
+/*******************************************************************************
+*      Function: _wakePoolWaiters()
+*   Description: Submits the replies waiting for the pool, oldest first, for
+*                as long as it has room. A connection whose command was
+*                waiting goes back to reading commands.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _wakePoolWaiters(struct EventLoop *loop) {
+    struct Reply *rep, *next;
+    struct Conn *conn;
+    void (*task)(void *);
+
+    while ((rep = loop->poolWait)) {
+        next = rep->poolNext;
+        task = rep->task;
+        conn = rep->conn;
+        rep->task = NULL;
+        if (poolSubmit(loop->pool, task, rep) == -1) {
+            rep->task = task;
+            return;
+        }
+        loop->poolWait = next;
+        if (!next) {
+            loop->poolWaitTail = NULL;
+        }
+        if (task == _runCmd && conn->poolWaiting) {
+            conn->poolWaiting = 0;
+            if (_updateCtrl(loop, conn) == 0) {
+                _recvCmd(loop, conn);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _poolEvent()
+*   Description: Collects commands finished by the worker pool and starts
+*                sending their replies, then hands the pool the work that
+*                was waiting for it.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _poolEvent(struct EventLoop *loop) {
+    void *done[MAX_EVENTS];
+    struct Reply *rep;
+    int i, n;
+
+    n = poolReap(loop->pool, done, MAX_EVENTS);
+    for (i = 0; i < n; i++) {
+        rep = done[i];
+        /* Drop replies whose client has already gone */
+        if (!rep->conn) {
+            _freeReply(rep);
+            continue;
+        }
+        /* A listing page for a reply that is already being sent */
+        if (rep->hdrLen) {
+            rep->state = RS_SEND_BODY;
+            _updateCtrl(loop, rep->conn);
+            continue;
+        }
+        /* A put whose file is open, or was refused, takes its data */
+        if (rep->cmd.upload && !rep->cmd.upload->done) {
+            rep->state = RS_RECEIVING;
+            if (_updateCtrl(loop, rep->conn) == 0) {
+                _recvCmd(loop, rep->conn);
+            }
+            continue;
+        }
+        rep->state = RS_SEND_HDR;
+        _startReply(loop, rep);
+    }
+    _wakePoolWaiters(loop);
+}
+
+/*******************************************************************************
+*      Function: _parseCmd()
+*   Description: Parses the next header or body out of the receive buffer.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: conn is in the CS_RECV_HDR or CS_RECV_BODY state.
+*       Returns: 1 if something was parsed, 0 if more bytes are needed, -1 if
+*                the connection was closed.
+*******************************************************************************/
+
+int _parseCmd(struct EventLoop *loop, struct Conn *conn) {
+    unsigned int avail = conn->inEnd - conn->inStart;
+    char *p = conn->in + conn->inStart;
+    unsigned int need;
+
+    if (conn->state == CS_RECV_HDR) {
+        /* Every header is at least HEADER_LEN bytes, which is enough to
+         * tell the formats apart */
+        need = avail >= HEADER_LEN ? requestHeaderLen(p) : HEADER_LEN;
+        if (avail < need) {
+            return 0;
+        }
+        /* Process the header into the struct */
+        processHeader(p, &conn->cmd);
+        conn->inStart += need;
+
+        /* The first header decides whether this is a session, and a
+         * session must keep using extended headers */
+        if (conn->cmd.version) {
+            conn->session = 1;
+        }
+        if (!conn->cmd.version != !conn->session) {
+            fprintf(stderr, "ftserver: mixed header formats\n");
+            metricsError(loop->metrics, E_MALFORMED);
+            _closeConn(loop, conn);
+            return -1;
+        }
+        if (conn->cmd.len > (conn->cmd.mode == 'u' && conn->cmd.version >= 2 ?
+                             DELTA_BODY_MAX : BODY_MAX)) {
+            fprintf(stderr, "ftserver: command body too long\n");
+            metricsError(loop->metrics, E_MALFORMED);
+            _closeConn(loop, conn);
+            return -1;
+        }
+        /* Delta signatures can outgrow the receive buffer, so a delta
+         * body is gathered as it arrives in a buffer from the pool, where
+         * it counts against the memory budget */
+        conn->cmd.sigBody.buffer = NULL;
+        if (conn->cmd.mode == 'u' && conn->cmd.version >= 2) {
+            bufPoolGet(loop->bufs, &conn->cmd.sigBody);
+            dynBufReserve(&conn->cmd.sigBody, conn->cmd.len);
+            conn->bodyGot = 0;
+        }
+        conn->state = CS_RECV_BODY;
+        return 1;
+    }
+
+    if (conn->cmd.sigBody.buffer) {
+        need = conn->cmd.len - conn->bodyGot;
+        if (need > avail) {
+            need = avail;
+        }
+        memcpy(conn->cmd.sigBody.buffer + conn->bodyGot, p, need);
+        conn->bodyGot += need;
+        conn->inStart += need;
+        if (conn->bodyGot < conn->cmd.len) {
+            return 0;
+        }
+        p = conn->cmd.sigBody.buffer;
+    } else if (avail < conn->cmd.len) {
+        return 0;
+    } else {
+        conn->inStart += conn->cmd.len;
+    }
+    if (processBody(p, &conn->cmd) == -1) {
+        fprintf(stderr, "ftserver: malformed command body\n");
+        metricsError(loop->metrics, E_MALFORMED);
+        _closeConn(loop, conn);
+        return -1;
+    }
+    _dispatch(loop, conn);
+    return conn->ctrl.fd == -1 ? -1 : 1;
+}
+
+/*******************************************************************************
+*      Function: _waitForMemory()
+*   Description: Stops reading commands from a connection until the reply
+*                buffer pool drops back under its budget.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: The buffer pool is full.
+*       Returns: None.
+*******************************************************************************/
+
+void _waitForMemory(struct EventLoop *loop, struct Conn *conn) {
+    if (!conn->memWaiting) {
+        conn->memWaiting = 1;
+        conn->waitNext = loop->memWait;
+        loop->memWait = conn;
+    }
+    _updateCtrl(loop, conn);
+}
+
+/*******************************************************************************
+*      Function: _wakeMemWaiters()
+*   Description: Resumes connections waiting for buffer memory, for as long
+*                as the buffer pool stays under its budget.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _wakeMemWaiters(struct EventLoop *loop) {
+    struct Conn *conn;
+
+    while (loop->memWait && !bufPoolFull(loop->bufs)) {
+        conn = loop->memWait;
+        loop->memWait = conn->waitNext;
+        conn->memWaiting = 0;
+        if (_updateCtrl(loop, conn) == 0) {
+            _recvCmd(loop, conn);
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _runCommit()
+*   Description: Stores a put's file once its data has arrived. Runs on a
+*                worker thread, so it touches nothing but the reply itself.
+*    Parameters: void *arg - The struct Reply of the put.
+* Preconditions: The upload is done.
+*       Returns: None.
+*******************************************************************************/
+
+void _runCommit(void *arg) {
+    struct Reply *rep = arg;
+
+    rep->mode = commitUpload(&rep->cmd, &rep->body);
+    rep->bodyLen = rep->body.size;
+    if (rep->mode == 'r') {
+        metricsAdd(rep->metrics, M_STORED, 1);
+        printf("Stored \"%s\" from %s.\n", rep->cmd.fName, rep->host);
+    } else {
+        printf("Cannot store \"%s\". Sending error message to %s:%s.\n",
+               rep->cmd.fName, rep->host, rep->serverPort);
+    }
+}
+
+/*******************************************************************************
+*      Function: _endUpload()
+*   Description: Finishes receiving a put's data. The file is stored on the
+*                worker pool, once a worker is free, before the reply is
+*                sent; a put that was refused is answered at once. The
+*                connection goes back to receiving commands.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply of the put.
+* Preconditions: Every byte of the upload has been received.
+*       Returns: None.
+*******************************************************************************/
+
+void _endUpload(struct EventLoop *loop, struct Reply *rep) {
+    struct Conn *conn = rep->conn;
+
+    rep->cmd.upload->done = 1;
+    conn->upload = NULL;
+    conn->state = CS_RECV_HDR;
+    if (_updateCtrl(loop, conn) == -1) {
+        return;
+    }
+
+    if (rep->mode == 'r') {
+        rep->state = RS_WORKING;
+        _submit(loop, rep, _runCommit);
+        return;
+    }
+    rep->state = RS_SEND_HDR;
+    _startReply(loop, rep);
+}
+
+/*******************************************************************************
+*      Function: _runDrain()
+*   Description: Writes the part of a put's data received so far to its
+*                file. Runs on a worker thread, so it touches nothing but
+*                the reply itself.
+*    Parameters: void *arg - The struct Reply of the put.
+* Preconditions: Received bytes of the upload are waiting to be written.
+*       Returns: None.
+*******************************************************************************/
+
+void _runDrain(void *arg) {
+    struct Reply *rep = arg;
+
+    uploadDrain(rep->cmd.upload);
+}
+
+/*******************************************************************************
+*      Function: _recvUpload()
+*   Description: Receives the data that follows a put, starting with any
+*                bytes that arrived with the request. The data is only
+*                received here; once the upload's pipe or buffer is full,
+*                the socket runs dry or UP_SLICE bytes have been taken, a
+*                worker writes it to the file while the connection stops
+*                reading. Level-triggered epoll reports the rest.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: conn is in the CS_RECV_DATA state.
+*       Returns: 1 once the data has all arrived, 0 if more is needed, -1 if
+*                the connection was closed.
+*******************************************************************************/
+
+int _recvUpload(struct EventLoop *loop, struct Conn *conn) {
+    struct Reply *rep = conn->upload;
+    struct Upload *up = rep->cmd.upload;
+    unsigned int avail = conn->inEnd - conn->inStart;
+    off_t budget = UP_SLICE;
+    ssize_t status;
+
+    /* A worker is still creating the file or writing to it */
+    if (rep->state == RS_WORKING) {
+        return 0;
+    }
+
+    if (avail > up->len - up->recvd) {
+        avail = up->len - up->recvd;
+    }
+    if (avail > 0) {
+        uploadQueue(up, conn->in + conn->inStart, avail);
+        conn->inStart += avail;
+        metricsAdd(loop->metrics, M_BYTES_RECV, avail);
+    }
+
+    while (up->recvd < up->len && budget > 0) {
+        status = uploadRecv(up, conn->ctrl.fd, loop->upBuf, budget);
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (status == 0) {
+            fprintf(stderr, "ftserver: Client ended connection.\n");
+            _closeConn(loop, conn);
+            return -1;
+        }
+        if (status == -1) {
+            perror("ftserver: recv");
+            _closeConn(loop, conn);
+            return -1;
+        }
+        budget -= status;
+        metricsAdd(loop->metrics, M_BYTES_RECV, status);
+    }
+
+    /* Hand what has arrived to a worker, and resume once it is written */
+    if (uploadPending(up)) {
+        rep->state = RS_WORKING;
+        _submit(loop, rep, _runDrain);
+        return _updateCtrl(loop, conn) == -1 ? -1 : 0;
+    }
+    if (up->recvd < up->len) {
+        return 0;
+    }
+
+    _endUpload(loop, rep);
+    return conn->ctrl.fd == -1 ? -1 : 1;
+}
+
+/*******************************************************************************
+*      Function: _recvCmd()
+*   Description: Parses every complete command in the receive buffer, reading
+*                more from the socket as needed, and receives the data that
+*                follows a put. Stops once a legacy command has arrived or a
+*                session reaches its pipelining limit.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _recvCmd(struct EventLoop *loop, struct Conn *conn) {
+    ssize_t status;
+    int parsed;
+
+    while (conn->state == CS_RECV_DATA ||
+           ((conn->state == CS_RECV_HDR || conn->state == CS_RECV_BODY) &&
+            conn->nReplies < SESSION_DEPTH)) {
+        if (conn->state == CS_RECV_DATA) {
+            if (_recvUpload(loop, conn) != 1) {
+                return;
+            }
+            continue;
+        }
+        /* Hold new commands back while a command waits for a worker */
+        if (conn->state == CS_RECV_HDR && conn->poolWaiting) {
+            return;
+        }
+        /* and while reply buffers are over budget */
+        if (conn->state == CS_RECV_HDR && bufPoolFull(loop->bufs)) {
+            _waitForMemory(loop, conn);
+            return;
+        }
+        parsed = _parseCmd(loop, conn);
+        if (parsed == -1) {
+            return;
+        }
+        if (parsed == 1) {
+            continue;
+        }
+
+        /* Make room and receive more of the command */
+        if (conn->inStart > 0) {
+            memmove(conn->in, conn->in + conn->inStart,
+                    conn->inEnd - conn->inStart);
+            conn->inEnd -= conn->inStart;
+            conn->inStart = 0;
+        }
+        status = recv(conn->ctrl.fd, conn->in + conn->inEnd,
+                      IN_BUF_LEN - conn->inEnd, 0);
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                             errno == EINTR)) {
+            return;
+        }
+        /* A session client that has sent all of its commands */
+        if (status == 0 && conn->session && conn->state == CS_RECV_HDR &&
+            conn->inEnd == 0) {
+            conn->state = CS_DRAINING;
+            if (conn->nReplies == 0) {
+                _closeConn(loop, conn);
+            } else {
+                _updateCtrl(loop, conn);
+            }
+            return;
+        }
+        /* Handle socket closure */
+        if (status == 0) {
+            fprintf(stderr, "ftserver: Client ended connection.\n");
+            _closeConn(loop, conn);
+            return;
+        }
+        /* Handle errors */
+        if (status == -1) {
+            perror("ftserver: recv");
+            _closeConn(loop, conn);
+            return;
+        }
+        conn->inEnd += status;
+    }
+}
+
+/*******************************************************************************
+*      Function: _ctrlEvent()
+*   Description: Handles readiness on a control connection.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Conn *conn - The connection.
+*                unsigned int events - The epoll events reported.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _ctrlEvent(struct EventLoop *loop, struct Conn *conn,
+                unsigned int events) {
+    char discard[64];
+    ssize_t status;
+
+    /* Wait for the client to hang up once its reply has been sent */
+    if (conn->state == CS_LINGER) {
+        status = recv(conn->ctrl.fd, discard, sizeof(discard), 0);
+        if (status == 0 || (status == -1 && errno != EAGAIN &&
+                            errno != EWOULDBLOCK && errno != EINTR)) {
+            _closeConn(loop, conn);
+        }
+        return;
+    }
+
+    /* The client went away */
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        _closeConn(loop, conn);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        _readyFlow(loop, &conn->flow);
+    }
+    if (conn->ctrl.fd != -1 && (events & EPOLLIN)) {
+        _recvCmd(loop, conn);
+    }
+}
+
+/*******************************************************************************
+*      Function: _dataEvent()
+*   Description: Handles readiness on a data connection, finishing the
+*                connect() and then handing the reply to the scheduler.
+*    Parameters: struct EventLoop *loop - The event loop.
+*                struct Reply *rep - The reply.
+*                unsigned int events - The epoll events reported.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _dataEvent(struct EventLoop *loop, struct Reply *rep,
+                unsigned int events) {
+    struct Conn *conn = rep->conn;
+    int err;
+
+    if (rep->state == RS_CONNECTING) {
+        err = connectResult(rep->data.fd);
+        if (err) {
+            fprintf(stderr, "ftserver: connect: %s\n", strerror(err));
+            _closeConn(loop, conn);
+            return;
+        }
+        rep->state = RS_SEND_HDR;
+    }
+
+    if (events & EPOLLERR) {
+        _closeConn(loop, conn);
+        return;
+    }
+
+    _readyFlow(loop, &rep->flow);
+}
+
+/*******************************************************************************
+*      Function: _statsEvent()
+*   Description: Prints the server stats after a SIGUSR1.
+*    Parameters: struct EventLoop *loop - The event loop.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _statsEvent(struct EventLoop *loop) {
+    struct signalfd_siginfo info;
+    struct DynBuf report;
+
+    /* Several signals may have been merged into one read */
+    while (read(loop->statsSignal.fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    initDynBuf(&report);
+    metricsDump(loop->metrics, &report);
+    printf("----------------------\n");
+    fwrite(report.buffer, 1, report.size, stdout);
+    freeDynBuf(&report);
+}
+
+/*******************************************************************************
+*      Function: runEventLoop()
+*   Description: Runs the server event loop forever.
+*    Parameters: int servFD - The listening socket file descriptor.
+*                struct ServerOpts *opts - The validated server options.
+* Preconditions: servFD is bound and listening.
+*       Returns: None.
+*******************************************************************************/
+
+void runEventLoop(int servFD, struct ServerOpts *opts) {
+    struct epoll_event events[MAX_EVENTS];
+    struct EventLoop loop;
+    struct Handle *h;
+    struct Conn *dead;
+    struct Reply *rep;
+    int i, nReady, timeout = -1;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.serverPort = opts->port;
+    loop.listen.fd = servFD;
+    loop.listen.kind = H_LISTEN;
+    loop.pool = initPool(opts->nThreads, opts->queueDepth);
+    loop.poolDone.fd = loop.pool->doneFD;
+    loop.poolDone.kind = H_POOL;
+    loop.lists = initListCache(".");
+    loop.files = initFileCache(opts->cacheBudget);
+    loop.manifest = initManifest(opts->hashing);
+    if (opts->uring) {
+        loop.uring = initUring(opts->nThreads);
+    }
+    if (opts->resolveTTL > 0) {
+        loop.resolver = initResolver(opts->resolveTTL);
+    }
+    loop.metrics = initMetrics();
+    loop.bufs = initBufPool(opts->bufferBudget);
+    initScheduler(&loop.sched, opts->globalRate, opts->connRate);
+    loop.upBuf = malloc(UP_BUF_LEN);
+    assert(loop.upBuf);
+    loop.statsSignal.fd = initStatsSignal();
+    loop.statsSignal.kind = H_SIGNAL;
+    loop.listChanged.fd = loop.lists->inotifyFD;
+    loop.listChanged.kind = H_INOTIFY;
+
+    loop.epfd = epoll_create1(0);
+    if (loop.epfd == -1) {
+        perror("ftserver: epoll_create1");
+        exit(2);
+    }
+    if (setNonBlocking(servFD) == -1 ||
+        _watch(&loop, &loop.listen, EPOLL_CTL_ADD, EPOLLIN) == -1 ||
+        _watch(&loop, &loop.poolDone, EPOLL_CTL_ADD, EPOLLIN) == -1) {
+        exit(2);
+    }
+    if (loop.listChanged.fd != -1 &&
+        _watch(&loop, &loop.listChanged, EPOLL_CTL_ADD, EPOLLIN) == -1) {
+        exit(2);
+    }
+    if (loop.statsSignal.fd != -1 &&
+        _watch(&loop, &loop.statsSignal, EPOLL_CTL_ADD, EPOLLIN) == -1) {
+        exit(2);
+    }
+
+    while (1) {
+        nReady = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        if (nReady == -1) {
+            if (errno != EINTR) {
+                perror("ftserver: epoll_wait");
+            }
+            continue;
+        }
+
+        for (i = 0; i < nReady; i++) {
+            h = events[i].data.ptr;
+            /* Skip events for handles closed earlier in this batch */
+            if (h->fd == -1) {
+                continue;
+            }
+            if (h->kind == H_LISTEN) {
+                _acceptConns(&loop);
+            } else if (h->kind == H_POOL) {
+                _poolEvent(&loop);
+            } else if (h->kind == H_INOTIFY) {
+                listCacheEvents(loop.lists);
+            } else if (h->kind == H_SIGNAL) {
+                _statsEvent(&loop);
+            } else if (h->kind == H_CTRL) {
+                _ctrlEvent(&loop, h->owner, events[i].events);
+            } else {
+                _dataEvent(&loop, h->owner, events[i].events);
+            }
+        }
+
+        /* Send from the sockets found ready, as the rate limits allow */
+        timeout = _runScheduler(&loop);
+
+        /* Free the connections closed during this batch */
+        while (loop.graveyard) {
+            dead = loop.graveyard;
+            loop.graveyard = dead->next;
+            while ((rep = dead->replies)) {
+                _unlinkReply(rep);
+                _freeReply(rep);
+            }
+            if (dead->cmd.sigBody.buffer) {
+                freeDynBuf(&dead->cmd.sigBody);
+            }
+            free(dead);
+        }
+        _wakeMemWaiters(&loop);
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,139 @@
+/*******************************************************************************
+*      Filename: event.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for event.c. Please see event.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <sys/epoll.h>
+
+#include "archive.h"
+#include "codec.h"
+#include "delta.h"
+#include "command.h"
+#include "dirlist.h"
+#include "dyn_buffer.h"
+#include "listcache.h"
+#include "metrics.h"
+#include "pool.h"
+#include "resolver.h"
+#include "shaper.h"
+#include "socket.h"
+#include "signal.h"
+#include "upload.h"
+#include "validate.h"
+
+#define MAX_EVENTS   64         /* Events handled per epoll_wait() call */
+#define HOST_LEN     1024       /* Client hostname buffer length */
+#define REPLY_SLICE  1048576    /* Most bytes handed to one send call */
+#define IN_BUF_LEN   4096       /* Control connection receive buffer length */
+#define SESSION_DEPTH 32        /* Pipelined commands in flight per session */
+#define STRIPE_MIN   1048576    /* Smallest stripe worth a data connection */
+
+/* Kinds of file descriptors watched by the event loop */
+enum HandleKind { H_LISTEN, H_CTRL, H_DATA, H_POOL, H_INOTIFY, H_SIGNAL };
+
+/* Control connection states. Legacy connections carry one command and wait
+ * in CS_LINGER for the client to hang up; sessions return to CS_RECV_HDR
+ * after each command and drain their replies once the client stops sending.
+ * A session receives the data of a put in CS_RECV_DATA. */
+enum ConnState { CS_RECV_HDR, CS_RECV_BODY, CS_RECV_DATA, CS_REPLYING,
+                 CS_LINGER, CS_DRAINING };
+
+/* Reply states. A chunked reply sends its body in RS_SEND_BODY and finishes
+ * in RS_SEND_END once the terminating chunk is on its way. The reply to a put
+ * waits in RS_RECEIVING while the file's data arrives. */
+enum ReplyState { RS_WORKING, RS_RECEIVING, RS_CONNECTING, RS_SEND_HDR,
+                  RS_SEND_BODY, RS_SEND_END };
+
+/* A file descriptor registered with epoll. The event data points back at
+ * this struct so that the loop can find the connection it belongs to. */
+struct Handle {
+    int fd;                /* The watched file descriptor */
+    int kind;              /* One of enum HandleKind */
+    void *owner;           /* The struct Conn or struct Reply owning the fd */
+};
+
+/* An outgoing response and its send progress */
+struct Reply {
+    struct Handle data;    /* Data connection, or fd -1 if sent on ctrl */
+    struct Conn *conn;     /* The control connection that asked for it, or
+                            * NULL if it closed while the command ran */
+    struct Reply *prev;    /* Neighbours in the connection's reply list */
+    struct Reply *next;
+    struct Reply *sendNext; /* Next reply queued on the ctrl conn */
+    struct ClientCmd cmd;  /* The command being answered */
+    struct DynBuf body;    /* Body bytes when not streamed from a file */
+    char mode;             /* Response mode, 'r' or 'e' */
+    char header[REPLY_HEADER_MAX]; /* The packed response header */
+    int hdrLen;            /* Length of the packed header */
+    int state;             /* One of enum ReplyState */
+    int hdrSent;           /* Header bytes sent so far */
+    off_t bodySent;        /* Body bytes sent so far */
+    off_t bodyLen;         /* Total body length, or the length known so far
+                            * for a chunked reply */
+    char flags;            /* Reply flags, FLAG_CHUNKED for chunked framing */
+    char chunkHdr[CHUNK_HDR_LEN + CHECKSUM_LEN]; /* Length prefix of the
+                            * current chunk, and the trailer after the last */
+    int chunkHdrLen;       /* Length of the packed prefix and trailer */
+    int chunkHdrSent;      /* Prefix bytes sent so far */
+    off_t chunkLeft;       /* Bytes of the current chunk still to send */
+    int paged;             /* Nonzero if the body is read into body a page
+                            * at a time by the worker pool */
+    off_t pageOff;         /* Offset of the next file page in the range */
+    struct Codec *codec;   /* Compression state, or NULL */
+    int pageCompressed;    /* Nonzero if body holds deflated data */
+    unsigned long checksum; /* CRC-32 of the pages read so far */
+    char host[HOST_LEN];   /* Client hostname, for the worker's messages */
+    const char *serverPort; /* Server listening port */
+    struct ListCache *lists; /* Directory listing cache */
+    struct FileCache *files; /* Hot file cache */
+    struct Uring *uring;   /* io_uring backend, or NULL */
+    struct Manifest *manifest; /* Content hash manifest */
+    struct Metrics *metrics; /* Server metrics */
+    struct BufPool *bufs;  /* Pool of body and compression buffers */
+    struct timespec start; /* When the command was received, or zero for a
+                            * stripe */
+    off_t totalSent;       /* Body bytes sent over all pages */
+    struct Flow flow;      /* Scheduling state of the data connection */
+    void (*task)(void *);  /* Work waiting for a worker, or NULL */
+    struct Reply *poolNext; /* Next reply waiting for a worker */
+};
+
+/* A client control connection */
+struct Conn {
+    struct Handle ctrl;    /* The control socket */
+    int state;             /* One of enum ConnState */
+    int session;           /* Nonzero once an extended header has arrived */
+    unsigned int events;   /* Current epoll interest for the ctrl socket */
+    char in[IN_BUF_LEN];   /* Received bytes not yet parsed */
+    unsigned int inStart;  /* Offset of the first unparsed byte */
+    unsigned int inEnd;    /* Offset past the last received byte */
+    unsigned int bodyGot;  /* Bytes of a heap-held command body received */
+    struct ClientCmd cmd;  /* The command being received */
+    struct Reply *replies; /* Every outstanding reply */
+    int nReplies;          /* Length of the reply list */
+    struct Reply *sendHead; /* Replies waiting to be sent on the ctrl conn */
+    struct Reply *sendTail;
+    struct Reply *upload;  /* Put whose data is being received, or NULL */
+    char host[HOST_LEN];   /* Client hostname */
+    struct sockaddr_storage addr; /* Client address, for hostname lookups */
+    socklen_t addrLen;
+    char inetAddr[INET6_ADDRSTRLEN]; /* Client IP address */
+    struct timespec accepted; /* When the connection was accepted */
+    int firstByteSent;     /* Nonzero once any reply byte has been sent */
+    int memWaiting;        /* Nonzero while commands wait for buffer memory */
+    int poolWaiting;       /* Nonzero while a command waits for a worker */
+    struct Flow flow;      /* Scheduling state of the ctrl connection */
+    struct TokenBucket bucket; /* Rate limit shared by all its sockets */
+    struct Conn *waitNext; /* Next connection waiting for buffer memory */
+    struct Conn *next;     /* Next closed connection awaiting release */
+};
+
+void runEventLoop(int, struct ServerOpts *);
+
+#endif
@@ -0,0 +1,424 @@
+/*******************************************************************************
+*      Filename: filecache.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: A size-bounded LRU cache of hot files. Each entry maps a
+*                whole file into memory and is keyed by its name together
+*                with the device, inode, mtime and size it had when mapped,
+*                so a replaced or modified file is never served stale. Replies
+*                send straight from the mapping without reopening or reading
+*                the file. Entries are reference counted: an entry evicted or
+*                invalidated while a reply is sending from it stays mapped
+*                until that reply releases it. A file truncated in place
+*                under its mapping faults with SIGBUS when the lost pages
+*                are read, so the server's own copies out of a mapping are
+*                guarded and end the reply early instead.
+*******************************************************************************/
+
+#include "filecache.h"
+
+/* The copy a thread is making out of a mapping, or NULL */
+__thread sigjmp_buf *fcGuard = NULL;
+pthread_once_t fcBusOnce = PTHREAD_ONCE_INIT;
+
+/*******************************************************************************
+*      Function: _hashName()
+*   Description: Hashes a file name to a bucket index.
+*    Parameters: const char *name - The file name.
+* Preconditions: None.
+*       Returns: The bucket index.
+*******************************************************************************/
+
+unsigned int _hashName(const char *name) {
+    unsigned int hash = 5381;
+
+    while (*name) {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+    return hash % FC_BUCKETS;
+}
+
+/*******************************************************************************
+*      Function: _busHandler()
+*   Description: Handles SIGBUS. A fault during a guarded copy abandons the
+*                copy; any other fault kills the server as it would have
+*                without the handler.
+*    Parameters: int sig - The signal number.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _busHandler(int sig) {
+    if (fcGuard) {
+        siglongjmp(*fcGuard, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*******************************************************************************
+*      Function: _installBusHandler()
+*   Description: Installs the SIGBUS handler.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _installBusHandler(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _busHandler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) {
+        perror("ftserver: sigaction");
+    }
+}
+
+/*******************************************************************************
+*      Function: _dropRef()
+*   Description: Drops a reference to an entry, unmapping and freeing it when
+*                the last one goes.
+*    Parameters: struct FileEntry *e - The entry.
+* Preconditions: The cache lock is held.
+*       Returns: None.
+*******************************************************************************/
+
+void _dropRef(struct FileEntry *e) {
+    if (--e->refs > 0) {
+        return;
+    }
+    if (munmap(e->map, e->size) != 0) {
+        perror("ftserver: munmap");
+    }
+    free(e);
+}
+
+/*******************************************************************************
+*      Function: _removeEntry()
+*   Description: Takes an entry out of the hash table and LRU list and drops
+*                the cache's reference to it.
+*    Parameters: struct FileCache *cache - The cache.
+*                struct FileEntry *e - The entry.
+* Preconditions: The cache lock is held. The entry is cached.
+*       Returns: None.
+*******************************************************************************/
+
+void _removeEntry(struct FileCache *cache, struct FileEntry *e) {
+    struct FileEntry **pp = &cache->buckets[_hashName(e->name)];
+
+    while (*pp != e) {
+        pp = &(*pp)->hashNext;
+    }
+    *pp = e->hashNext;
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        cache->newest = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache->oldest = e->prev;
+    }
+
+    cache->stats.used -= e->size;
+    _dropRef(e);
+}
+
+/*******************************************************************************
+*      Function: _touch()
+*   Description: Moves an entry to the newest end of the LRU list.
+*    Parameters: struct FileCache *cache - The cache.
+*                struct FileEntry *e - The entry.
+* Preconditions: The cache lock is held. The entry is cached.
+*       Returns: None.
+*******************************************************************************/
+
+void _touch(struct FileCache *cache, struct FileEntry *e) {
+    if (cache->newest == e) {
+        return;
+    }
+    /* Unlink */
+    e->prev->next = e->next;
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache->oldest = e->prev;
+    }
+    /* Relink at the front */
+    e->prev = NULL;
+    e->next = cache->newest;
+    cache->newest->prev = e;
+    cache->newest = e;
+}
+
+/*******************************************************************************
+*      Function: initFileCache()
+*   Description: Creates a file cache.
+*    Parameters: size_t budget - The most bytes to keep mapped, or 0 to
+*                                disable caching.
+* Preconditions: None.
+*       Returns: The cache.
+*******************************************************************************/
+
+struct FileCache *initFileCache(size_t budget) {
+    struct FileCache *cache;
+
+    cache = calloc(1, sizeof(struct FileCache));
+    assert(cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->stats.budget = budget;
+    pthread_once(&fcBusOnce, _installBusHandler);
+
+    return cache;
+}
+
+/*******************************************************************************
+*      Function: fileCacheGet()
+*   Description: Looks up the current version of a file. An entry for an
+*                older version of the file is dropped.
+*    Parameters: struct FileCache *cache - The cache.
+*                const char *name - The file name.
+*                struct stat *st - The file's current status.
+* Preconditions: None.
+*       Returns: The entry, held for the caller, or NULL on a miss.
+*******************************************************************************/
+
+struct FileEntry *fileCacheGet(struct FileCache *cache, const char *name,
+                               struct stat *st) {
+    struct FileEntry *e;
+
+    /* Files that could never be cached don't count as misses */
+    if (st->st_size == 0 ||
+        (size_t) st->st_size > cache->stats.budget / FC_ENTRY_DIV) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (e = cache->buckets[_hashName(name)]; e; e = e->hashNext) {
+        if (strcmp(e->name, name) == 0) {
+            break;
+        }
+    }
+    if (e && (e->dev != st->st_dev || e->ino != st->st_ino ||
+              e->size != st->st_size ||
+              e->mtime.tv_sec != st->st_mtim.tv_sec ||
+              e->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        _removeEntry(cache, e);
+        e = NULL;
+    }
+    if (e) {
+        e->refs++;
+        _touch(cache, e);
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+/*******************************************************************************
+*      Function: fileCacheAdd()
+*   Description: Maps a file and adds it to the cache, evicting the least
+*                recently used entries to stay within the budget. Files too
+*                large for the cache, or already added by another request,
+*                aren't mapped. A file whose contents have already been read
+*                is copied into anonymous memory instead.
+*    Parameters: struct FileCache *cache - The cache.
+*                const char *name - The file name.
+*                int fd - The open file, or -1 if data is given.
+*                const char *data - The file's contents, or NULL to map fd.
+*                struct stat *st - The file's status.
+* Preconditions: fd is a regular file opened for reading, or data holds
+*                st->st_size bytes.
+*       Returns: The new entry, held for the caller, or NULL if the file
+*                wasn't cached.
+*******************************************************************************/
+
+struct FileEntry *fileCacheAdd(struct FileCache *cache, const char *name,
+                               int fd, const char *data, struct stat *st) {
+    struct FileEntry *e, *victim, *older;
+    unsigned int bucket;
+    char *map;
+
+    if (st->st_size == 0 || strlen(name) >= FC_NAME_MAX ||
+        (size_t) st->st_size > cache->stats.budget / FC_ENTRY_DIV) {
+        return NULL;
+    }
+
+    /* Map the file outside the lock. Pages are faulted in as they are
+     * served, so a range request doesn't read the whole file. */
+    if (data) {
+        map = mmap(NULL, st->st_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("ftserver: mmap");
+        return NULL;
+    }
+    if (data) {
+        memcpy(map, data, st->st_size);
+    }
+
+    e = calloc(1, sizeof(struct FileEntry));
+    assert(e);
+    e->cache = cache;
+    strcpy(e->name, name);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->map = map;
+    e->refs = 2;
+
+    pthread_mutex_lock(&cache->lock);
+    bucket = _hashName(name);
+    for (victim = cache->buckets[bucket]; victim; victim = victim->hashNext) {
+        if (strcmp(victim->name, name) == 0) {
+            break;
+        }
+    }
+    /* Another request cached the file first; this mapping is only used by
+     * the caller */
+    if (victim) {
+        e->refs = 1;
+        pthread_mutex_unlock(&cache->lock);
+        return e;
+    }
+
+    /* Evict from the old end. Entries still being sent stay mapped until
+     * their replies release them. */
+    for (victim = cache->oldest;
+         victim && cache->stats.used + e->size > cache->stats.budget;
+         victim = older) {
+        older = victim->prev;
+        _removeEntry(cache, victim);
+        cache->stats.evictions++;
+    }
+
+    e->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    e->next = cache->newest;
+    if (cache->newest) {
+        cache->newest->prev = e;
+    } else {
+        cache->oldest = e;
+    }
+    cache->newest = e;
+    cache->stats.used += e->size;
+    pthread_mutex_unlock(&cache->lock);
+
+    return e;
+}
+
+/*******************************************************************************
+*      Function: fileCachePrefetch()
+*   Description: Asks the kernel to start reading a range of a mapped file
+*                ahead of it being sent.
+*    Parameters: struct FileEntry *e - The entry.
+*                off_t off - The start of the range.
+*                off_t len - Its length.
+* Preconditions: The caller holds a reference. The range lies within the
+*                entry.
+*       Returns: None.
+*******************************************************************************/
+
+void fileCachePrefetch(struct FileEntry *e, off_t off, off_t len) {
+    off_t start = off - off % sysconf(_SC_PAGESIZE);
+
+    if (len > 0) {
+        madvise(e->map + start, off + len - start, MADV_WILLNEED);
+    }
+}
+
+/*******************************************************************************
+*      Function: fileCacheCopy()
+*   Description: Copies part of a cached file. The file's current size is
+*                checked first, and the copy is guarded, so a file truncated
+*                in place ends the copy early instead of killing the server.
+*    Parameters: struct FileEntry *e - The entry.
+*                char *dst - Destination for the bytes.
+*                off_t off - The offset within the file.
+*                size_t len - The number of bytes to copy.
+* Preconditions: The caller holds a reference. The range lies within the
+*                entry.
+*       Returns: The number of bytes copied, which is short only if the file
+*                has been truncated.
+*******************************************************************************/
+
+size_t fileCacheCopy(struct FileEntry *e, char *dst, off_t off, size_t len) {
+    sigjmp_buf jmp;
+    struct stat st;
+
+    /* Bytes past the end of the file as it now stands can't be read. A
+     * file replaced under the name leaves the mapped one intact. */
+    if (stat(e->name, &st) == 0 && st.st_dev == e->dev &&
+        st.st_ino == e->ino && off + (off_t) len > st.st_size) {
+        len = st.st_size > off ? st.st_size - off : 0;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (sigsetjmp(jmp, 1)) {
+        fcGuard = NULL;
+        fprintf(stderr, "ftserver: %s truncated while cached\n", e->name);
+        return 0;
+    }
+    fcGuard = &jmp;
+    memcpy(dst, e->map + off, len);
+    fcGuard = NULL;
+
+    return len;
+}
+
+/*******************************************************************************
+*      Function: fileCacheHold()
+*   Description: Takes another reference to an entry.
+*    Parameters: struct FileEntry *e - The entry.
+* Preconditions: The caller already holds a reference.
+*       Returns: None.
+*******************************************************************************/
+
+void fileCacheHold(struct FileEntry *e) {
+    pthread_mutex_lock(&e->cache->lock);
+    e->refs++;
+    pthread_mutex_unlock(&e->cache->lock);
+}
+
+/*******************************************************************************
+*      Function: fileCacheRelease()
+*   Description: Releases a reference to an entry.
+*    Parameters: struct FileEntry *e - The entry.
+* Preconditions: The caller holds a reference.
+*       Returns: None.
+*******************************************************************************/
+
+void fileCacheRelease(struct FileEntry *e) {
+    struct FileCache *cache = e->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    _dropRef(e);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*******************************************************************************
+*      Function: fileCacheStats()
+*   Description: Copies the cache counters.
+*    Parameters: struct FileCache *cache - The cache.
+*                struct FileCacheStats *stats - Destination for the counters.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void fileCacheStats(struct FileCache *cache, struct FileCacheStats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
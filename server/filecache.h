@@ -0,0 +1,72 @@
+/*******************************************************************************
+*      Filename: filecache.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for filecache.c. Please see filecache.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FC_BUCKETS   1024       /* Hash table buckets */
+#define FC_NAME_MAX  256        /* Longest cached file name, with terminator */
+#define FC_ENTRY_DIV 4          /* Files over budget / FC_ENTRY_DIV aren't
+                                 * cached */
+
+/* A cached file, mapped into memory */
+struct FileEntry {
+    struct FileCache *cache; /* The owning cache */
+    char name[FC_NAME_MAX]; /* The file name */
+    dev_t dev;             /* Device, inode, mtime and size identify the */
+    ino_t ino;             /* version of the file that was mapped */
+    struct timespec mtime;
+    off_t size;
+    char *map;             /* The mapped file contents */
+    int refs;              /* Replies using the entry, plus one while cached */
+    struct FileEntry *hashNext; /* Next entry in the bucket */
+    struct FileEntry *prev; /* Neighbours in the LRU list, newest first */
+    struct FileEntry *next;
+};
+
+/* Cache counters */
+struct FileCacheStats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t used;           /* Bytes mapped by cached entries */
+    size_t budget;         /* Most bytes cached at once */
+};
+
+struct FileCache {
+    pthread_mutex_t lock;  /* Guards every field below and all entries */
+    struct FileEntry *buckets[FC_BUCKETS];
+    struct FileEntry *newest; /* LRU list ends */
+    struct FileEntry *oldest;
+    struct FileCacheStats stats;
+};
+
+struct FileCache *initFileCache(size_t);
+struct FileEntry *fileCacheGet(struct FileCache *, const char *,
+                               struct stat *);
+struct FileEntry *fileCacheAdd(struct FileCache *, const char *, int,
+                               const char *, struct stat *);
+void fileCachePrefetch(struct FileEntry *, off_t, off_t);
+size_t fileCacheCopy(struct FileEntry *, char *, off_t, size_t);
+void fileCacheHold(struct FileEntry *);
+void fileCacheRelease(struct FileEntry *);
+void fileCacheStats(struct FileCache *, struct FileCacheStats *);
+
+#endif
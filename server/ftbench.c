@@ -0,0 +1,678 @@
+/*******************************************************************************
+*      Filename: ftbench.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: A load generator for ftserver. Concurrent clients issue a
+*                mix of directory listings and file gets over the legacy
+*                7-byte header protocol, each with a data port of its own,
+*                against a corpus of small, medium and huge files. Results
+*                are printed as a single JSON object, so runs against
+*                different server builds can be compared by a script. The
+*                -C option generates the corpus.
+*******************************************************************************/
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "command.h"
+
+#define IO_TIMEOUT_MS  10000    /* Longest wait for any reply progress */
+#define RECV_BUF_LEN   262144   /* Receive buffer length */
+#define GEN_BUF_LEN    1048576  /* Corpus generation buffer length */
+
+#define DEFAULT_CLIENTS  16     /* Default concurrent clients */
+#define DEFAULT_SECONDS  10     /* Default run time */
+#define DEFAULT_LIST_PCT 10     /* Default percentage of listings */
+#define MAX_CLIENTS      1024   /* Largest allowed client count */
+
+/* Request kinds. Gets are classed by the size of the file fetched. */
+enum OpKind { OP_LIST, OP_SMALL, OP_MEDIUM, OP_HUGE, OP_KINDS };
+
+static const char *opNames[OP_KINDS] = { "list", "small", "medium", "huge" };
+
+/* The corpus: file name prefix, count and size of each file class */
+static const struct {
+    const char *prefix;
+    int count;
+    off_t size;
+} corpusClasses[OP_KINDS] = {
+    { NULL, 0, 0 },
+    { "small_", 200, 4096 },
+    { "medium_", 20, 1048576 },
+    { "huge_", 1, 268435456 }
+};
+
+/* Latencies and totals of one request kind */
+struct Samples {
+    unsigned long long *lat; /* Latency of each successful request, in us */
+    size_t n;
+    size_t cap;
+    unsigned long long bytes; /* Body bytes received */
+    unsigned long long errors; /* Failed requests */
+};
+
+/* One simulated client */
+struct Client {
+    pthread_t thread;
+    struct Bench *bench;   /* The shared benchmark settings */
+    unsigned int seed;     /* rand_r() state */
+    int listenFD;          /* The client's data port listener */
+    unsigned short dataPort; /* Its port number */
+    struct Samples samples[OP_KINDS];
+};
+
+/* Benchmark settings shared by every client */
+struct Bench {
+    const char *host;      /* Server host */
+    const char *port;      /* Server port */
+    struct addrinfo *addr; /* Resolved server address */
+    int nClients;          /* Concurrent clients */
+    int seconds;           /* Run time */
+    int perClient;         /* Requests per client, or 0 for no limit */
+    int listPct;           /* Percentage of requests that are listings */
+    int weights[OP_KINDS]; /* Relative weights of the get classes */
+    char **files[OP_KINDS]; /* Corpus file names by class */
+    int nFiles[OP_KINDS];
+    struct timespec start; /* When the clients started */
+    struct timespec end;   /* When they stop issuing requests */
+};
+
+/*******************************************************************************
+*      Function: _usage()
+*   Description: Prints the ftbench usage message and exits with an error.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _usage() {
+    fprintf(stderr, "ftbench: usage: ftbench -C corpus_dir\n"
+                    "         ftbench [-c clients] [-d seconds] "
+                    "[-n requests] [-l list_pct]\n"
+                    "                 [-w small:medium:huge] "
+                    "host port corpus_dir\n");
+    exit(1);
+}
+
+/*******************************************************************************
+*      Function: _usSince()
+*   Description: Measures the time elapsed since a CLOCK_MONOTONIC reading.
+*    Parameters: const struct timespec *start - The earlier reading.
+* Preconditions: None.
+*       Returns: The elapsed time in microseconds.
+*******************************************************************************/
+
+unsigned long long _usSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000ULL +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*******************************************************************************
+*      Function: _generateCorpus()
+*   Description: Creates the benchmark corpus in a directory, leaving files
+*                that already have the right size alone. File contents are
+*                pseudo-random, so they do not compress.
+*    Parameters: const char *dir - The corpus directory.
+* Preconditions: None.
+*       Returns: None. Exits with an error on failure.
+*******************************************************************************/
+
+void _generateCorpus(const char *dir) {
+    char path[PATH_MAX];
+    char *buf;
+    struct stat st;
+    unsigned long long x = 88172645463325252ULL;
+    off_t left;
+    ssize_t chunk;
+    int c, i, j, fd;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("ftbench: mkdir");
+        exit(2);
+    }
+
+    buf = malloc(GEN_BUF_LEN);
+    if (!buf) {
+        fprintf(stderr, "ftbench: out of memory\n");
+        exit(2);
+    }
+    /* xorshift64 */
+    for (j = 0; j + 8 <= GEN_BUF_LEN; j += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + j, &x, 8);
+    }
+
+    for (c = OP_SMALL; c < OP_KINDS; c++) {
+        for (i = 0; i < corpusClasses[c].count; i++) {
+            snprintf(path, sizeof(path), "%s/%s%03d.bin", dir,
+                     corpusClasses[c].prefix, i);
+            if (stat(path, &st) == 0 && st.st_size == corpusClasses[c].size) {
+                continue;
+            }
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                perror("ftbench: open");
+                exit(2);
+            }
+            /* Start each file at a different place in the buffer */
+            j = (i * 4099) % GEN_BUF_LEN;
+            for (left = corpusClasses[c].size; left > 0; left -= chunk) {
+                chunk = GEN_BUF_LEN - j;
+                if (chunk > left) {
+                    chunk = left;
+                }
+                chunk = write(fd, buf + j, chunk);
+                if (chunk <= 0) {
+                    perror("ftbench: write");
+                    exit(2);
+                }
+                j = 0;
+            }
+            close(fd);
+        }
+    }
+
+    free(buf);
+    printf("Corpus ready in %s\n", dir);
+}
+
+/*******************************************************************************
+*      Function: _loadCorpus()
+*   Description: Finds the corpus files in a directory and sorts them into
+*                their size classes by name.
+*    Parameters: struct Bench *b - The benchmark settings.
+*                const char *dir - The corpus directory.
+* Preconditions: None.
+*       Returns: None. Exits with an error if a weighted class is empty.
+*******************************************************************************/
+
+void _loadCorpus(struct Bench *b, const char *dir) {
+    struct dirent *ent;
+    DIR *d;
+    int c;
+
+    d = opendir(dir);
+    if (!d) {
+        perror("ftbench: opendir");
+        exit(2);
+    }
+    while ((ent = readdir(d))) {
+        for (c = OP_SMALL; c < OP_KINDS; c++) {
+            if (strncmp(ent->d_name, corpusClasses[c].prefix,
+                        strlen(corpusClasses[c].prefix)) == 0) {
+                break;
+            }
+        }
+        if (c == OP_KINDS || strlen(ent->d_name) >= FNAME_MAX) {
+            continue;
+        }
+        b->files[c] = realloc(b->files[c],
+                              (b->nFiles[c] + 1) * sizeof(char *));
+        if (!b->files[c] || !(b->files[c][b->nFiles[c]] =
+                              strdup(ent->d_name))) {
+            fprintf(stderr, "ftbench: out of memory\n");
+            exit(2);
+        }
+        b->nFiles[c]++;
+    }
+    closedir(d);
+
+    for (c = OP_SMALL; c < OP_KINDS; c++) {
+        if (b->weights[c] && !b->nFiles[c]) {
+            fprintf(stderr, "ftbench: no %s files in %s; run ftbench -C %s\n",
+                    opNames[c], dir, dir);
+            exit(2);
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _addSample()
+*   Description: Records the latency of a successful request.
+*    Parameters: struct Samples *s - The samples of the request's kind.
+*                unsigned long long us - The latency in microseconds.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _addSample(struct Samples *s, unsigned long long us) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->lat = realloc(s->lat, s->cap * sizeof(unsigned long long));
+        if (!s->lat) {
+            fprintf(stderr, "ftbench: out of memory\n");
+            exit(2);
+        }
+    }
+    s->lat[s->n++] = us;
+}
+
+/*******************************************************************************
+*      Function: _waitFor()
+*   Description: Waits for one of two descriptors to become readable.
+*    Parameters: int a, int b - The descriptors.
+* Preconditions: None.
+*       Returns: The readable descriptor, or -1 on timeout or error.
+*******************************************************************************/
+
+int _waitFor(int a, int b) {
+    struct pollfd fds[2];
+    int status;
+
+    fds[0].fd = a;
+    fds[0].events = POLLIN;
+    fds[1].fd = b;
+    fds[1].events = POLLIN;
+
+    do {
+        status = poll(fds, 2, IO_TIMEOUT_MS);
+    } while (status == -1 && errno == EINTR);
+    if (status <= 0) {
+        return -1;
+    }
+    return fds[0].revents ? a : b;
+}
+
+/*******************************************************************************
+*      Function: _recvAll()
+*   Description: Receives exactly len bytes, or discards them if buf is
+*                NULL.
+*    Parameters: int fd - The socket.
+*                char *buf - The destination, or NULL.
+*                unsigned long long len - The number of bytes.
+* Preconditions: None.
+*       Returns: 0 on success, -1 on error, timeout or early end of stream.
+*******************************************************************************/
+
+int _recvAll(int fd, char *buf, unsigned long long len) {
+    char sink[RECV_BUF_LEN];
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (len > 0) {
+        if (poll(&pfd, 1, IO_TIMEOUT_MS) <= 0) {
+            return -1;
+        }
+        n = recv(fd, buf ? buf : sink,
+                 len < sizeof(sink) || buf ? len : sizeof(sink), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (buf) {
+            buf += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: _request()
+*   Description: Performs one legacy request: sends the 7-byte header and
+*                file name on a new control connection, then receives the
+*                reply on the client's data port, or an error message on the
+*                control connection.
+*    Parameters: struct Client *cl - The client.
+*                char mode - The request mode, 'l' or 'g'.
+*                const char *name - The file name, or "" for a listing.
+*                unsigned long long *bytes - Destination for the body length.
+* Preconditions: The client's data port is listening.
+*       Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int _request(struct Client *cl, char mode, const char *name,
+             unsigned long long *bytes) {
+    struct addrinfo *ai = cl->bench->addr;
+    char req[HEADER_LEN + FNAME_MAX];
+    char hdr[HEADER_LEN];
+    unsigned int nameLen = strlen(name);
+    unsigned long long len;
+    int ctrlFD, dataFD = -1, ready, status = -1;
+
+    ctrlFD = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (ctrlFD == -1) {
+        return -1;
+    }
+    if (connect(ctrlFD, ai->ai_addr, ai->ai_addrlen) == -1) {
+        close(ctrlFD);
+        return -1;
+    }
+
+    req[0] = mode;
+    req[1] = cl->dataPort >> 8;
+    req[2] = cl->dataPort;
+    req[3] = nameLen >> 24;
+    req[4] = nameLen >> 16;
+    req[5] = nameLen >> 8;
+    req[6] = nameLen;
+    memcpy(req + HEADER_LEN, name, nameLen);
+    if (send(ctrlFD, req, HEADER_LEN + nameLen, MSG_NOSIGNAL) !=
+        (ssize_t) (HEADER_LEN + nameLen)) {
+        close(ctrlFD);
+        return -1;
+    }
+
+    /* An error reply arrives on the control connection instead */
+    ready = _waitFor(cl->listenFD, ctrlFD);
+    if (ready == cl->listenFD) {
+        dataFD = accept(cl->listenFD, NULL, NULL);
+    }
+    if (dataFD != -1 && _recvAll(dataFD, hdr, HEADER_LEN) == 0 &&
+        hdr[0] == 'r') {
+        len = (unsigned long long) (unsigned char) hdr[3] << 24 |
+              (unsigned char) hdr[4] << 16 | (unsigned char) hdr[5] << 8 |
+              (unsigned char) hdr[6];
+        if (_recvAll(dataFD, NULL, len) == 0) {
+            *bytes = len;
+            status = 0;
+        }
+    }
+
+    if (dataFD != -1) {
+        close(dataFD);
+    }
+    close(ctrlFD);
+    return status;
+}
+
+/*******************************************************************************
+*      Function: _clientMain()
+*   Description: The client thread body. Issues randomly chosen requests
+*                until the run time or request count is used up.
+*    Parameters: void *arg - The struct Client.
+* Preconditions: None.
+*       Returns: NULL.
+*******************************************************************************/
+
+void *_clientMain(void *arg) {
+    struct Client *cl = arg;
+    struct Bench *b = cl->bench;
+    struct timespec t0, now;
+    unsigned long long bytes;
+    int done = 0, kind, total, r;
+
+    total = b->weights[OP_SMALL] + b->weights[OP_MEDIUM] + b->weights[OP_HUGE];
+
+    while (!b->perClient || done < b->perClient) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > b->end.tv_sec ||
+            (now.tv_sec == b->end.tv_sec && now.tv_nsec >= b->end.tv_nsec)) {
+            break;
+        }
+
+        /* Pick a listing, or a get of a file in a weighted size class */
+        if (!total || (int) (rand_r(&cl->seed) % 100) < b->listPct) {
+            kind = OP_LIST;
+        } else {
+            r = rand_r(&cl->seed) % total;
+            for (kind = OP_SMALL; r >= b->weights[kind]; kind++) {
+                r -= b->weights[kind];
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        bytes = 0;
+        if (kind == OP_LIST) {
+            r = _request(cl, 'l', "", &bytes);
+        } else {
+            r = _request(cl, 'g', b->files[kind][rand_r(&cl->seed) %
+                                                 b->nFiles[kind]], &bytes);
+        }
+        if (r == 0) {
+            _addSample(&cl->samples[kind], _usSince(&t0));
+            cl->samples[kind].bytes += bytes;
+        } else {
+            cl->samples[kind].errors++;
+        }
+        done++;
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: _cmpULL()
+*   Description: qsort() comparison of unsigned long longs.
+*    Parameters: const void *a, const void *b - The values.
+* Preconditions: None.
+*       Returns: Negative, zero or positive as a is below, equal to or above b.
+*******************************************************************************/
+
+int _cmpULL(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+*      Function: _printStats()
+*   Description: Prints the JSON fields for a set of samples.
+*    Parameters: struct Samples *s - The samples, whose latencies are sorted
+*                                    in place.
+*                double secs - The measured run time.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _printStats(struct Samples *s, double secs) {
+    static const double pcts[] = { 0.50, 0.99, 0.999 };
+    static const char *names[] = { "p50", "p99", "p999" };
+    size_t idx;
+    int i;
+
+    qsort(s->lat, s->n, sizeof(unsigned long long), _cmpULL);
+    printf("{\"requests\": %zu, \"errors\": %llu, \"bytes\": %llu, "
+           "\"req_per_sec\": %.1f, \"mb_per_sec\": %.2f", s->n, s->errors,
+           s->bytes, s->n / secs, s->bytes / secs / 1048576.0);
+    for (i = 0; i < 3; i++) {
+        idx = s->n ? (size_t) (pcts[i] * s->n + 0.999999) - 1 : 0;
+        printf(", \"%s_us\": %llu", names[i], s->n ? s->lat[idx] : 0ULL);
+    }
+    printf(", \"max_us\": %llu}", s->n ? s->lat[s->n - 1] : 0ULL);
+}
+
+/*******************************************************************************
+*      Function: _report()
+*   Description: Merges every client's samples and prints the results as
+*                one JSON object.
+*    Parameters: struct Bench *b - The benchmark settings.
+*                struct Client *clients - The finished clients.
+*                double secs - The measured run time.
+* Preconditions: Every client thread has been joined.
+*       Returns: The total number of failed requests.
+*******************************************************************************/
+
+unsigned long long _report(struct Bench *b, struct Client *clients,
+                           double secs) {
+    struct Samples all, kinds[OP_KINDS];
+    struct Samples *s;
+    int c, k;
+
+    memset(&all, 0, sizeof(all));
+    memset(kinds, 0, sizeof(kinds));
+    for (c = 0; c < b->nClients; c++) {
+        for (k = 0; k < OP_KINDS; k++) {
+            s = &clients[c].samples[k];
+            while (s->n) {
+                _addSample(&kinds[k], s->lat[--s->n]);
+                _addSample(&all, kinds[k].lat[kinds[k].n - 1]);
+            }
+            kinds[k].bytes += s->bytes;
+            kinds[k].errors += s->errors;
+            all.bytes += s->bytes;
+            all.errors += s->errors;
+        }
+    }
+
+    printf("{\"clients\": %d, \"seconds\": %.3f, \"list_pct\": %d, "
+           "\"weights\": [%d, %d, %d], \"total\": ", b->nClients, secs,
+           b->listPct, b->weights[OP_SMALL], b->weights[OP_MEDIUM],
+           b->weights[OP_HUGE]);
+    _printStats(&all, secs);
+    for (k = 0; k < OP_KINDS; k++) {
+        printf(", \"%s\": ", opNames[k]);
+        _printStats(&kinds[k], secs);
+    }
+    printf("}\n");
+
+    return all.errors;
+}
+
+/*******************************************************************************
+*      Function: _parseCount()
+*   Description: Parses an integer option argument.
+*    Parameters: const char *arg - The option argument.
+*                int min, int max - The allowed range.
+* Preconditions: None.
+*       Returns: The value. Exits with the usage message if it is invalid.
+*******************************************************************************/
+
+int _parseCount(const char *arg, int min, int max) {
+    char *end;
+    long val;
+
+    errno = 0;
+    val = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || val < min || val > max) {
+        _usage();
+    }
+    return val;
+}
+
+/*******************************************************************************
+*      Function: _openDataPort()
+*   Description: Opens a client's data port listener on an ephemeral port.
+*    Parameters: struct Client *cl - The client.
+* Preconditions: None.
+*       Returns: None. Exits with an error on failure.
+*******************************************************************************/
+
+void _openDataPort(struct Client *cl) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    cl->listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (cl->listenFD == -1 ||
+        bind(cl->listenFD, (struct sockaddr *) &sa, sizeof(sa)) == -1 ||
+        listen(cl->listenFD, 4) == -1 ||
+        getsockname(cl->listenFD, (struct sockaddr *) &sa, &len) == -1) {
+        perror("ftbench: data port");
+        exit(2);
+    }
+    cl->dataPort = ntohs(sa.sin_port);
+}
+
+/*******************************************************************************
+*      Function: main()
+*   Description: The main ftbench function.
+*    Parameters: int argc - The argument count.
+*                char **argv - The argument list.
+* Preconditions: None.
+*       Returns: 0 if every request succeeded, 1 otherwise.
+*******************************************************************************/
+
+int main(int argc, char **argv) {
+    struct Bench b;
+    struct Client *clients;
+    struct addrinfo hints;
+    double secs;
+    int c, i, status;
+
+    memset(&b, 0, sizeof(b));
+    b.nClients = DEFAULT_CLIENTS;
+    b.seconds = DEFAULT_SECONDS;
+    b.listPct = DEFAULT_LIST_PCT;
+    b.weights[OP_SMALL] = 70;
+    b.weights[OP_MEDIUM] = 25;
+    b.weights[OP_HUGE] = 5;
+
+    while ((c = getopt(argc, argv, "C:c:d:n:l:w:")) != -1) {
+        if (c == 'C') {
+            _generateCorpus(optarg);
+            return 0;
+        } else if (c == 'c') {
+            b.nClients = _parseCount(optarg, 1, MAX_CLIENTS);
+        } else if (c == 'd') {
+            b.seconds = _parseCount(optarg, 1, 86400);
+        } else if (c == 'n') {
+            b.perClient = _parseCount(optarg, 0, 1000000000);
+        } else if (c == 'l') {
+            b.listPct = _parseCount(optarg, 0, 100);
+        } else if (c == 'w') {
+            if (sscanf(optarg, "%d:%d:%d", &b.weights[OP_SMALL],
+                       &b.weights[OP_MEDIUM], &b.weights[OP_HUGE]) != 3 ||
+                b.weights[OP_SMALL] < 0 || b.weights[OP_MEDIUM] < 0 ||
+                b.weights[OP_HUGE] < 0) {
+                _usage();
+            }
+        } else {
+            _usage();
+        }
+    }
+    if (argc - optind != 3) {
+        _usage();
+    }
+    b.host = argv[optind];
+    b.port = argv[optind + 1];
+    _loadCorpus(&b, argv[optind + 2]);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status = getaddrinfo(b.host, b.port, &hints, &b.addr);
+    if (status != 0) {
+        fprintf(stderr, "ftbench: getaddrinfo: %s\n", gai_strerror(status));
+        exit(2);
+    }
+
+    clients = calloc(b.nClients, sizeof(struct Client));
+    if (!clients) {
+        fprintf(stderr, "ftbench: out of memory\n");
+        exit(2);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &b.start);
+    b.end = b.start;
+    b.end.tv_sec += b.seconds;
+    for (i = 0; i < b.nClients; i++) {
+        clients[i].bench = &b;
+        clients[i].seed = i * 2654435761U + 1;
+        _openDataPort(&clients[i]);
+        if (pthread_create(&clients[i].thread, NULL, _clientMain,
+                           &clients[i]) != 0) {
+            fprintf(stderr, "ftbench: pthread_create failed\n");
+            exit(2);
+        }
+    }
+    for (i = 0; i < b.nClients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        close(clients[i].listenFD);
+    }
+    secs = _usSince(&b.start) / 1e6;
+
+    return _report(&b, clients, secs) ? 1 : 0;
+}
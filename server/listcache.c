@@ -0,0 +1,125 @@
+/*******************************************************************************
+*      Filename: listcache.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: A cache of the served directory's listing. The first '-l'
+*                request scans the directory; later requests are answered by
+*                copying the serialized listing until an inotify event shows
+*                that a file was created, removed or renamed. The event loop
+*                watches the inotify descriptor and drains it through
+*                listCacheEvents(), while workers read the cache under its
+*                lock.
+*******************************************************************************/
+
+#include "command.h"
+#include "listcache.h"
+
+/*******************************************************************************
+*      Function: initListCache()
+*   Description: Creates a listing cache for a directory. If inotify can't
+*                watch the directory, every request falls back to a scan.
+*    Parameters: const char *dir - The directory to watch.
+* Preconditions: None.
+*       Returns: The cache.
+*******************************************************************************/
+
+struct ListCache *initListCache(const char *dir) {
+    struct ListCache *cache;
+
+    cache = calloc(1, sizeof(struct ListCache));
+    assert(cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    initDynBuf(&cache->list);
+
+    cache->inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotifyFD == -1) {
+        perror("ftserver: inotify_init1");
+        return cache;
+    }
+    if (inotify_add_watch(cache->inotifyFD, dir, LIST_EVENTS) == -1) {
+        perror("ftserver: inotify_add_watch");
+        close(cache->inotifyFD);
+        cache->inotifyFD = -1;
+    }
+
+    return cache;
+}
+
+/*******************************************************************************
+*      Function: listCacheGet()
+*   Description: Copies the directory listing into a message buffer, scanning
+*                the directory only if the cached listing is out of date. A
+*                scan that raced with a change to the directory is not cached.
+*    Parameters: struct ListCache *cache - The cache.
+*                struct DynBuf *msgBuf - The buffer to hold the listing.
+* Preconditions: msgBuf has been initialized.
+*       Returns: 'r' if the listing has entries, 'e' otherwise.
+*******************************************************************************/
+
+char listCacheGet(struct ListCache *cache, struct DynBuf *msgBuf) {
+    unsigned long gen;
+    char mode;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->valid) {
+        clearDynBuf(msgBuf);
+        dynBufAddBytes(msgBuf, cache->list.buffer, cache->list.size);
+        mode = cache->mode;
+        pthread_mutex_unlock(&cache->lock);
+        return mode;
+    }
+    gen = cache->gen;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Scan without the lock so that other requests aren't held up */
+    mode = generateList(msgBuf);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->inotifyFD != -1 && !cache->valid && cache->gen == gen) {
+        clearDynBuf(&cache->list);
+        dynBufAddBytes(&cache->list, msgBuf->buffer, msgBuf->size);
+        cache->mode = mode;
+        cache->valid = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return mode;
+}
+
+/*******************************************************************************
+*      Function: listCacheEvents()
+*   Description: Drains the cache's inotify descriptor, invalidating the
+*                cached listing if anything arrived. Queue overflows are
+*                reported as events too, so no change is missed.
+*    Parameters: struct ListCache *cache - The cache.
+* Preconditions: The inotify descriptor is open and non-blocking.
+*       Returns: None.
+*******************************************************************************/
+
+void listCacheEvents(struct ListCache *cache) {
+    char buf[INOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t status;
+    int changed = 0;
+
+    while (1) {
+        status = read(cache->inotifyFD, buf, sizeof(buf));
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status <= 0) {
+            if (status == -1 && errno != EAGAIN) {
+                perror("ftserver: read");
+            }
+            break;
+        }
+        changed = 1;
+    }
+
+    if (changed) {
+        pthread_mutex_lock(&cache->lock);
+        cache->valid = 0;
+        cache->gen++;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
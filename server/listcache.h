@@ -0,0 +1,41 @@
+/*******************************************************************************
+*      Filename: listcache.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for listcache.c. Please see listcache.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef LISTCACHE_H
+#define LISTCACHE_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "dyn_buffer.h"
+
+#define INOTIFY_BUF_LEN 4096    /* Bytes of inotify events read at a time */
+
+/* Events that change which regular files a directory holds */
+#define LIST_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                     IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* A serialized directory listing kept until the directory changes */
+struct ListCache {
+    pthread_mutex_t lock;  /* Guards every field below */
+    int inotifyFD;         /* inotify instance watching the directory, or -1
+                            * if listings can't be cached */
+    int valid;             /* Nonzero while list matches the directory */
+    unsigned long gen;     /* Bumped on every invalidation */
+    char mode;             /* Reply mode of the cached listing */
+    struct DynBuf list;    /* The cached listing or error message */
+};
+
+struct ListCache *initListCache(const char *);
+char listCacheGet(struct ListCache *, struct DynBuf *);
+void listCacheEvents(struct ListCache *);
+
+#endif
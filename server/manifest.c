@@ -0,0 +1,479 @@
+/*******************************************************************************
+*      Filename: manifest.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: A manifest of the content hashes of the regular files in the
+*                server directory, for conditional gets. A thread of its own
+*                scans the directory every MF_INTERVAL seconds, or sooner
+*                when a request finds an entry out of date, and hashes only
+*                the files that are new or whose size, times or inode have
+*                changed since they were last hashed. The manifest is saved
+*                to MF_FILE after each scan that changes it and loaded again
+*                at startup, so a restart doesn't rehash unchanged files. A
+*                hash is only trusted while the file's status still matches
+*                the status it was hashed at.
+*******************************************************************************/
+
+#include "command.h"
+#include "manifest.h"
+
+/*******************************************************************************
+*      Function: _manifestBucket()
+*   Description: Hashes a file name to a bucket index.
+*    Parameters: const char *name - The file name.
+* Preconditions: None.
+*       Returns: The bucket index.
+*******************************************************************************/
+
+unsigned int _manifestBucket(const char *name) {
+    unsigned int hash = 5381;
+
+    while (*name) {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+    return hash % MF_BUCKETS;
+}
+
+/*******************************************************************************
+*      Function: _findManifestEntry()
+*   Description: Finds the entry of a file.
+*    Parameters: struct Manifest *mf - The manifest.
+*                const char *name - The file name.
+* Preconditions: The manifest lock is held.
+*       Returns: The entry, or NULL if the file has none.
+*******************************************************************************/
+
+struct ManifestEntry *_findManifestEntry(struct Manifest *mf,
+                                         const char *name) {
+    struct ManifestEntry *e;
+
+    for (e = mf->buckets[_manifestBucket(name)]; e; e = e->hashNext) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: _sameStatus()
+*   Description: Determines whether a file still has the status its entry
+*                was hashed at.
+*    Parameters: const struct ManifestEntry *e - The entry.
+*                const struct stat *st - The file's current status.
+* Preconditions: None.
+*       Returns: Nonzero if the status matches.
+*******************************************************************************/
+
+int _sameStatus(const struct ManifestEntry *e, const struct stat *st) {
+    return e->size == st->st_size && e->dev == st->st_dev &&
+           e->ino == st->st_ino &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           e->ctime.tv_sec == st->st_ctim.tv_sec &&
+           e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*******************************************************************************
+*      Function: _setEntry()
+*   Description: Adds or updates the entry of a file.
+*    Parameters: struct Manifest *mf - The manifest.
+*                const char *name - The file name.
+*                const struct stat *st - The status the file was hashed at.
+*                const unsigned char *hash - The file's content hash.
+*                unsigned long scan - The scan that hashed the file.
+* Preconditions: The manifest lock is held. The name is at most NAME_MAX
+*                bytes long.
+*       Returns: None.
+*******************************************************************************/
+
+void _setEntry(struct Manifest *mf, const char *name, const struct stat *st,
+               const unsigned char *hash, unsigned long scan) {
+    struct ManifestEntry *e;
+    unsigned int bucket;
+
+    e = _findManifestEntry(mf, name);
+    if (!e) {
+        e = calloc(1, sizeof(struct ManifestEntry));
+        assert(e);
+        strcpy(e->name, name);
+        bucket = _manifestBucket(name);
+        e->hashNext = mf->buckets[bucket];
+        mf->buckets[bucket] = e;
+        mf->nEntries++;
+    }
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->ctime = st->st_ctim;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    memcpy(e->hash, hash, MF_HASH_LEN);
+    e->scan = scan;
+}
+
+/*******************************************************************************
+*      Function: _hashContents()
+*   Description: Computes the MD5 of a file's contents.
+*    Parameters: const char *name - The file name.
+*                struct stat *st - The file's status when the scan found it,
+*                                  replaced by its status once hashed.
+*                unsigned char *hash - Destination for the hash.
+* Preconditions: None.
+*       Returns: 0 on success, -1 if the file can't be read or changed while
+*                it was being hashed.
+*******************************************************************************/
+
+int _hashContents(const char *name, struct stat *st, unsigned char *hash) {
+    struct stat after;
+    EVP_MD_CTX *md;
+    ssize_t status;
+    char *buf;
+    int fd;
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    buf = malloc(MF_READ_LEN);
+    assert(buf);
+    md = EVP_MD_CTX_new();
+    assert(md);
+    EVP_DigestInit_ex(md, EVP_md5(), NULL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        status = -1;
+    } else {
+        while ((status = read(fd, buf, MF_READ_LEN)) > 0) {
+            EVP_DigestUpdate(md, buf, status);
+        }
+    }
+    EVP_DigestFinal_ex(md, hash, NULL);
+
+    /* A file written to while it was read is hashed again next scan */
+    if (status == 0 && (fstat(fd, &after) == -1 ||
+                        after.st_size != st->st_size ||
+                        after.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+                        after.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+                        after.st_ctim.tv_sec != st->st_ctim.tv_sec ||
+                        after.st_ctim.tv_nsec != st->st_ctim.tv_nsec)) {
+        status = -1;
+    }
+    EVP_MD_CTX_free(md);
+    free(buf);
+    close(fd);
+    return status == 0 ? 0 : -1;
+}
+
+/*******************************************************************************
+*      Function: _loadManifest()
+*   Description: Loads the manifest saved by an earlier run. Each line holds
+*                a hash, the status it was taken at and the file name. The
+*                entries are checked against their files by the first scan.
+*    Parameters: struct Manifest *mf - The manifest.
+* Preconditions: The manifest is empty and no scan has run.
+*       Returns: None.
+*******************************************************************************/
+
+void _loadManifest(struct Manifest *mf) {
+    char line[NAME_MAX + 256];
+    char hex[2 * MF_HASH_LEN + 1];
+    unsigned char hash[MF_HASH_LEN];
+    long long size, mSec, cSec;
+    unsigned long long dev, ino;
+    long mNsec, cNsec;
+    struct stat st;
+    size_t len;
+    FILE *fp;
+    int i, pos;
+
+    fp = fopen(MF_FILE, "r");
+    if (!fp) {
+        if (errno != ENOENT) {
+            perror("ftserver: " MF_FILE);
+        }
+        return;
+    }
+    if (!fgets(line, sizeof(line), fp) ||
+        strcmp(line, MF_MAGIC "\n") != 0) {
+        fprintf(stderr, "ftserver: ignoring unrecognized " MF_FILE "\n");
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%32s %lld %lld %ld %lld %ld %llu %llu %n", hex,
+                   &size, &mSec, &mNsec, &cSec, &cNsec, &dev, &ino,
+                   &pos) != 8 ||
+            strlen(hex) != 2 * MF_HASH_LEN || line[pos] == '\0' ||
+            strlen(line + pos) > NAME_MAX) {
+            continue;
+        }
+        for (i = 0; i < MF_HASH_LEN; i++) {
+            sscanf(hex + 2 * i, "%2hhx", &hash[i]);
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_size = size;
+        st.st_mtim.tv_sec = mSec;
+        st.st_mtim.tv_nsec = mNsec;
+        st.st_ctim.tv_sec = cSec;
+        st.st_ctim.tv_nsec = cNsec;
+        st.st_dev = dev;
+        st.st_ino = ino;
+        _setEntry(mf, line + pos, &st, hash, 0);
+    }
+    fclose(fp);
+}
+
+/*******************************************************************************
+*      Function: _saveManifest()
+*   Description: Saves the manifest to MF_TMP_FILE and renames it over
+*                MF_FILE, so a crash never leaves a partial manifest. Files
+*                whose names hold a newline are not saved.
+*    Parameters: struct Manifest *mf - The manifest.
+* Preconditions: Only the scan thread changes the manifest.
+*       Returns: None.
+*******************************************************************************/
+
+void _saveManifest(struct Manifest *mf) {
+    struct ManifestEntry *e;
+    FILE *fp;
+    int i, j, failed;
+
+    fp = fopen(MF_TMP_FILE, "w");
+    if (!fp) {
+        perror("ftserver: " MF_TMP_FILE);
+        return;
+    }
+    fprintf(fp, "%s\n", MF_MAGIC);
+
+    pthread_mutex_lock(&mf->lock);
+    for (i = 0; i < MF_BUCKETS; i++) {
+        for (e = mf->buckets[i]; e; e = e->hashNext) {
+            if (strchr(e->name, '\n')) {
+                continue;
+            }
+            for (j = 0; j < MF_HASH_LEN; j++) {
+                fprintf(fp, "%02x", e->hash[j]);
+            }
+            fprintf(fp, " %lld %lld %ld %lld %ld %llu %llu %s\n",
+                    (long long) e->size, (long long) e->mtime.tv_sec,
+                    e->mtime.tv_nsec, (long long) e->ctime.tv_sec,
+                    e->ctime.tv_nsec, (unsigned long long) e->dev,
+                    (unsigned long long) e->ino, e->name);
+        }
+    }
+    pthread_mutex_unlock(&mf->lock);
+
+    failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0 || failed) {
+        perror("ftserver: " MF_TMP_FILE);
+        unlink(MF_TMP_FILE);
+        return;
+    }
+    if (rename(MF_TMP_FILE, MF_FILE) == -1) {
+        perror("ftserver: rename");
+        unlink(MF_TMP_FILE);
+    }
+}
+
+/*******************************************************************************
+*      Function: _scanDirectory()
+*   Description: Brings the manifest up to date with the server directory.
+*                Files whose status still matches their entry are not read.
+*                Entries of files that are gone are dropped.
+*    Parameters: struct Manifest *mf - The manifest.
+* Preconditions: Only the scan thread calls this.
+*       Returns: Nonzero if the manifest changed.
+*******************************************************************************/
+
+int _scanDirectory(struct Manifest *mf) {
+    unsigned char hash[MF_HASH_LEN];
+    struct ManifestEntry *e, **pp;
+    struct dirent *ep;
+    struct stat st;
+    unsigned long scan;
+    int i, known, changed = 0;
+    DIR *dir;
+
+    dir = opendir(".");
+    if (!dir) {
+        perror("ftserver: opendir");
+        return 0;
+    }
+    pthread_mutex_lock(&mf->lock);
+    scan = ++mf->scan;
+    pthread_mutex_unlock(&mf->lock);
+
+    while ((ep = readdir(dir))) {
+        /* Files are served by name, so status follows symbolic links */
+        if (reservedName(ep->d_name) ||
+            fstatat(dirfd(dir), ep->d_name, &st, 0) == -1 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mf->lock);
+        e = _findManifestEntry(mf, ep->d_name);
+        known = e && _sameStatus(e, &st);
+        if (known) {
+            e->scan = scan;
+        }
+        pthread_mutex_unlock(&mf->lock);
+        if (known || _hashContents(ep->d_name, &st, hash) == -1) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mf->lock);
+        _setEntry(mf, ep->d_name, &st, hash, scan);
+        mf->hashed += st.st_size;
+        pthread_mutex_unlock(&mf->lock);
+        changed = 1;
+    }
+    closedir(dir);
+
+    /* Drop the files this scan didn't find */
+    pthread_mutex_lock(&mf->lock);
+    for (i = 0; i < MF_BUCKETS; i++) {
+        pp = &mf->buckets[i];
+        while ((e = *pp)) {
+            if (e->scan != scan) {
+                *pp = e->hashNext;
+                free(e);
+                mf->nEntries--;
+                changed = 1;
+            } else {
+                pp = &e->hashNext;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mf->lock);
+
+    return changed;
+}
+
+/*******************************************************************************
+*      Function: _manifestMain()
+*   Description: The scan thread body. Scans the directory, saving the
+*                manifest when it changes, then waits MF_INTERVAL seconds or
+*                until a request finds an entry stale. Scans are at least
+*                MF_MIN_GAP seconds apart. The thread runs at a lower
+*                priority than the workers serving requests.
+*    Parameters: void *arg - The struct Manifest.
+* Preconditions: None.
+*       Returns: Never.
+*******************************************************************************/
+
+void *_manifestMain(void *arg) {
+    struct Manifest *mf = arg;
+    struct timespec deadline;
+
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), MF_NICE);
+
+    while (1) {
+        if (_scanDirectory(mf)) {
+            _saveManifest(mf);
+        }
+        sleep(MF_MIN_GAP);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MF_INTERVAL - MF_MIN_GAP;
+        pthread_mutex_lock(&mf->lock);
+        while (!mf->stale &&
+               pthread_cond_timedwait(&mf->wake, &mf->lock,
+                                      &deadline) != ETIMEDOUT) {
+        }
+        mf->stale = 0;
+        pthread_mutex_unlock(&mf->lock);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: initManifest()
+*   Description: Loads the saved manifest and starts the scan thread. With
+*                hashing off, the saved hashes are still used while their
+*                files are unchanged, but nothing is scanned or hashed.
+*    Parameters: int hashing - Nonzero to scan and hash the directory.
+* Preconditions: The working directory is the server directory.
+*       Returns: The manifest.
+*******************************************************************************/
+
+struct Manifest *initManifest(int hashing) {
+    struct Manifest *mf;
+
+    mf = calloc(1, sizeof(struct Manifest));
+    assert(mf);
+    pthread_mutex_init(&mf->lock, NULL);
+    pthread_cond_init(&mf->wake, NULL);
+    _loadManifest(mf);
+
+    if (hashing && pthread_create(&mf->thread, NULL, _manifestMain, mf) != 0) {
+        fprintf(stderr, "ftserver: pthread_create failed\n");
+        exit(2);
+    }
+
+    return mf;
+}
+
+/*******************************************************************************
+*      Function: manifestMatch()
+*   Description: Determines whether a client's copy of a file is current,
+*                from the hash of its copy. A file without an up to date
+*                entry never matches, and has the scan thread woken to hash
+*                it.
+*    Parameters: struct Manifest *mf - The manifest.
+*                const char *name - The file name.
+*                const struct stat *st - The file's current status.
+*                const unsigned char *hash - The hash of the client's copy.
+* Preconditions: None.
+*       Returns: Nonzero if the file's contents have that hash.
+*******************************************************************************/
+
+int manifestMatch(struct Manifest *mf, const char *name,
+                  const struct stat *st, const unsigned char *hash) {
+    struct ManifestEntry *e;
+    int match = 0;
+
+    /* Only the server directory itself is scanned */
+    if (strchr(name, '/')) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&mf->lock);
+    e = _findManifestEntry(mf, name);
+    if (e && _sameStatus(e, st)) {
+        match = memcmp(e->hash, hash, MF_HASH_LEN) == 0;
+    } else {
+        mf->stale = 1;
+        pthread_cond_signal(&mf->wake);
+    }
+    pthread_mutex_unlock(&mf->lock);
+
+    return match;
+}
+
+/*******************************************************************************
+*      Function: manifestStats()
+*   Description: Reports the size of the manifest.
+*    Parameters: struct Manifest *mf - The manifest.
+*                int *files - Destination for the number of hashed files.
+*                unsigned long long *hashed - Destination for the bytes
+*                                             hashed since startup.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void manifestStats(struct Manifest *mf, int *files,
+                   unsigned long long *hashed) {
+    pthread_mutex_lock(&mf->lock);
+    *files = mf->nEntries;
+    *hashed = mf->hashed;
+    pthread_mutex_unlock(&mf->lock);
+}
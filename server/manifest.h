@@ -0,0 +1,68 @@
+/*******************************************************************************
+*      Filename: manifest.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for manifest.c. Please see manifest.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#define MF_BUCKETS   4096       /* Hash table buckets */
+#define MF_HASH_LEN  16         /* MD5 of a file's contents */
+#define MF_INTERVAL  60         /* Seconds between scans of the directory */
+#define MF_MIN_GAP   1          /* Fewest seconds between two scans */
+#define MF_READ_LEN  1048576    /* Bytes hashed at a time */
+#define MF_NICE      10         /* Scan thread priority, below the workers */
+#define MF_FILE      ".ftmanifest"     /* Where the manifest is kept */
+#define MF_TMP_FILE  ".ftmanifest.tmp" /* Written, then renamed to MF_FILE */
+#define MF_MAGIC     "ftmanifest 1"    /* First line of MF_FILE */
+
+/* The content hash of a regular file, and the status it was hashed at */
+struct ManifestEntry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    dev_t dev;
+    ino_t ino;
+    unsigned char hash[MF_HASH_LEN];
+    unsigned long scan;    /* The last scan that found the file */
+    struct ManifestEntry *hashNext; /* Next entry in the bucket */
+};
+
+struct Manifest {
+    pthread_mutex_t lock;  /* Guards everything below */
+    pthread_cond_t wake;   /* Signalled when an entry is found stale */
+    pthread_t thread;      /* The scan thread */
+    int stale;             /* Nonzero if a scan is wanted early */
+    unsigned long scan;    /* Number of the current scan */
+    int nEntries;          /* Number of hashed files */
+    unsigned long long hashed; /* Bytes hashed since the server started */
+    struct ManifestEntry *buckets[MF_BUCKETS];
+};
+
+struct Manifest *initManifest(int);
+int manifestMatch(struct Manifest *, const char *, const struct stat *,
+                  const unsigned char *);
+void manifestStats(struct Manifest *, int *, unsigned long long *);
+
+#endif
@@ -0,0 +1,266 @@
+/*******************************************************************************
+*      Filename: metrics.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Server metrics: request, listing, file and byte counters,
+*                error counts by cause, and latency histograms for accept to
+*                first byte and for whole requests. Everything is updated
+*                with relaxed atomic operations, so recording never takes a
+*                lock. A text report of the metrics is served by the 's'
+*                command and printed on SIGUSR1.
+*******************************************************************************/
+
+#include "metrics.h"
+
+/* Error reply messages, indexed by enum ErrorKind */
+static const char *errorMsgs[E_KINDS] = {
+    "FILE NOT FOUND", "FILE TOO LARGE", "INVALID RANGE",
+    "NO DIRECTORY CONTENTS", "INVALID COMMAND", "SERVER BUSY",
+    "malformed request", "other"
+};
+
+/*******************************************************************************
+*      Function: _bucket()
+*   Description: Finds the histogram bucket holding a value.
+*    Parameters: unsigned long long v - The value.
+* Preconditions: None.
+*       Returns: The bucket index.
+*******************************************************************************/
+
+int _bucket(unsigned long long v) {
+    int exp;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    if (v >> HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    exp = 63 - __builtin_clzll(v);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*******************************************************************************
+*      Function: _bucketValue()
+*   Description: Gives the value reported for a histogram bucket: the middle
+*                of the range of values it holds.
+*    Parameters: int i - The bucket index.
+* Preconditions: None.
+*       Returns: The value.
+*******************************************************************************/
+
+unsigned long long _bucketValue(int i) {
+    int exp = i / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long long low, width;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    width = 1ULL << (exp - HIST_SUB_BITS);
+    low = (unsigned long long) (HIST_SUB + i % HIST_SUB) * width;
+    return low + width / 2;
+}
+
+/*******************************************************************************
+*      Function: _dumpHistogram()
+*   Description: Appends a line of histogram percentiles to a report. The
+*                buckets are read one at a time while other threads record,
+*                so the percentiles come from a near-consistent snapshot.
+*                A percentile is reported as the middle of its bucket, but
+*                never above the largest value recorded.
+*    Parameters: struct DynBuf *out - The report.
+*                const char *name - The histogram name.
+*                struct Histogram *h - The histogram.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _dumpHistogram(struct DynBuf *out, const char *name,
+                    struct Histogram *h) {
+    static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total = 0, seen = 0, target, max, value;
+    char line[256];
+    int i, p = 0;
+
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+
+    snprintf(line, sizeof(line), "%s (us): count %llu, mean %llu", name,
+             total, total ? atomic_load_explicit(&h->sum,
+                                                 memory_order_relaxed) / total
+                          : 0);
+    dynBufAddStr(out, line);
+
+    for (i = 0; i < HIST_BUCKETS && p < 4 && total; i++) {
+        seen += counts[i];
+        target = (unsigned long long) (pcts[p] / 100.0 * total + 0.5);
+        value = _bucketValue(i);
+        while (p < 4 && seen >= target) {
+            snprintf(line, sizeof(line), ", p%g %llu", pcts[p],
+                     value < max ? value : max);
+            dynBufAddStr(out, line);
+            if (++p < 4) {
+                target = (unsigned long long) (pcts[p] / 100.0 * total + 0.5);
+            }
+        }
+    }
+
+    snprintf(line, sizeof(line), ", max %llu\n", max);
+    dynBufAddStr(out, line);
+}
+
+/*******************************************************************************
+*      Function: initMetrics()
+*   Description: Creates the server metrics, all zero.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: The metrics.
+*******************************************************************************/
+
+struct Metrics *initMetrics(void) {
+    struct Metrics *m;
+
+    m = calloc(1, sizeof(struct Metrics));
+    assert(m);
+    clock_gettime(CLOCK_MONOTONIC, &m->started);
+
+    return m;
+}
+
+/*******************************************************************************
+*      Function: metricsAdd()
+*   Description: Adds to a counter.
+*    Parameters: struct Metrics *m - The metrics.
+*                int counter - One of enum Counter.
+*                unsigned long long n - The amount to add.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void metricsAdd(struct Metrics *m, int counter, unsigned long long n) {
+    atomic_fetch_add_explicit(&m->counters[counter], n, memory_order_relaxed);
+}
+
+/*******************************************************************************
+*      Function: metricsError()
+*   Description: Counts an error.
+*    Parameters: struct Metrics *m - The metrics.
+*                int kind - One of enum ErrorKind.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void metricsError(struct Metrics *m, int kind) {
+    atomic_fetch_add_explicit(&m->errors[kind], 1, memory_order_relaxed);
+}
+
+/*******************************************************************************
+*      Function: metricsErrorMsg()
+*   Description: Counts an error reply by its message.
+*    Parameters: struct Metrics *m - The metrics.
+*                const char *msg - The error message sent to the client.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void metricsErrorMsg(struct Metrics *m, const char *msg) {
+    int kind;
+
+    for (kind = 0; kind < E_OTHER; kind++) {
+        if (strcmp(msg, errorMsgs[kind]) == 0) {
+            break;
+        }
+    }
+    metricsError(m, kind);
+}
+
+/*******************************************************************************
+*      Function: metricsRecord()
+*   Description: Records a latency in a histogram.
+*    Parameters: struct Histogram *h - The histogram.
+*                unsigned long long us - The latency in microseconds.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void metricsRecord(struct Histogram *h, unsigned long long us) {
+    unsigned long long max;
+
+    atomic_fetch_add_explicit(&h->counts[_bucket(us)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (us > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+/*******************************************************************************
+*      Function: metricsSince()
+*   Description: Measures the time elapsed since a CLOCK_MONOTONIC reading.
+*    Parameters: const struct timespec *start - The earlier reading.
+* Preconditions: None.
+*       Returns: The elapsed time in microseconds.
+*******************************************************************************/
+
+unsigned long long metricsSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000ULL +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*******************************************************************************
+*      Function: metricsDump()
+*   Description: Appends a text report of the metrics to a buffer.
+*    Parameters: struct Metrics *m - The metrics.
+*                struct DynBuf *out - The buffer.
+* Preconditions: The buffer has been initialized.
+*       Returns: None.
+*******************************************************************************/
+
+void metricsDump(struct Metrics *m, struct DynBuf *out) {
+    unsigned long long c[M_COUNTERS];
+    char line[512];
+    int i;
+
+    for (i = 0; i < M_COUNTERS; i++) {
+        c[i] = atomic_load_explicit(&m->counters[i], memory_order_relaxed);
+    }
+
+    snprintf(line, sizeof(line),
+             "Uptime: %llu s\n"
+             "Connections: %llu\n"
+             "Requests: %llu list, %llu get, %llu detail, %llu stats, "
+             "%llu put\n"
+             "Served: %llu listings, %llu files, %llu bytes, %llu not "
+             "modified\n"
+             "Stored: %llu files, %llu bytes received\n"
+             "Errors:",
+             metricsSince(&m->started) / 1000000, c[M_CONNS],
+             c[M_LIST_REQS], c[M_GET_REQS], c[M_DETAIL_REQS],
+             c[M_STATS_REQS], c[M_PUT_REQS], c[M_LISTINGS], c[M_FILES],
+             c[M_BYTES_SENT], c[M_UNCHANGED], c[M_STORED], c[M_BYTES_RECV]);
+    dynBufAddStr(out, line);
+
+    for (i = 0; i < E_KINDS; i++) {
+        snprintf(line, sizeof(line), "%s %llu %s", i ? "," : "",
+                 atomic_load_explicit(&m->errors[i], memory_order_relaxed),
+                 errorMsgs[i]);
+        dynBufAddStr(out, line);
+    }
+    dynBufAddStr(out, "\n");
+
+    _dumpHistogram(out, "Accept to first byte", &m->firstByte);
+    _dumpHistogram(out, "Request time", &m->request);
+}
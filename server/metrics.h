@@ -0,0 +1,63 @@
+/*******************************************************************************
+*      Filename: metrics.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for metrics.c. Please see metrics.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dyn_buffer.h"
+
+#define HIST_SUB_BITS  4        /* log2 of the sub-buckets per power of two */
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP   40       /* Values of 2^40 us (12 days) and up share
+                                 * the last bucket */
+#define HIST_BUCKETS   ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Server counters */
+enum Counter { M_CONNS, M_LIST_REQS, M_GET_REQS, M_DETAIL_REQS, M_STATS_REQS,
+               M_PUT_REQS, M_LISTINGS, M_FILES, M_UNCHANGED, M_BYTES_SENT,
+               M_STORED, M_BYTES_RECV, M_COUNTERS };
+
+/* Error replies and dropped connections, by cause */
+enum ErrorKind { E_NOT_FOUND, E_TOO_LARGE, E_BAD_RANGE, E_NO_CONTENTS,
+                 E_BAD_COMMAND, E_BUSY, E_MALFORMED, E_OTHER, E_KINDS };
+
+/* A log-linear latency histogram in microseconds. Each power of two is split
+ * into HIST_SUB buckets, so a recorded value is off by at most 1/HIST_SUB. */
+struct Histogram {
+    atomic_ullong counts[HIST_BUCKETS];
+    atomic_ullong total;   /* Number of recorded values */
+    atomic_ullong sum;     /* Sum of recorded values */
+    atomic_ullong max;     /* Largest recorded value */
+};
+
+/* Every metric kept by the server. Updates are lock-free, so worker
+ * threads and the event loop record without contending. */
+struct Metrics {
+    struct timespec started; /* When the server started */
+    atomic_ullong counters[M_COUNTERS];
+    atomic_ullong errors[E_KINDS];
+    struct Histogram firstByte; /* Accept to first reply byte */
+    struct Histogram request;   /* Command received to reply sent */
+};
+
+struct Metrics *initMetrics(void);
+void metricsAdd(struct Metrics *, int, unsigned long long);
+void metricsError(struct Metrics *, int);
+void metricsErrorMsg(struct Metrics *, const char *);
+void metricsRecord(struct Histogram *, unsigned long long);
+unsigned long long metricsSince(const struct timespec *);
+void metricsDump(struct Metrics *, struct DynBuf *);
+
+#endif
@@ -0,0 +1,264 @@
+/*******************************************************************************
+*      Filename: pool.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: A fixed pool of worker threads that runs blocking work (disk
+*                reads, directory scans) off the event loop thread. Tasks are
+*                spread round-robin across per-worker deques; a worker that
+*                runs dry steals from the others. Finished tasks are posted to
+*                a completion list and announced through an eventfd that the
+*                event loop watches.
+*******************************************************************************/
+
+#include "pool.h"
+
+/*******************************************************************************
+*      Function: _dequePush()
+*   Description: Pushes a task onto the bottom of a deque.
+*    Parameters: struct Deque *dq - The deque.
+*                struct Task *t - The task.
+* Preconditions: The deque has room for the task.
+*       Returns: None.
+*******************************************************************************/
+
+void _dequePush(struct Deque *dq, struct Task *t) {
+    pthread_mutex_lock(&dq->lock);
+    assert(dq->size < dq->cap);
+    dq->tasks[(dq->top + dq->size) % dq->cap] = t;
+    dq->size++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/*******************************************************************************
+*      Function: _dequePop()
+*   Description: Takes the oldest task from the top of a deque. The owning
+*                worker and thieves alike take tasks in the order they were
+*                queued, so a deque that keeps receiving new work can't
+*                leave its oldest commands waiting.
+*    Parameters: struct Deque *dq - The deque.
+* Preconditions: None.
+*       Returns: The task, or NULL if the deque is empty.
+*******************************************************************************/
+
+struct Task *_dequePop(struct Deque *dq) {
+    struct Task *t = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size > 0) {
+        t = dq->tasks[dq->top];
+        dq->top = (dq->top + 1) % dq->cap;
+        dq->size--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return t;
+}
+
+/*******************************************************************************
+*      Function: _nextTask()
+*   Description: Finds a task for a worker, first from its own deque and then
+*                by stealing from the others, sleeping while none are queued.
+*    Parameters: struct Pool *pool - The pool.
+*                int self - The worker's index.
+* Preconditions: None.
+*       Returns: The task.
+*******************************************************************************/
+
+struct Task *_nextTask(struct Pool *pool, int self) {
+    struct Task *t;
+    int i;
+
+    while (1) {
+        t = _dequePop(&pool->deques[self]);
+        for (i = 1; !t && i < pool->nWorkers; i++) {
+            t = _dequePop(&pool->deques[(self + i) % pool->nWorkers]);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (t) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            return t;
+        }
+        /* Sleep until something is queued */
+        while (pool->queued == 0) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* The arguments handed to a new worker thread */
+struct WorkerArg {
+    struct Pool *pool;     /* The owning pool */
+    int self;              /* The worker's index and deque */
+};
+
+/*******************************************************************************
+*      Function: _workerMain()
+*   Description: The worker thread body. Runs tasks forever, posting each one
+*                to the completion list when it finishes.
+*    Parameters: void *arg - The struct WorkerArg for this thread.
+* Preconditions: None.
+*       Returns: Never.
+*******************************************************************************/
+
+void *_workerMain(void *arg) {
+    struct WorkerArg wa = *(struct WorkerArg *) arg;
+    struct Task *t;
+    uint64_t one = 1;
+
+    free(arg);
+
+    while (1) {
+        t = _nextTask(wa.pool, wa.self);
+        t->work(t->arg);
+
+        /* Post the completion and wake the event loop */
+        pthread_mutex_lock(&wa.pool->lock);
+        t->next = wa.pool->done;
+        wa.pool->done = t;
+        pthread_mutex_unlock(&wa.pool->lock);
+        if (write(wa.pool->doneFD, &one, sizeof(one)) == -1) {
+            perror("ftserver: write");
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: initPool()
+*   Description: Creates a pool and starts its worker threads.
+*    Parameters: int nWorkers - The number of worker threads.
+*                int maxOutstanding - The most tasks that may be queued or
+*                                     running at once.
+* Preconditions: Both values are positive.
+*       Returns: The pool.
+*******************************************************************************/
+
+struct Pool *initPool(int nWorkers, int maxOutstanding) {
+    struct Pool *pool;
+    struct WorkerArg *wa;
+    int i;
+
+    assert(nWorkers > 0 && maxOutstanding > 0);
+
+    pool = calloc(1, sizeof(struct Pool));
+    assert(pool);
+    pool->nWorkers = nWorkers;
+    pool->maxOutstanding = maxOutstanding;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pool->doneFD = eventfd(0, EFD_NONBLOCK);
+    if (pool->doneFD == -1) {
+        perror("ftserver: eventfd");
+        exit(2);
+    }
+
+    /* Every deque can hold the whole queue, so pushes never fail */
+    pool->deques = calloc(nWorkers, sizeof(struct Deque));
+    assert(pool->deques);
+    for (i = 0; i < nWorkers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].cap = maxOutstanding;
+        pool->deques[i].tasks = calloc(maxOutstanding, sizeof(struct Task *));
+        assert(pool->deques[i].tasks);
+    }
+
+    pool->threads = calloc(nWorkers, sizeof(pthread_t));
+    assert(pool->threads);
+    for (i = 0; i < nWorkers; i++) {
+        wa = malloc(sizeof(struct WorkerArg));
+        assert(wa);
+        wa->pool = pool;
+        wa->self = i;
+        if (pthread_create(&pool->threads[i], NULL, _workerMain, wa) != 0) {
+            fprintf(stderr, "ftserver: pthread_create failed\n");
+            exit(2);
+        }
+    }
+
+    return pool;
+}
+
+/*******************************************************************************
+*      Function: poolSubmit()
+*   Description: Queues work to be run on a worker thread.
+*    Parameters: struct Pool *pool - The pool.
+*                void (*work)(void *) - The function to run.
+*                void *arg - Its argument, returned by poolReap().
+* Preconditions: None.
+*       Returns: 0 on success, -1 if the pool's queue depth has been reached.
+*******************************************************************************/
+
+int poolSubmit(struct Pool *pool, void (*work)(void *), void *arg) {
+    struct Task *t;
+    unsigned int target;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->outstanding >= pool->maxOutstanding) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->outstanding++;
+    target = pool->nextDeque++ % pool->nWorkers;
+    pthread_mutex_unlock(&pool->lock);
+
+    t = malloc(sizeof(struct Task));
+    assert(t);
+    t->work = work;
+    t->arg = arg;
+    t->next = NULL;
+    _dequePush(&pool->deques[target], t);
+
+    /* Only count the task as queued once it can be found */
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+/*******************************************************************************
+*      Function: poolReap()
+*   Description: Collects the arguments of completed tasks. Called from the
+*                event loop when the pool's eventfd becomes readable.
+*    Parameters: struct Pool *pool - The pool.
+*                void **args - Destination for the completed task arguments.
+*                int maxArgs - The capacity of args.
+* Preconditions: None.
+*       Returns: The number of completions stored in args.
+*******************************************************************************/
+
+int poolReap(struct Pool *pool, void **args, int maxArgs) {
+    struct Task *t;
+    uint64_t count;
+    int n = 0;
+
+    /* Reset the eventfd counter before draining so no wakeup is lost */
+    if (read(pool->doneFD, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("ftserver: read");
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->done && n < maxArgs) {
+        t = pool->done;
+        pool->done = t->next;
+        args[n++] = t->arg;
+        pool->outstanding--;
+        free(t);
+    }
+    /* Leave a wakeup pending for anything left over */
+    if (pool->done) {
+        count = 1;
+        if (write(pool->doneFD, &count, sizeof(count)) == -1) {
+            perror("ftserver: write");
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return n;
+}
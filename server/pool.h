@@ -0,0 +1,57 @@
+/*******************************************************************************
+*      Filename: pool.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for pool.c. Please see pool.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* A unit of work and, once run, a completion */
+struct Task {
+    void (*work)(void *);  /* The function run on a worker thread */
+    void *arg;             /* Its argument, handed back on completion */
+    struct Task *next;     /* Next entry in the completion list */
+};
+
+/* A worker's queue. The event loop pushes at the bottom; the owner and
+ * idle workers stealing from it take the oldest task from the top. */
+struct Deque {
+    pthread_mutex_t lock;
+    struct Task **tasks;   /* Ring buffer of queued tasks */
+    int cap;               /* Ring buffer capacity */
+    int top;               /* Index of the oldest task */
+    int size;              /* Number of queued tasks */
+};
+
+struct Pool {
+    int nWorkers;          /* Number of worker threads */
+    int maxOutstanding;    /* Queued plus running task limit */
+    int outstanding;       /* Tasks submitted but not yet reaped */
+    int queued;            /* Tasks waiting in the deques */
+    unsigned int nextDeque; /* Round-robin submission target */
+    pthread_t *threads;
+    struct Deque *deques;
+    pthread_mutex_t lock;  /* Guards the counters and the done list */
+    pthread_cond_t wake;   /* Signalled when a task is queued */
+    struct Task *done;     /* Completed tasks awaiting reaping */
+    int doneFD;            /* eventfd signalled on each completion */
+};
+
+struct Pool *initPool(int, int);
+int poolSubmit(struct Pool *, void (*)(void *), void *);
+int poolReap(struct Pool *, void **, int);
+
+#endif
@@ -0,0 +1,212 @@
+/*******************************************************************************
+*      Filename: resolver.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: An asynchronous reverse DNS cache for client addresses.
+*                Lookups run on a thread of their own, so neither the event
+*                loop nor the worker pool ever waits on DNS. Until a lookup
+*                completes a client is known by its IP address. Resolved
+*                hostnames are kept for a configurable time and failures for
+*                RV_FAIL_TTL seconds before they are looked up again.
+*******************************************************************************/
+
+#include "resolver.h"
+
+/*******************************************************************************
+*      Function: _hashAddr()
+*   Description: Hashes a presentation address to a bucket index.
+*    Parameters: const char *addr - The address.
+* Preconditions: None.
+*       Returns: The bucket index.
+*******************************************************************************/
+
+unsigned int _hashAddr(const char *addr) {
+    unsigned int hash = 5381;
+
+    while (*addr) {
+        hash = hash * 33 + (unsigned char) *addr++;
+    }
+    return hash % RV_BUCKETS;
+}
+
+/*******************************************************************************
+*      Function: _sweep()
+*   Description: Frees every expired entry that is not waiting for a lookup,
+*                to make room in a full cache.
+*    Parameters: struct Resolver *rv - The resolver.
+*                time_t now - The current time.
+* Preconditions: The resolver lock is held.
+*       Returns: None.
+*******************************************************************************/
+
+void _sweep(struct Resolver *rv, time_t now) {
+    struct HostEntry **pp, *e;
+    int i;
+
+    for (i = 0; i < RV_BUCKETS; i++) {
+        pp = &rv->buckets[i];
+        while ((e = *pp)) {
+            if (!e->queued && e->expires <= now) {
+                *pp = e->hashNext;
+                free(e);
+                rv->nEntries--;
+            } else {
+                pp = &e->hashNext;
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+*      Function: _lookupMain()
+*   Description: The lookup thread body. Resolves queued addresses one at a
+*                time and records each result in its entry.
+*    Parameters: void *arg - The struct Resolver.
+* Preconditions: None.
+*       Returns: Never.
+*******************************************************************************/
+
+void *_lookupMain(void *arg) {
+    struct Resolver *rv = arg;
+    struct HostEntry *e;
+    char host[NI_MAXHOST];
+    int status;
+
+    while (1) {
+        pthread_mutex_lock(&rv->lock);
+        while (!rv->queueHead) {
+            pthread_cond_wait(&rv->wake, &rv->lock);
+        }
+        e = rv->queueHead;
+        rv->queueHead = e->queueNext;
+        if (!rv->queueHead) {
+            rv->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&rv->lock);
+
+        /* Queued entries are never freed or changed by resolverLookup(),
+         * so e is safe to use unlocked */
+        status = getnameinfo((struct sockaddr *) &e->sa, e->saLen, host,
+                             sizeof(host), NULL, 0, NI_NAMEREQD);
+
+        pthread_mutex_lock(&rv->lock);
+        if (status == 0) {
+            strcpy(e->host, host);
+            e->state = HS_RESOLVED;
+            e->expires = time(NULL) + rv->ttl;
+            printf("Resolved %s to %s\n", e->addr, e->host);
+        } else {
+            e->state = HS_FAILED;
+            e->expires = time(NULL) + RV_FAIL_TTL;
+            fprintf(stderr, "ftserver: getnameinfo: %s: %s\n", e->addr,
+                    gai_strerror(status));
+        }
+        e->queued = 0;
+        pthread_mutex_unlock(&rv->lock);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: initResolver()
+*   Description: Creates a resolver and starts its lookup thread.
+*    Parameters: int ttl - Seconds a resolved hostname is trusted.
+* Preconditions: ttl is positive.
+*       Returns: The resolver.
+*******************************************************************************/
+
+struct Resolver *initResolver(int ttl) {
+    struct Resolver *rv;
+
+    assert(ttl > 0);
+
+    rv = calloc(1, sizeof(struct Resolver));
+    assert(rv);
+    rv->ttl = ttl;
+    pthread_mutex_init(&rv->lock, NULL);
+    pthread_cond_init(&rv->wake, NULL);
+
+    if (pthread_create(&rv->thread, NULL, _lookupMain, rv) != 0) {
+        fprintf(stderr, "ftserver: pthread_create failed\n");
+        exit(2);
+    }
+
+    return rv;
+}
+
+/*******************************************************************************
+*      Function: resolverLookup()
+*   Description: Finds the hostname of a client address without blocking.
+*                If no current hostname is cached, a lookup is queued
+*                unless one is already under way or recently failed.
+*    Parameters: struct Resolver *rv - The resolver.
+*                const struct sockaddr_storage *sa - The client address.
+*                socklen_t saLen - The length of the address.
+*                const char *addr - The presentation form of the address.
+*                char *host - Destination for the hostname, or the address
+*                             itself if the hostname is not known yet.
+*                size_t hostLen - The capacity of host.
+* Preconditions: None.
+*       Returns: 0 if host holds a resolved hostname, 1 otherwise.
+*******************************************************************************/
+
+int resolverLookup(struct Resolver *rv, const struct sockaddr_storage *sa,
+                   socklen_t saLen, const char *addr, char *host,
+                   size_t hostLen) {
+    struct HostEntry *e;
+    unsigned int bucket = _hashAddr(addr);
+    time_t now = time(NULL);
+    int status = 1;
+
+    snprintf(host, hostLen, "%s", addr);
+
+    pthread_mutex_lock(&rv->lock);
+    for (e = rv->buckets[bucket]; e; e = e->hashNext) {
+        if (strcmp(e->addr, addr) == 0) {
+            break;
+        }
+    }
+
+    if (e && e->state == HS_RESOLVED) {
+        snprintf(host, hostLen, "%s", e->host);
+        status = 0;
+    }
+    /* Keep using a cached result until it expires */
+    if (e && (e->queued || e->expires > now)) {
+        pthread_mutex_unlock(&rv->lock);
+        return status;
+    }
+
+    if (!e) {
+        if (rv->nEntries >= RV_MAX_ENTRIES) {
+            _sweep(rv, now);
+        }
+        if (rv->nEntries >= RV_MAX_ENTRIES) {
+            pthread_mutex_unlock(&rv->lock);
+            return status;
+        }
+        e = calloc(1, sizeof(struct HostEntry));
+        assert(e);
+        snprintf(e->addr, sizeof(e->addr), "%s", addr);
+        e->hashNext = rv->buckets[bucket];
+        rv->buckets[bucket] = e;
+        rv->nEntries++;
+    }
+
+    /* Queue a fresh lookup. An expired hostname is still used meanwhile. */
+    memcpy(&e->sa, sa, saLen);
+    e->saLen = saLen;
+    e->queued = 1;
+    e->queueNext = NULL;
+    if (rv->queueTail) {
+        rv->queueTail->queueNext = e;
+    } else {
+        rv->queueHead = e;
+    }
+    rv->queueTail = e;
+    pthread_cond_signal(&rv->wake);
+    pthread_mutex_unlock(&rv->lock);
+
+    return status;
+}
@@ -0,0 +1,57 @@
+/*******************************************************************************
+*      Filename: resolver.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for resolver.c. Please see resolver.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <assert.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define RV_BUCKETS     1024     /* Hash table buckets */
+#define RV_MAX_ENTRIES 4096     /* Most addresses remembered at once */
+#define RV_FAIL_TTL    60       /* Seconds before a failed lookup is retried */
+
+/* Lookup results of a cached address */
+enum HostState { HS_PENDING, HS_RESOLVED, HS_FAILED };
+
+/* A client address and, once looked up, its hostname */
+struct HostEntry {
+    char addr[INET6_ADDRSTRLEN]; /* The presentation address, the key */
+    struct sockaddr_storage sa; /* The address to look up */
+    socklen_t saLen;
+    char host[NI_MAXHOST]; /* The hostname, once resolved */
+    int state;             /* One of enum HostState */
+    int queued;            /* Nonzero while waiting for or in a lookup */
+    time_t expires;        /* When the result should be looked up again */
+    struct HostEntry *hashNext; /* Next entry in the bucket */
+    struct HostEntry *queueNext; /* Next entry waiting for the lookup thread */
+};
+
+struct Resolver {
+    pthread_mutex_t lock;  /* Guards everything below */
+    pthread_cond_t wake;   /* Signalled when a lookup is queued */
+    pthread_t thread;      /* The lookup thread */
+    int ttl;               /* Seconds a resolved hostname is trusted */
+    int nEntries;          /* Number of cached addresses */
+    struct HostEntry *buckets[RV_BUCKETS];
+    struct HostEntry *queueHead; /* Lookups waiting, oldest first */
+    struct HostEntry *queueTail;
+};
+
+struct Resolver *initResolver(int);
+int resolverLookup(struct Resolver *, const struct sockaddr_storage *,
+                   socklen_t, const char *, char *, size_t);
+
+#endif
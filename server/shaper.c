@@ -0,0 +1,211 @@
+/*******************************************************************************
+*      Filename: shaper.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Bandwidth shaping for replies. Token buckets cap the rate
+*                of the whole server and of each client connection, and a
+*                deficit round robin scheduler shares what they allow among
+*                the sockets that are ready to send. Each round a flow may
+*                send SC_QUANTUM bytes more than it has used, so flows share
+*                the bandwidth evenly whatever their send sizes. Interactive
+*                flows - listings, errors and small files - are served before
+*                bulk transfers, which use whatever bandwidth is left.
+*******************************************************************************/
+
+#include "shaper.h"
+
+/*******************************************************************************
+*      Function: shaperNow()
+*   Description: Reads the monotonic clock.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: The time in nanoseconds.
+*******************************************************************************/
+
+unsigned long long shaperNow(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*******************************************************************************
+*      Function: initBucket()
+*   Description: Initializes a full token bucket.
+*    Parameters: struct TokenBucket *b - The bucket.
+*                unsigned long long rate - Bytes per second, or 0 for no
+*                                          limit.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void initBucket(struct TokenBucket *b, unsigned long long rate) {
+    b->rate = rate;
+    b->burst = rate / SC_BURST_DIV;
+    if (b->burst < SC_BURST_MIN) {
+        b->burst = SC_BURST_MIN;
+    }
+    b->tokens = b->burst;
+    b->last = shaperNow();
+}
+
+/*******************************************************************************
+*      Function: bucketRefill()
+*   Description: Adds the tokens earned since the bucket was last refilled.
+*    Parameters: struct TokenBucket *b - The bucket.
+*                unsigned long long now - The current time in ns.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void bucketRefill(struct TokenBucket *b, unsigned long long now) {
+    if (!b->rate || now <= b->last) {
+        return;
+    }
+    b->tokens += (double) b->rate * (now - b->last) / 1e9;
+    if (b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+    b->last = now;
+}
+
+/*******************************************************************************
+*      Function: bucketAvail()
+*   Description: Finds how many bytes a bucket allows to be sent now.
+*    Parameters: const struct TokenBucket *b - The bucket.
+* Preconditions: The bucket has been refilled.
+*       Returns: The byte count, LLONG_MAX if the bucket has no limit.
+*******************************************************************************/
+
+long long bucketAvail(const struct TokenBucket *b) {
+    if (!b->rate) {
+        return LLONG_MAX;
+    }
+    return b->tokens < 0 ? 0 : (long long) b->tokens;
+}
+
+/*******************************************************************************
+*      Function: bucketTake()
+*   Description: Spends tokens on bytes that were sent.
+*    Parameters: struct TokenBucket *b - The bucket.
+*                long long n - The number of bytes.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void bucketTake(struct TokenBucket *b, long long n) {
+    if (b->rate) {
+        b->tokens -= n;
+    }
+}
+
+/*******************************************************************************
+*      Function: bucketWait()
+*   Description: Finds how long until a bucket allows a send worth making,
+*                of SC_MIN_SEND bytes or a full burst if that is smaller.
+*    Parameters: const struct TokenBucket *b - The bucket.
+* Preconditions: The bucket has been refilled.
+*       Returns: The wait in ns, 0 if a send may be made now.
+*******************************************************************************/
+
+unsigned long long bucketWait(const struct TokenBucket *b) {
+    double need = SC_MIN_SEND;
+
+    if (need > b->burst) {
+        need = b->burst;
+    }
+    if (!b->rate || b->tokens >= need) {
+        return 0;
+    }
+    return (unsigned long long) ((need - b->tokens) * 1e9 / b->rate) + 1;
+}
+
+/*******************************************************************************
+*      Function: initScheduler()
+*   Description: Initializes a scheduler with no flows.
+*    Parameters: struct Scheduler *sc - The scheduler.
+*                unsigned long long globalRate - The server's limit in bytes
+*                                                per second, or 0.
+*                unsigned long long connRate - Each connection's limit in
+*                                              bytes per second, or 0.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void initScheduler(struct Scheduler *sc, unsigned long long globalRate,
+                   unsigned long long connRate) {
+    memset(sc, 0, sizeof(struct Scheduler));
+    initBucket(&sc->global, globalRate);
+    sc->connRate = connRate;
+}
+
+/*******************************************************************************
+*      Function: schedAdd()
+*   Description: Puts a flow at the end of a class's list, where it keeps its
+*                deficit.
+*    Parameters: struct Scheduler *sc - The scheduler.
+*                struct Flow *f - The flow.
+*                int cls - One of enum FlowClass.
+* Preconditions: The flow is not active.
+*       Returns: None.
+*******************************************************************************/
+
+void schedAdd(struct Scheduler *sc, struct Flow *f, int cls) {
+    f->active = 1;
+    f->cls = cls;
+    f->next = NULL;
+    f->prev = sc->tail[cls];
+    if (sc->tail[cls]) {
+        sc->tail[cls]->next = f;
+    } else {
+        sc->head[cls] = f;
+    }
+    sc->tail[cls] = f;
+    sc->count[cls]++;
+}
+
+/*******************************************************************************
+*      Function: schedRemove()
+*   Description: Takes a flow off its list, if it is on one.
+*    Parameters: struct Scheduler *sc - The scheduler.
+*                struct Flow *f - The flow.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void schedRemove(struct Scheduler *sc, struct Flow *f) {
+    if (!f->active) {
+        return;
+    }
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        sc->head[f->cls] = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        sc->tail[f->cls] = f->prev;
+    }
+    f->prev = f->next = NULL;
+    f->active = 0;
+    sc->count[f->cls]--;
+}
+
+/*******************************************************************************
+*      Function: schedPop()
+*   Description: Takes the flow whose turn it is in a class.
+*    Parameters: struct Scheduler *sc - The scheduler.
+*                int cls - One of enum FlowClass.
+* Preconditions: None.
+*       Returns: The flow, no longer active, or NULL if the class has none.
+*******************************************************************************/
+
+struct Flow *schedPop(struct Scheduler *sc, int cls) {
+    struct Flow *f = sc->head[cls];
+
+    if (f) {
+        schedRemove(sc, f);
+    }
+    return f;
+}
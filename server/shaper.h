@@ -0,0 +1,71 @@
+/*******************************************************************************
+*      Filename: shaper.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for shaper.c. Please see shaper.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SC_QUANTUM   1048576    /* Bytes added to a flow's deficit each round */
+#define SC_BATCH     8388608    /* Most bytes sent per scheduling pass */
+#define SC_SMALL     1048576    /* Replies up to this long are interactive */
+#define SC_MIN_SEND  16384      /* Fewest tokens worth waking a flow for */
+#define SC_BURST_DIV 8          /* A bucket holds 1/SC_BURST_DIV s of tokens */
+#define SC_BURST_MIN 65536      /* ...but never fewer than this many */
+
+/* Scheduling classes, served in strict priority order */
+enum FlowClass { SC_INTERACTIVE, SC_BULK, SC_CLASSES };
+
+/* A token bucket limiting a byte rate */
+struct TokenBucket {
+    unsigned long long rate; /* Bytes per second, or 0 for no limit */
+    double burst;          /* Most tokens held */
+    double tokens;         /* Bytes that may be sent now */
+    unsigned long long last; /* When tokens were last added, in ns */
+};
+
+struct Handle;
+
+/* A socket with reply bytes to send: a session's control connection or a
+ * data connection */
+struct Flow {
+    struct Handle *h;      /* The socket */
+    struct TokenBucket *bucket; /* Its control connection's bucket */
+    int active;            /* Nonzero while on a scheduler list */
+    int cls;               /* One of enum FlowClass, while active */
+    long long deficit;     /* Bytes the flow may still send this round */
+    unsigned int events;   /* epoll interest of a data connection */
+    struct Flow *prev;     /* Neighbours on the scheduler list */
+    struct Flow *next;
+};
+
+/* A deficit round robin scheduler over the flows ready to send */
+struct Scheduler {
+    struct TokenBucket global; /* Limits all flows together */
+    unsigned long long connRate; /* Per connection limit, or 0 */
+    struct Flow *head[SC_CLASSES];
+    struct Flow *tail[SC_CLASSES];
+    int count[SC_CLASSES];
+};
+
+unsigned long long shaperNow(void);
+void initBucket(struct TokenBucket *, unsigned long long);
+void bucketRefill(struct TokenBucket *, unsigned long long);
+long long bucketAvail(const struct TokenBucket *);
+void bucketTake(struct TokenBucket *, long long);
+unsigned long long bucketWait(const struct TokenBucket *);
+void initScheduler(struct Scheduler *, unsigned long long,
+                   unsigned long long);
+void schedAdd(struct Scheduler *, struct Flow *, int);
+void schedRemove(struct Scheduler *, struct Flow *);
+struct Flow *schedPop(struct Scheduler *, int);
+
+#endif
@@ -3,7 +3,7 @@
 *        Author: Maxwell Goldberg
 * Last Modified: 03.11.17
 *   Description: The SIGINT signal handler and a utility for registering it in
-*                the main function.
+*                the main function, and the SIGUSR1 stats request signal.
 *******************************************************************************/
 
 #include "signal.h"
@@ -25,7 +25,10 @@ void catchSIGINT(int signo) {
 
 /*******************************************************************************
 *      Function: registerHandler()
-*   Description: Registers the SIGINT signal handler.
+*   Description: Registers the SIGINT signal handler, ignores SIGPIPE and
+*                blocks SIGUSR1 so that it can be read from a signalfd.
+*                Called before any thread starts, so every thread inherits
+*                the blocked mask.
 *    Parameters: None.
 * Preconditions: None.
 *       Returns: None.
@@ -46,4 +49,44 @@ void registerHandler() {
         perror("ftserver: sigaction");
         exit(1);
     }
+
+    /* Ignore SIGPIPE so that a client closing its end mid-transfer surfaces
+     * as an EPIPE error on that connection instead of killing the server */
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("ftserver: sigaction");
+        exit(1);
+    }
+
+    /* Block SIGUSR1, which the event loop reads through initStatsSignal() */
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &sa.sa_mask, NULL) == -1) {
+        perror("ftserver: sigprocmask");
+        exit(1);
+    }
+}
+
+/*******************************************************************************
+*      Function: initStatsSignal()
+*   Description: Opens a signalfd that becomes readable when SIGUSR1 is
+*                received, so the event loop can print the server stats
+*                outside of a signal handler.
+*    Parameters: None.
+* Preconditions: registerHandler() has blocked SIGUSR1.
+*       Returns: The signalfd, or -1 on failure.
+*******************************************************************************/
+
+int initStatsSignal() {
+    sigset_t mask;
+    int fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("ftserver: signalfd");
+    }
+    return fd;
 }
@@ -11,36 +11,30 @@
 
 /*******************************************************************************
 *      Function: obtainClientCredentials()
-*   Description: Obtains the hostname and IP address if the socket identified
-*                by a struct sockaddr_storage.
+*   Description: Obtains the IP address of the socket identified by a struct
+*                sockaddr_storage, for IPv4 and IPv6 peers alike. The
+*                hostname is left to the resolver, so that no DNS lookup
+*                happens on the accept path.
 *    Parameters: struct sockaddr_storage *clientAddr - The sockaddr struct.
-*                char *host - The destination of the hostname.
-*                char *inetStr - The destination of the IP address.
+*                socklen_t addrLen - The length of the address.
+*                char *inetStr - The destination of the IP address, at least
+*                                INET6_ADDRSTRLEN bytes long.
 * Preconditions: The sockaddr_storage * points to the socket information.
-*       Returns: 0 on success, 1 on failure to find the hostname.
+*       Returns: 0 on success, 1 on failure.
 *******************************************************************************/
 
-int obtainClientCredentials(struct sockaddr_storage *clientAddr, char *host,
-                         char *inetStr) {
-    struct addrinfo hints, *targetinfo;
-    struct hostent *he;
+int obtainClientCredentials(struct sockaddr_storage *clientAddr,
+                            socklen_t addrLen, char *inetStr) {
     int status;
 
-    /* Get the presentation internet address */
-    inet_ntop(AF_INET, &(((struct sockaddr_in *) clientAddr)->sin_addr), 
-              inetStr, INET_ADDRSTRLEN);
-    /* Get the host information. Note that we use the deprecated 
-     * gethostbyaddr() here because getnameinfo() produced
-     * a memory leak (or the appearance of a leak in Valgrind). */ 
-    he = gethostbyaddr(&(((struct sockaddr_in *) clientAddr)->sin_addr),
-                       INET_ADDRSTRLEN, AF_INET);
-    if (!he) {
-        herror("ftserver: gethostbyname");
-        strcpy(host, "unknown host"); 
+    status = getnameinfo((struct sockaddr *) clientAddr, addrLen, inetStr,
+                         INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST);
+    if (status != 0) {
+        fprintf(stderr, "ftserver: getnameinfo: %s\n", gai_strerror(status));
+        strcpy(inetStr, "unknown address");
         return 1;
-    } 
+    }
 
-    strcpy(host, he->h_name);
     return 0;
 }
 
@@ -121,8 +115,8 @@ int _bindSocket(struct addrinfo *servinfo) {
 
 /*******************************************************************************
 *      Function: _connectSocket()
-*   Description: Attempts to initialize and connect a socket to a server 
-*                specified by a struct addrinfo.
+*   Description: Attempts to initialize a non-blocking socket and start
+*                connecting it to a server specified by a struct addrinfo.
 *    Parameters: struct addrinfo *servinfo - The server information.
 * Preconditions: None.
 *       Returns: The socket file descriptor, -1 on failure.
@@ -134,14 +128,17 @@ int _connectSocket(struct addrinfo *servinfo) {
 
     /* Iterate through all possible addrinfos. */
     for (p = servinfo; p != NULL; p = p->ai_next) {
-        /* Initialize a socket */
-        sockFD = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        /* Initialize a non-blocking socket */
+        sockFD = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                        p->ai_protocol);
         if (sockFD == -1) {
             perror("ftserver: socket");
             continue;
         }
-        /* Attempt to connect */
-        if (connect(sockFD, p->ai_addr, p->ai_addrlen) == -1) {
+        /* Start the connection. Completion is reported by the event loop
+         * once the socket becomes writable. */
+        if (connect(sockFD, p->ai_addr, p->ai_addrlen) == -1 &&
+            errno != EINPROGRESS) {
             close(sockFD);
             perror("ftserver: connect");
             continue; 
@@ -151,7 +148,8 @@ int _connectSocket(struct addrinfo *servinfo) {
     }
 
     if (!p) {
-        fprintf(stderr, "ftserver: failed to bind\n");
+        fprintf(stderr, "ftserver: failed to connect\n");
+        freeaddrinfo(servinfo);
         return -1;
     }
     /* Free the addrinfo struct */
@@ -178,12 +176,13 @@ int initServer(const char *serverPort) {
 
 /*******************************************************************************
 *      Function: initDataConn()
-*   Description: Obtain the client's listening socket address and attempt to
-*                connect to it.
+*   Description: Obtain the client's listening socket address and start a
+*                non-blocking connection to it.
 *    Parameters: const char *hostInfo - The client IP address info string.
 *                const char *dataPort - The client data listening port.
 * Preconditions: None.
-*       Returns: The data connection file descriptor, -1 on failure.
+*       Returns: The data connection file descriptor (possibly still
+*                connecting), -1 on failure.
 *******************************************************************************/
 
 int initDataConn(const char *hostInfo, const char *dataPort) {
@@ -194,160 +193,139 @@ int initDataConn(const char *hostInfo, const char *dataPort) {
 }
 
 /*******************************************************************************
-*      Function: sendAll()
-*   Description: Attempts to send all bytes of a message into a socket.
-*    Parameters: int sockfd - The socket file descriptor.
-*                char *msg - The byte string to be sent.
-*                int msgLen - The length of the string.
+*      Function: setNonBlocking()
+*   Description: Places a file descriptor in non-blocking mode.
+*    Parameters: int fd - The file descriptor.
 * Preconditions: None.
-*       Returns: 0 on success, 1 on failure.
+*       Returns: 0 on success, -1 on failure.
 *******************************************************************************/
 
-int sendAll(int sockfd, char *msg, int msgLen) {
-    int totalSent = 0;
-    int currSent;
-
-    /* Continue sending while the total number of bytes sent is less than
-     * the message length */
-    while (totalSent < msgLen) {
-        currSent = send(sockfd, &msg[totalSent], msgLen-totalSent, 0);
-        if (currSent == -1) {
-            perror("ftserver: send");
-            return 1;
-        }
+int setNonBlocking(int fd) {
+    int flags;
 
-        totalSent += currSent;
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("ftserver: fcntl");
+        return -1;
     }
-
     return 0;
 }
 
 /*******************************************************************************
-*      Function: _cmdRecvHelper()
-*   Description: Attempts to take in msgLen bytes of a sending socket's message.
+*      Function: connectResult()
+*   Description: Obtains the outcome of a non-blocking connect() once the
+*                socket has become writable.
 *    Parameters: int sockfd - The socket file descriptor.
-*                char *msg - The message buffer.
-*                int msgLen - The length of the message to be received.
-* Preconditions: None.
-*       Returns: 0 on sender closure, -1 on error, a positive value otherwise.
+* Preconditions: connect() was started on the socket.
+*       Returns: 0 if the connection was established, the error code
+*                otherwise.
 *******************************************************************************/
 
-int _cmdRecvHelper(int sockfd, char *msg, int msgLen) {
-    char buffer[msgLen+1];
-    int bytesRecvd = 0;
-    int status, i;
-
-    /* While part of the message (up to msgLen) hasn't been received... */
-    while(bytesRecvd < msgLen) {
-        memset(buffer, 0, sizeof(buffer));
-
-        /* Receive more of the message */
-        status = recv(sockfd, buffer, msgLen - bytesRecvd, 0);
-   
-        /* Handle socket closure */
-        if(status == 0) {
-            fprintf(stderr, "ftserver: Client ended connection.\n");
-            if (close(sockfd) != 0) {
-                perror("ftserver: close");
-            }
-            return status;
-        }
-        /* Handle errors */
-        if(status == -1) {
-            perror("ftserver: recv");
-            if (close(sockfd) != 0) {
-                perror("ftserver: close");
-            }
-            return status;
-        }
-        /* Append the temp buffer to the message buffer */ 
-        for (i =0; i < status; i++) {
-            msg[bytesRecvd + i] = buffer[i];
-        }
- 
-        bytesRecvd += status;
-    }
+int connectResult(int sockfd) {
+    int err = 0;
+    socklen_t errLen = sizeof(err);
 
-    return status;
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen) == -1) {
+        return errno;
+    }
+    return err;
 }
 
 /*******************************************************************************
-*      Function: cmdRecv()
-*   Description: Receives an entire client command.
+*      Function: sendSome()
+*   Description: Sends as much of a byte string as a non-blocking socket will
+*                currently accept.
 *    Parameters: int sockfd - The socket file descriptor.
-*                struct ClientCmd *cmd - The client command struct to inform.
+*                const char *msg - The byte string to be sent.
+*                size_t msgLen - The length of the string.
 * Preconditions: None.
-*       Returns: -1 on recv() error, 0 on unexpected socket closure, and a
-*                positive value otherwise.
+*       Returns: The number of bytes sent, or -1 with errno set. EAGAIN means
+*                the socket is full and the caller should wait.
 *******************************************************************************/
 
-int cmdRecv(int sockfd, struct ClientCmd *cmd) {
-    char header[HEADER_LEN+1];
-    char body[FNAME_MAX+1];
-    int status;
-
-    memset(header, 0, sizeof(header));
-    memset(body, 0, sizeof(body));
+ssize_t sendSome(int sockfd, const char *msg, size_t msgLen) {
+    ssize_t currSent;
 
-    /* Get the header byte string */
-    status = _cmdRecvHelper(sockfd, header, HEADER_LEN);
+    do {
+        currSent = send(sockfd, msg, msgLen, MSG_NOSIGNAL);
+    } while (currSent == -1 && errno == EINTR);
 
-    if (status <= 0) {
-        return status;
-    }
-    
-    /* Process the header into the struct */ 
-    processHeader(header, cmd);    
-
-    /* Get the body byte string */
-    if (cmd->len) {
-        status = _cmdRecvHelper(sockfd, body, cmd->len);
-        if (status <= 0) {
-            return status;
-        }
-        strcpy(cmd->fName, body);
-    }
-    return status;
+    return currSent;
 }
 
 /*******************************************************************************
-*      Function: responseSend()
-*   Description: Sends an entire response message into a socket.
+*      Function: sendVecSome()
+*   Description: Sends as much of a list of byte strings as a non-blocking
+*                socket will currently accept, in one system call, so a
+*                header and the data after it can share packets.
 *    Parameters: int sockfd - The socket file descriptor.
-*                char mode - The response mode.
-*                struct DynBuf *body - The dynamic string.
-*                struct ClientCmd *cmd - The client command.
-* Preconditions: The client command, mode, and message body have been 
-*                initialized.
-*       Returns: 0 on success, 1 on failure.
+*                struct iovec *iov - The byte strings, in order.
+*                int iovcnt - The number of byte strings.
+*                int more - Nonzero if more data follows straight after, so
+*                the kernel should hold back a short final packet.
+* Preconditions: None.
+*       Returns: The number of bytes sent, or -1 with errno set. EAGAIN means
+*                the socket is full and the caller should wait.
 *******************************************************************************/
 
-int responseSend(int sockfd, char mode, struct DynBuf *body, 
-                  struct ClientCmd *cmd) {
-    char header[HEADER_LEN+1];
-    char *msg;
-    int i, status;
+ssize_t sendVecSome(int sockfd, struct iovec *iov, int iovcnt, int more) {
+    struct msghdr msg;
+    ssize_t currSent;
 
-    memset(header, 0, sizeof(header));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
 
-    /* Pack the header according to the client command */
-    packHeader(cmd, mode, header, body->buffer, body->size);
+    do {
+        currSent = sendmsg(sockfd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    } while (currSent == -1 && errno == EINTR);
 
-    /* Pack the message into a single string */
-    msg = malloc(sizeof(char) * (HEADER_LEN + body->size + 1));
-    memset(msg, 0, sizeof(msg));
+    return currSent;
+}
 
-    for (i = 0; i < HEADER_LEN; i++) {
-        msg[i] = (unsigned char) header[i];
-    }
+/*******************************************************************************
+*      Function: sendFileSome()
+*   Description: Sends as much of a file region as a non-blocking socket will
+*                currently accept. The data is handed to the socket with
+*                sendfile() so that it is never copied into user space. If the
+*                kernel refuses the pair, a bounded pread()/send() copy is
+*                used instead; only the bytes actually sent are consumed, so
+*                nothing needs to be held between calls.
+*    Parameters: int sockfd - The socket file descriptor.
+*                int fileFD - The open file descriptor.
+*                off_t *offset - The file offset, advanced by the bytes sent.
+*                off_t len - The number of bytes left to send.
+* Preconditions: None.
+*       Returns: The number of bytes sent, or -1 with errno set. A return of 0
+*                with len > 0 means the file was truncated.
+*******************************************************************************/
 
-    for (i = 0; i < body->size; i++) {
-        msg[i+HEADER_LEN] = body->buffer[i];
+ssize_t sendFileSome(int sockfd, int fileFD, off_t *offset, off_t len) {
+    char buffer[FILE_CHUNK_LEN];
+    ssize_t currSent, currRead;
+    size_t toSend;
+
+    toSend = len < SENDFILE_MAX ? (size_t) len : SENDFILE_MAX;
+    do {
+        currSent = sendfile(sockfd, fileFD, offset, toSend);
+    } while (currSent == -1 && errno == EINTR);
+
+    if (currSent != -1 || (errno != EINVAL && errno != ENOSYS)) {
+        return currSent;
     }
-    /* Send the message */
-    status = sendAll(sockfd, msg, HEADER_LEN + body->size);   
 
-    free(msg); 
+    /* Fall back to copying a single chunk through user space */
+    toSend = len < FILE_CHUNK_LEN ? (size_t) len : FILE_CHUNK_LEN;
+    do {
+        currRead = pread(fileFD, buffer, toSend, *offset);
+    } while (currRead == -1 && errno == EINTR);
+    if (currRead <= 0) {
+        return currRead;
+    }
 
-    return status;
+    currSent = sendSome(sockfd, buffer, currRead);
+    if (currSent > 0) {
+        *offset += currSent;
+    }
+    return currSent;
 }
@@ -17,20 +17,28 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "command.h"
 
+#define FILE_CHUNK_LEN 65536     /* Read/send fallback buffer length */
+#define SENDFILE_MAX   0x7ffff000 /* Largest single sendfile() transfer */
+
 int initServer(const char *);
 int initDataConn(const char *, const char *);
-int sendAll(int, char *, int);
-int cmdRecv(int, struct ClientCmd *);
-int responseSend(int, char, struct DynBuf *, struct ClientCmd *);
+int setNonBlocking(int);
+int connectResult(int);
+ssize_t sendSome(int, const char *, size_t);
+ssize_t sendVecSome(int, struct iovec *, int, int);
+ssize_t sendFileSome(int, int, off_t *, off_t);
 
-int obtainClientCredentials(struct sockaddr_storage *, char *, char *);
+int obtainClientCredentials(struct sockaddr_storage *, socklen_t, char *);
 
 #endif
@@ -0,0 +1,375 @@
+/*******************************************************************************
+*      Filename: treewalk.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Walks a directory tree for recursive listings and archives.
+*                A few walker threads list directories ahead of the reply,
+*                so directory reads and stat calls overlap with sending. The
+*                reply still takes entries in depth-first order: it descends
+*                into each directory as soon as the directory's own entry
+*                has been taken. If the directory it needs next hasn't been
+*                listed yet, the reply lists it itself rather than wait. At
+*                most TW_AHEAD directories are held listed ahead of the
+*                reply. No more than TW_MAX_WALKERS walkers run across the
+*                server; a walk started while they are all busy gets fewer,
+*                or none, and its reply lists the rest. Paths never leave
+*                the server directory, and symbolic links are not followed.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include "treewalk.h"
+#include "dirlist.h"
+
+/* Walker threads running for all walks */
+pthread_mutex_t twLock = PTHREAD_MUTEX_INITIALIZER;
+int twWalkers = 0;
+
+/*******************************************************************************
+*      Function: treeOpen()
+*   Description: Opens a path beneath the server directory, refusing any
+*                path that escapes it or runs through a symbolic link.
+*    Parameters: const char *path - The relative path.
+*                int flags - The open() flags.
+* Preconditions: None.
+*       Returns: The file descriptor, or -1 with errno set.
+*******************************************************************************/
+
+int treeOpen(const char *path, int flags) {
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    return syscall(SYS_openat2, AT_FDCWD, path[0] ? path : ".", &how,
+                   sizeof(how));
+}
+
+/*******************************************************************************
+*      Function: _newDir()
+*   Description: Creates a directory waiting to be listed.
+*    Parameters: const char *path - The directory's relative path.
+* Preconditions: None.
+*       Returns: The directory.
+*******************************************************************************/
+
+struct TreeDir *_newDir(const char *path) {
+    struct TreeDir *d;
+
+    d = calloc(1, sizeof(struct TreeDir));
+    assert(d);
+    d->path = strdup(path);
+    assert(d->path);
+    d->state = DS_QUEUED;
+    return d;
+}
+
+/*******************************************************************************
+*      Function: _freeDir()
+*   Description: Frees a directory with the entries the reply hasn't taken,
+*                and the listings of the subdirectories among them.
+*    Parameters: struct TreeDir *d - The directory.
+* Preconditions: No thread is listing the directory or its subdirectories.
+*       Returns: None.
+*******************************************************************************/
+
+void _freeDir(struct TreeDir *d) {
+    int i;
+
+    for (i = 0; i < d->nEnts; i++) {
+        if (i >= d->next && d->ents[i].sub) {
+            _freeDir(d->ents[i].sub);
+        }
+        free(d->ents[i].path);
+    }
+    free(d->ents);
+    free(d->path);
+    free(d);
+}
+
+/*******************************************************************************
+*      Function: _listDir()
+*   Description: Lists a directory, keeping its regular files and
+*                subdirectories. Each subdirectory gets a listing of its own,
+*                not yet read. Entries whose paths would be too long, and
+*                directories that can't be read, are left out.
+*    Parameters: struct TreeDir *d - The directory.
+* Preconditions: The caller has claimed the directory for listing.
+*       Returns: None.
+*******************************************************************************/
+
+void _listDir(struct TreeDir *d) {
+    char buf[DIRENT_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct LinuxDirent64))));
+    char path[PATH_MAX];
+    struct LinuxDirent64 *ld;
+    struct TreeEnt *e;
+    struct statx stx;
+    long status, pos;
+    int fd, cap = 0;
+
+    fd = treeOpen(d->path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return;
+    }
+
+    while ((status = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < status; pos += ld->d_reclen) {
+            ld = (struct LinuxDirent64 *) (buf + pos);
+            if (strcmp(ld->d_name, ".") == 0 ||
+                strcmp(ld->d_name, "..") == 0 ||
+                (!d->path[0] && reservedName(ld->d_name)) ||
+                snprintf(path, sizeof(path), "%s%s%s", d->path,
+                         d->path[0] ? "/" : "", ld->d_name) >=
+                (int) sizeof(path) ||
+                statx(fd, ld->d_name,
+                      AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                      STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME,
+                      &stx) == -1 ||
+                (!S_ISREG(stx.stx_mode) && !S_ISDIR(stx.stx_mode))) {
+                continue;
+            }
+
+            if (d->nEnts == cap) {
+                cap = cap ? cap * 2 : 16;
+                d->ents = realloc(d->ents, cap * sizeof(struct TreeEnt));
+                assert(d->ents);
+            }
+            e = &d->ents[d->nEnts++];
+            e->path = strdup(path);
+            assert(e->path);
+            e->mode = stx.stx_mode;
+            e->size = S_ISREG(stx.stx_mode) ? (off_t) stx.stx_size : 0;
+            e->mtime = stx.stx_mtime.tv_sec;
+            e->sub = S_ISDIR(stx.stx_mode) ? _newDir(path) : NULL;
+        }
+    }
+    if (status == -1) {
+        perror("ftserver: getdents64");
+    }
+    close(fd);
+}
+
+/*******************************************************************************
+*      Function: _finishListing()
+*   Description: Marks a directory listed and queues its subdirectories, the
+*                first one last so that walkers take them in the order the
+*                reply will need them.
+*    Parameters: struct TreeWalk *tw - The walk.
+*                struct TreeDir *d - The directory just listed.
+* Preconditions: tw->lock is held.
+*       Returns: None.
+*******************************************************************************/
+
+void _finishListing(struct TreeWalk *tw, struct TreeDir *d) {
+    int i;
+
+    for (i = d->nEnts - 1; i >= 0; i--) {
+        if (d->ents[i].sub) {
+            d->ents[i].sub->queueNext = tw->queue;
+            tw->queue = d->ents[i].sub;
+        }
+    }
+    d->state = DS_READY;
+    tw->ahead++;
+    pthread_cond_broadcast(&tw->ready);
+    pthread_cond_broadcast(&tw->work);
+}
+
+/*******************************************************************************
+*      Function: _releaseWalk()
+*   Description: Drops a reference to a walk, freeing it with everything
+*                still listed once the reply and all walkers are done.
+*    Parameters: struct TreeWalk *tw - The walk.
+* Preconditions: tw->lock is held. It is released.
+*       Returns: None.
+*******************************************************************************/
+
+void _releaseWalk(struct TreeWalk *tw) {
+    struct TreeDir *d, *up;
+
+    if (--tw->refs > 0) {
+        pthread_mutex_unlock(&tw->lock);
+        return;
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    /* Every remaining directory hangs off the reply's stack */
+    for (d = tw->top; d; d = up) {
+        up = d->up;
+        _freeDir(d);
+    }
+    pthread_mutex_destroy(&tw->lock);
+    pthread_cond_destroy(&tw->work);
+    pthread_cond_destroy(&tw->ready);
+    free(tw);
+}
+
+/*******************************************************************************
+*      Function: _walkerMain()
+*   Description: The walker thread body. Lists queued directories, newest
+*                first, while the reply is fewer than TW_AHEAD directories
+*                behind, until the walk is abandoned or finished.
+*    Parameters: void *arg - The struct TreeWalk.
+* Preconditions: None.
+*       Returns: NULL.
+*******************************************************************************/
+
+void *_walkerMain(void *arg) {
+    struct TreeWalk *tw = arg;
+    struct TreeDir *d;
+
+    pthread_mutex_lock(&tw->lock);
+    while (!tw->stop && tw->top) {
+        if (!tw->queue || tw->ahead >= TW_AHEAD) {
+            pthread_cond_wait(&tw->work, &tw->lock);
+            continue;
+        }
+        d = tw->queue;
+        tw->queue = d->queueNext;
+        d->state = DS_LISTING;
+        pthread_mutex_unlock(&tw->lock);
+
+        _listDir(d);
+
+        pthread_mutex_lock(&tw->lock);
+        _finishListing(tw, d);
+    }
+    _releaseWalk(tw);
+
+    pthread_mutex_lock(&twLock);
+    twWalkers--;
+    pthread_mutex_unlock(&twLock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: initTreeWalk()
+*   Description: Starts walking a directory tree, with as many of
+*                TW_THREADS walkers as the server-wide limit allows.
+*    Parameters: const char *root - The relative path of the tree's root, or
+*                                   "" for the server directory.
+* Preconditions: None.
+*       Returns: The walk, or NULL if the root isn't a directory beneath the
+*                server directory.
+*******************************************************************************/
+
+struct TreeWalk *initTreeWalk(const char *root) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct TreeWalk *tw;
+    int i, fd, n;
+
+    fd = treeOpen(root, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return NULL;
+    }
+    close(fd);
+
+    tw = calloc(1, sizeof(struct TreeWalk));
+    assert(tw);
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->work, NULL);
+    pthread_cond_init(&tw->ready, NULL);
+    tw->top = _newDir(root);
+    tw->queue = tw->top;
+    tw->refs = 1;
+
+    /* Claim walker slots up front; unused ones are handed back */
+    pthread_mutex_lock(&twLock);
+    n = TW_MAX_WALKERS - twWalkers;
+    if (n > TW_THREADS) {
+        n = TW_THREADS;
+    }
+    twWalkers += n;
+    pthread_mutex_unlock(&twLock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&tw->lock);
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&thread, &attr, _walkerMain, tw) != 0) {
+            perror("ftserver: pthread_create");
+            break;
+        }
+        tw->refs++;
+    }
+    pthread_mutex_unlock(&tw->lock);
+    pthread_attr_destroy(&attr);
+
+    if (i < n) {
+        pthread_mutex_lock(&twLock);
+        twWalkers -= n - i;
+        pthread_mutex_unlock(&twLock);
+    }
+
+    return tw;
+}
+
+/*******************************************************************************
+*      Function: treeWalkNext()
+*   Description: Takes the next entry of a walk in depth-first order. A
+*                directory's entry comes before the entries inside it.
+*    Parameters: struct TreeWalk *tw - The walk.
+* Preconditions: Only the reply calls this.
+*       Returns: The entry, valid until the next call, or NULL once the
+*                whole tree has been taken.
+*******************************************************************************/
+
+struct TreeEnt *treeWalkNext(struct TreeWalk *tw) {
+    struct TreeDir *d, **link;
+    struct TreeEnt *e;
+
+    pthread_mutex_lock(&tw->lock);
+    while ((d = tw->top)) {
+        /* List the directory the reply needs now rather than wait */
+        if (d->state == DS_QUEUED) {
+            for (link = &tw->queue; *link != d; link = &(*link)->queueNext) {
+            }
+            *link = d->queueNext;
+            d->state = DS_LISTING;
+            pthread_mutex_unlock(&tw->lock);
+            _listDir(d);
+            pthread_mutex_lock(&tw->lock);
+            _finishListing(tw, d);
+        }
+        while (d->state == DS_LISTING) {
+            pthread_cond_wait(&tw->ready, &tw->lock);
+        }
+
+        if (d->next < d->nEnts) {
+            e = &d->ents[d->next++];
+            if (e->sub) {
+                e->sub->up = d;
+                tw->top = e->sub;
+            }
+            pthread_mutex_unlock(&tw->lock);
+            return e;
+        }
+
+        /* The directory is finished; return to the one enclosing it */
+        tw->top = d->up;
+        tw->ahead--;
+        _freeDir(d);
+        pthread_cond_broadcast(&tw->work);
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: freeTreeWalk()
+*   Description: Abandons a walk. Walkers finish the directory they are
+*                listing and exit, and the last one out frees the walk.
+*    Parameters: struct TreeWalk *tw - The walk.
+* Preconditions: The reply no longer uses the walk.
+*       Returns: None.
+*******************************************************************************/
+
+void freeTreeWalk(struct TreeWalk *tw) {
+    pthread_mutex_lock(&tw->lock);
+    tw->stop = 1;
+    pthread_cond_broadcast(&tw->work);
+    _releaseWalk(tw);
+}
@@ -0,0 +1,76 @@
+/*******************************************************************************
+*      Filename: treewalk.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for treewalk.c. Please see treewalk.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef TREEWALK_H
+#define TREEWALK_H
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#define TW_THREADS 4            /* Walker threads per tree transfer */
+#define TW_MAX_WALKERS 16       /* Walker threads across the whole server */
+#define TW_AHEAD   256          /* Most directories listed ahead of the
+                                 * reply */
+
+/* Listing states of a directory in a walk */
+enum DirState { DS_QUEUED, DS_LISTING, DS_READY };
+
+/* A file or directory found by a walk */
+struct TreeEnt {
+    char *path;            /* Path relative to the server directory */
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    struct TreeDir *sub;   /* The directory's own listing, or NULL */
+};
+
+/* A directory of a walk and, once listed, its entries */
+struct TreeDir {
+    char *path;            /* Path relative to the server directory */
+    int state;             /* One of enum DirState */
+    struct TreeEnt *ents;  /* Regular files and directories, in directory
+                            * order */
+    int nEnts;
+    int next;              /* Index of the next entry for the reply */
+    struct TreeDir *up;    /* Enclosing directory on the reply's stack */
+    struct TreeDir *queueNext; /* Next directory waiting to be listed */
+};
+
+/* A walk of a directory tree. Walker threads list directories ahead of the
+ * reply, which takes their entries in depth-first order. */
+struct TreeWalk {
+    pthread_mutex_t lock;  /* Guards everything below */
+    pthread_cond_t work;   /* Signalled when walkers may list more */
+    pthread_cond_t ready;  /* Signalled when a directory has been listed */
+    int refs;              /* The reply, plus each running walker */
+    int stop;              /* Nonzero once the reply has been abandoned */
+    int ahead;             /* Directories listed but not finished by the
+                            * reply */
+    struct TreeDir *queue; /* Directories waiting to be listed, newest
+                            * first */
+    struct TreeDir *top;   /* The directory the reply is in */
+};
+
+int treeOpen(const char *, int);
+struct TreeWalk *initTreeWalk(const char *);
+struct TreeEnt *treeWalkNext(struct TreeWalk *);
+void freeTreeWalk(struct TreeWalk *);
+
+#endif
@@ -0,0 +1,538 @@
+/*******************************************************************************
+*      Filename: upload.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: Stores the files clients send with 'p' requests. The data
+*                follows the request on the control connection and is
+*                written to a temporary file, preallocated to its full
+*                length so it is laid out in one piece. Bytes are spliced
+*                from the socket through a pipe into the file without being
+*                copied into user space. The event loop only moves them from
+*                the socket into the pipe; a worker drains the pipe into the
+*                file, so no disk write ever runs on the loop. Once every
+*                byte has arrived the file is flushed to disk and renamed
+*                over its name, so other clients only ever see the old file
+*                or the whole new one. Writeback is started as the data
+*                arrives, so little is left to flush once it has all been
+*                received.
+*                Where the filesystem allows, the temporary file is opened
+*                with O_TMPFILE and has no name until then, so an upload
+*                that is cut short leaves nothing behind.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include "upload.h"
+
+/*******************************************************************************
+*      Function: _validPutName()
+*   Description: Checks that a file may be stored under a name: a plain file
+*                name that isn't one of the server's own files.
+*    Parameters: const char *name - The name.
+* Preconditions: None.
+*       Returns: 1 if the name is valid, 0 otherwise.
+*******************************************************************************/
+
+int _validPutName(const char *name) {
+    if (!name[0] || strchr(name, '/') || strcmp(name, ".") == 0 ||
+        strcmp(name, "..") == 0) {
+        return 0;
+    }
+    return !reservedName(name);
+}
+
+/*******************************************************************************
+*      Function: _putError()
+*   Description: Abandons a file being stored, placing an error message in
+*                the buffer. The data still to come will be discarded.
+*    Parameters: struct Upload *up - The upload.
+*                struct DynBuf *msgBuf - The buffer to hold the message.
+*                const char *msg - The error message.
+* Preconditions: msgBuf has been initialized.
+*       Returns: 'e'.
+*******************************************************************************/
+
+char _putError(struct Upload *up, struct DynBuf *msgBuf, const char *msg) {
+    if (up->fd != -1) {
+        close(up->fd);
+        up->fd = -1;
+    }
+    if (up->tmpName[0]) {
+        unlink(up->tmpName);
+        up->tmpName[0] = '\0';
+    }
+    clearDynBuf(msgBuf);
+    dynBufAddStr(msgBuf, msg);
+    return 'e';
+}
+
+/*******************************************************************************
+*      Function: _failWrite()
+*   Description: Gives up on writing an upload after an error. The rest of
+*                its data is received and discarded, and the error is
+*                reported once it has all arrived.
+*    Parameters: struct Upload *up - The upload.
+*                int err - The errno of the failed write.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _failWrite(struct Upload *up, int err) {
+    if (up->fd == -1) {
+        return;
+    }
+    fprintf(stderr, "ftserver: write: %s\n", strerror(err));
+    up->err = err;
+    close(up->fd);
+    up->fd = -1;
+    if (up->tmpName[0]) {
+        unlink(up->tmpName);
+        up->tmpName[0] = '\0';
+    }
+}
+
+/*******************************************************************************
+*      Function: initUpload()
+*   Description: Starts an upload with no file yet, which discards its data
+*                until openUpload() has succeeded.
+*    Parameters: off_t len - The bytes the client is sending.
+* Preconditions: None.
+*       Returns: The upload.
+*******************************************************************************/
+
+struct Upload *initUpload(off_t len) {
+    struct Upload *up;
+
+    up = calloc(1, sizeof(struct Upload));
+    assert(up);
+    up->fd = -1;
+    up->pipe[0] = up->pipe[1] = -1;
+    up->len = len;
+    return up;
+}
+
+/*******************************************************************************
+*      Function: openUpload()
+*   Description: Performs the first half of a 'p' request: creates the
+*                temporary file, reserves space for the whole upload and
+*                sets up the pipe the data is spliced through.
+*    Parameters: struct ClientCmd *cmd - The put command.
+*                struct DynBuf *msgBuf - The buffer to hold any error
+*                                        message.
+* Preconditions: cmd->upload is set.
+*       Returns: 'r' if the data may be received, 'e' otherwise.
+*******************************************************************************/
+
+char openUpload(struct ClientCmd *cmd, struct DynBuf *msgBuf) {
+    struct Upload *up = cmd->upload;
+    int len;
+
+    if (!_validPutName(cmd->fName)) {
+        return _putError(up, msgBuf, "INVALID FILE NAME");
+    }
+
+    up->fd = open(".", O_TMPFILE | O_WRONLY | O_CLOEXEC, UP_MODE);
+    up->anon = up->fd != -1;
+    /* Not every filesystem has unnamed files */
+    if (up->fd == -1) {
+        strcpy(up->tmpName, UP_TMP_PREFIX "XXXXXX");
+        up->fd = mkostemp(up->tmpName, O_CLOEXEC);
+        if (up->fd == -1) {
+            perror("ftserver: mkostemp");
+            up->tmpName[0] = '\0';
+            return _putError(up, msgBuf, "CANNOT STORE FILE");
+        }
+        fchmod(up->fd, UP_MODE);
+    }
+
+    /* Reserve every block now, so the file is contiguous and a full disk
+     * is found before the data is sent */
+    if (up->len > 0 && fallocate(up->fd, 0, 0, up->len) == -1 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        return _putError(up, msgBuf, errno == ENOSPC || errno == EFBIG ?
+                         "NO SPACE" : "CANNOT STORE FILE");
+    }
+
+    /* Without a pipe the data is received through user space instead */
+    if (pipe2(up->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("ftserver: pipe2");
+        up->pipe[0] = up->pipe[1] = -1;
+        return 'r';
+    }
+    fcntl(up->pipe[1], F_SETPIPE_SZ, UP_PIPE_LEN);
+    len = fcntl(up->pipe[1], F_GETPIPE_SZ);
+    if (len <= 0) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+        up->pipe[0] = up->pipe[1] = -1;
+        return 'r';
+    }
+    up->pipeLen = len;
+    return 'r';
+}
+
+/*******************************************************************************
+*      Function: _uploadBuf()
+*   Description: Returns an upload's user space buffer, allocating it the
+*                first time it is needed.
+*    Parameters: struct Upload *up - The upload.
+* Preconditions: None.
+*       Returns: The buffer of UP_BUF_LEN bytes.
+*******************************************************************************/
+
+char *_uploadBuf(struct Upload *up) {
+    if (!up->buf) {
+        up->buf = malloc(UP_BUF_LEN);
+        assert(up->buf);
+    }
+    return up->buf;
+}
+
+/*******************************************************************************
+*      Function: _writeUpload()
+*   Description: Writes bytes of an upload to its file at the current
+*                offset. An upload whose file has failed only counts them.
+*    Parameters: struct Upload *up - The upload.
+*                const char *data - The bytes.
+*                size_t len - The number of bytes.
+* Preconditions: len is no more than the bytes still to come.
+*       Returns: None.
+*******************************************************************************/
+
+void _writeUpload(struct Upload *up, const char *data, size_t len) {
+    ssize_t status;
+    size_t done = 0;
+
+    while (up->fd != -1 && done < len) {
+        status = pwrite(up->fd, data + done, len - done, up->got + done);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status <= 0) {
+            _failWrite(up, status == 0 ? EIO : errno);
+            break;
+        }
+        done += status;
+    }
+    up->got += len;
+}
+
+/*******************************************************************************
+*      Function: _drainPipe()
+*   Description: Moves bytes waiting in an upload's pipe into its file. If
+*                the file can't take them from the pipe, they are read out
+*                and written through the buffer, and the pipe isn't used
+*                again.
+*    Parameters: struct Upload *up - The upload.
+*                size_t len - The bytes in the pipe.
+* Preconditions: The pipe holds len bytes. No bytes are waiting in the
+*                upload's buffer.
+*       Returns: None.
+*******************************************************************************/
+
+void _drainPipe(struct Upload *up, size_t len) {
+    char *buf;
+    loff_t off;
+    ssize_t status;
+    size_t n;
+    int splicing = 1;
+
+    while (len > 0) {
+        if (splicing && up->fd != -1) {
+            off = up->got;
+            status = splice(up->pipe[0], NULL, up->fd, &off, len,
+                            SPLICE_F_MOVE);
+            if (status > 0) {
+                up->got += status;
+                len -= status;
+                continue;
+            }
+            if (status == -1 && errno == EINTR) {
+                continue;
+            }
+            if (status == 0 || (errno != EINVAL && errno != ENOSYS)) {
+                _failWrite(up, status == 0 ? EIO : errno);
+            }
+            splicing = 0;
+            continue;
+        }
+        /* Read the bytes back out, then write or discard them */
+        buf = _uploadBuf(up);
+        n = len < UP_BUF_LEN ? len : UP_BUF_LEN;
+        status = read(up->pipe[0], buf, n);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status <= 0) {
+            perror("ftserver: read");
+            _failWrite(up, EIO);
+            up->got += len;
+            break;
+        }
+        _writeUpload(up, buf, status);
+        len -= status;
+    }
+
+    if (!splicing) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+        up->pipe[0] = up->pipe[1] = -1;
+    }
+}
+
+/*******************************************************************************
+*      Function: _startWriteback()
+*   Description: Starts writing the received part of an upload to disk once
+*                UP_FLUSH_LEN bytes have built up, without waiting for it.
+*    Parameters: struct Upload *up - The upload.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _startWriteback(struct Upload *up) {
+    if (up->fd == -1 || up->got - up->flushed < UP_FLUSH_LEN) {
+        return;
+    }
+    sync_file_range(up->fd, up->flushed, up->got - up->flushed,
+                    SYNC_FILE_RANGE_WRITE);
+    up->flushed = up->got;
+}
+
+/*******************************************************************************
+*      Function: uploadQueue()
+*   Description: Takes bytes of an upload that were received along with the
+*                request, to be written with the next drain. They go into
+*                the pipe when they fit in one atomic write, and are copied
+*                into the upload's buffer otherwise.
+*    Parameters: struct Upload *up - The upload.
+*                const char *data - The bytes.
+*                size_t len - The number of bytes.
+* Preconditions: len is no more than the bytes still to come, and no more
+*                than UP_BUF_LEN. No bytes are waiting to be written.
+*       Returns: None.
+*******************************************************************************/
+
+void uploadQueue(struct Upload *up, const char *data, size_t len) {
+    ssize_t status;
+
+    up->recvd += len;
+    if (up->fd == -1) {
+        up->got += len;
+        return;
+    }
+    /* A write of at most PIPE_BUF bytes is never left half done */
+    if (up->pipe[0] != -1 && len <= PIPE_BUF) {
+        do {
+            status = write(up->pipe[1], data, len);
+        } while (status == -1 && errno == EINTR);
+        if (status == (ssize_t) len) {
+            up->piped = len;
+            return;
+        }
+    }
+    memcpy(_uploadBuf(up), data, len);
+    up->bufLen = len;
+}
+
+/*******************************************************************************
+*      Function: uploadRecv()
+*   Description: Receives the next part of an upload from a non-blocking
+*                socket without writing it. Data is spliced into the pipe
+*                when there is one and the file is still being written, and
+*                is received into the upload's buffer otherwise; either way
+*                it waits there for uploadDrain(). The data of an upload
+*                whose file has failed is received into buf and discarded.
+*    Parameters: struct Upload *up - The upload.
+*                int sockfd - The socket.
+*                char *buf - A buffer of UP_BUF_LEN bytes for discarded
+*                            data.
+*                off_t budget - The most bytes to receive.
+* Preconditions: Bytes of the upload are still to come. budget is positive.
+*       Returns: The number of bytes received, 0 if the client closed the
+*                connection, or -1 with errno set. errno is EAGAIN if the
+*                pipe or buffer is full and must be drained first.
+*******************************************************************************/
+
+ssize_t uploadRecv(struct Upload *up, int sockfd, char *buf, off_t budget) {
+    ssize_t status;
+    off_t want = up->len - up->recvd;
+
+    if (want > budget) {
+        want = budget;
+    }
+
+    /* Data with nowhere to go is only counted */
+    if (up->fd == -1) {
+        if (want > UP_BUF_LEN) {
+            want = UP_BUF_LEN;
+        }
+        do {
+            status = recv(sockfd, buf, want, 0);
+        } while (status == -1 && errno == EINTR);
+        if (status > 0) {
+            up->recvd += status;
+            up->got += status;
+        }
+        return status;
+    }
+
+    if (up->pipe[0] != -1 && up->bufLen == 0) {
+        if (want > (off_t) (up->pipeLen - up->piped)) {
+            want = up->pipeLen - up->piped;
+        }
+        if (want == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        do {
+            status = splice(sockfd, NULL, up->pipe[1], NULL, want,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (status == -1 && errno == EINTR);
+        if (status > 0) {
+            up->recvd += status;
+            up->piped += status;
+        }
+        if (status != -1 || (errno != EINVAL && errno != ENOSYS)) {
+            return status;
+        }
+        /* The socket can't be spliced, so stop trying once the pipe has
+         * been drained */
+        if (up->piped > 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+        up->pipe[0] = up->pipe[1] = -1;
+    }
+
+    if (want > (off_t) (UP_BUF_LEN - up->bufLen)) {
+        want = UP_BUF_LEN - up->bufLen;
+    }
+    if (want == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    do {
+        status = recv(sockfd, _uploadBuf(up) + up->bufLen, want, 0);
+    } while (status == -1 && errno == EINTR);
+    if (status > 0) {
+        up->recvd += status;
+        up->bufLen += status;
+    }
+    return status;
+}
+
+/*******************************************************************************
+*      Function: uploadPending()
+*   Description: Checks whether received bytes of an upload are waiting to
+*                be written.
+*    Parameters: struct Upload *up - The upload.
+* Preconditions: None.
+*       Returns: 1 if uploadDrain() has work to do, 0 otherwise.
+*******************************************************************************/
+
+int uploadPending(struct Upload *up) {
+    return up->bufLen > 0 || up->piped > 0;
+}
+
+/*******************************************************************************
+*      Function: uploadDrain()
+*   Description: Writes the received bytes of an upload that are waiting in
+*                its buffer and pipe to the file, then starts writeback if
+*                enough has built up. Runs on a worker thread, since these
+*                are the upload's blocking disk writes.
+*    Parameters: struct Upload *up - The upload.
+* Preconditions: Nothing else touches the upload until it returns.
+*       Returns: None.
+*******************************************************************************/
+
+void uploadDrain(struct Upload *up) {
+    /* The buffer only ever holds bytes that came before the pipe's */
+    if (up->bufLen > 0) {
+        _writeUpload(up, up->buf, up->bufLen);
+        up->bufLen = 0;
+    }
+    if (up->piped > 0) {
+        _drainPipe(up, up->piped);
+        up->piped = 0;
+    }
+    _startWriteback(up);
+}
+
+/*******************************************************************************
+*      Function: commitUpload()
+*   Description: Performs the second half of a 'p' request once the data
+*                has all arrived: flushes the file to disk and renames it
+*                over the requested name. A file with no name is first
+*                linked into the directory under a temporary name, since a
+*                link can't replace an existing file.
+*    Parameters: struct ClientCmd *cmd - The put command.
+*                struct DynBuf *msgBuf - The buffer to hold any error
+*                                        message.
+* Preconditions: openUpload() succeeded and cmd->upload is done.
+*       Returns: 'r' if the file was stored, 'e' otherwise.
+*******************************************************************************/
+
+char commitUpload(struct ClientCmd *cmd, struct DynBuf *msgBuf) {
+    struct Upload *up = cmd->upload;
+    char path[UP_TMP_LEN];
+
+    if (up->fd == -1) {
+        return _putError(up, msgBuf, up->err == ENOSPC || up->err == EFBIG ?
+                         "NO SPACE" : "CANNOT STORE FILE");
+    }
+    /* The data must reach the disk before the name points at it */
+    if (fdatasync(up->fd) == -1) {
+        perror("ftserver: fdatasync");
+        return _putError(up, msgBuf, errno == ENOSPC ? "NO SPACE" :
+                         "CANNOT STORE FILE");
+    }
+
+    if (up->anon) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", up->fd);
+        /* A name left by an earlier server with the same pid is stale */
+        snprintf(up->tmpName, sizeof(up->tmpName), UP_TMP_PREFIX "%ld.%d",
+                 (long) getpid(), up->fd);
+        unlink(up->tmpName);
+        if (linkat(AT_FDCWD, path, AT_FDCWD, up->tmpName,
+                   AT_SYMLINK_FOLLOW) == -1) {
+            perror("ftserver: linkat");
+            up->tmpName[0] = '\0';
+            return _putError(up, msgBuf, "CANNOT STORE FILE");
+        }
+    }
+    if (rename(up->tmpName, cmd->fName) == -1) {
+        perror("ftserver: rename");
+        return _putError(up, msgBuf, "CANNOT STORE FILE");
+    }
+    up->tmpName[0] = '\0';
+
+    close(up->fd);
+    up->fd = -1;
+    clearDynBuf(msgBuf);
+    return 'r';
+}
+
+/*******************************************************************************
+*      Function: freeUpload()
+*   Description: Releases an upload, removing its temporary file if it was
+*                never stored.
+*    Parameters: struct Upload *up - The upload.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void freeUpload(struct Upload *up) {
+    if (up->fd != -1) {
+        close(up->fd);
+    }
+    if (up->tmpName[0]) {
+        unlink(up->tmpName);
+    }
+    if (up->pipe[0] != -1) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+    }
+    free(up->buf);
+    free(up);
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************
+*      Filename: upload.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for upload.c. Please see upload.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "command.h"
+
+#define UP_PIPE_LEN   1048576   /* Pipe capacity asked for when splicing */
+#define UP_BUF_LEN    1048576   /* Bytes received at a time without splice */
+#define UP_SLICE      4194304   /* Most bytes received per readiness event */
+#define UP_FLUSH_LEN  8388608   /* Bytes written between starts of
+                                 * writeback */
+#define UP_MODE       0644      /* Permissions of a stored file */
+#define UP_TMP_PREFIX ".ftput." /* Start of a temporary file's name */
+#define UP_TMP_LEN    32        /* Temporary file name buffer length */
+
+/* A file being received from a client */
+struct Upload {
+    int fd;                /* The temporary file, or -1 while the data is
+                            * discarded */
+    int pipe[2];           /* Pipe the data is spliced through, or -1 */
+    size_t pipeLen;        /* Capacity of the pipe */
+    int anon;              /* Nonzero if the file has no name yet */
+    char tmpName[UP_TMP_LEN]; /* Name of the temporary file, or "" */
+    off_t len;             /* Bytes the client is sending */
+    off_t recvd;           /* Bytes received so far */
+    off_t got;             /* Bytes written to the file, or discarded */
+    off_t flushed;         /* Bytes whose writeback has been started */
+    char *buf;             /* UP_BUF_LEN bytes received through user space,
+                            * or NULL until needed */
+    size_t bufLen;         /* Received bytes waiting in buf */
+    size_t piped;          /* Received bytes waiting in the pipe */
+    int err;               /* errno of a failed write, or 0 */
+    int done;              /* Nonzero once every byte has been received */
+};
+
+struct Upload *initUpload(off_t);
+char openUpload(struct ClientCmd *, struct DynBuf *);
+void uploadQueue(struct Upload *, const char *, size_t);
+ssize_t uploadRecv(struct Upload *, int, char *, off_t);
+int uploadPending(struct Upload *);
+void uploadDrain(struct Upload *);
+char commitUpload(struct ClientCmd *, struct DynBuf *);
+void freeUpload(struct Upload *);
+
+#endif
@@ -0,0 +1,308 @@
+/*******************************************************************************
+*      Filename: uring.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: An optional io_uring backend for reading small files. Each
+*                worker thread borrows a ring with a registered buffer and a
+*                registered file slot. A read submits an open into the slot,
+*                a read of the whole file into the buffer and a close of the
+*                slot as one linked chain, so a file is opened, read and
+*                closed with a single io_uring_enter() call. The rings are
+*                driven with raw system calls; liburing is not needed.
+*******************************************************************************/
+
+#include "uring.h"
+
+/*******************************************************************************
+*      Function: _freeRing()
+*   Description: Unmaps and closes a ring.
+*    Parameters: struct Ring *r - The ring.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _freeRing(struct Ring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqesLen);
+    }
+    if (r->cqMap && r->cqMap != r->sqMap) {
+        munmap(r->cqMap, r->cqMapLen);
+    }
+    if (r->sqMap) {
+        munmap(r->sqMap, r->sqMapLen);
+    }
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+    free(r->buf);
+    free(r);
+}
+
+/*******************************************************************************
+*      Function: _initRing()
+*   Description: Sets up a ring, maps its queues, and registers its read
+*                buffer and an empty file slot.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: The ring, or NULL with errno set if io_uring is unavailable.
+*******************************************************************************/
+
+struct Ring *_initRing(void) {
+    struct io_uring_params p;
+    struct iovec iov;
+    struct Ring *r;
+    int slot = -1, err;
+
+    r = calloc(1, sizeof(struct Ring));
+    assert(r);
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (r->fd == -1) {
+        goto fail;
+    }
+
+    /* Map the submission and completion rings, which share one mapping on
+     * newer kernels, and the submission queue entries */
+    r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqMapLen > r->sqMapLen) {
+            r->sqMapLen = r->cqMapLen;
+        }
+        r->cqMapLen = r->sqMapLen;
+    }
+    r->sqMap = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqMap == MAP_FAILED) {
+        r->sqMap = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqMap = r->sqMap;
+    } else {
+        r->cqMap = mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqMap == MAP_FAILED) {
+            r->cqMap = NULL;
+            goto fail;
+        }
+    }
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+    r->sqHead = (unsigned *) ((char *) r->sqMap + p.sq_off.head);
+    r->sqTail = (unsigned *) ((char *) r->sqMap + p.sq_off.tail);
+    r->sqMask = (unsigned *) ((char *) r->sqMap + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *) ((char *) r->sqMap + p.sq_off.array);
+    r->cqHead = (unsigned *) ((char *) r->cqMap + p.cq_off.head);
+    r->cqTail = (unsigned *) ((char *) r->cqMap + p.cq_off.tail);
+    r->cqMask = (unsigned *) ((char *) r->cqMap + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cqMap + p.cq_off.cqes);
+
+    /* Register the read buffer, so it is pinned once rather than on every
+     * read, and one empty slot for the files being read */
+    r->buf = malloc(UR_BUF_LEN);
+    assert(r->buf);
+    iov.iov_base = r->buf;
+    iov.iov_len = UR_BUF_LEN;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+                &iov, 1) == -1 ||
+        syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+                &slot, 1) == -1) {
+        goto fail;
+    }
+
+    return r;
+
+fail:
+    err = errno;
+    _freeRing(r);
+    errno = err;
+    return NULL;
+}
+
+/*******************************************************************************
+*      Function: _queue()
+*   Description: Claims and clears the next submission queue entry.
+*    Parameters: struct Ring *r - The ring.
+*                unsigned *tail - The local tail, advanced past the entry.
+* Preconditions: The queue has room for the entry.
+*       Returns: The entry.
+*******************************************************************************/
+
+struct io_uring_sqe *_queue(struct Ring *r, unsigned *tail) {
+    unsigned idx = *tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[idx] = idx;
+    (*tail)++;
+    return sqe;
+}
+
+/*******************************************************************************
+*      Function: initUring()
+*   Description: Creates the io_uring backend with a ring for each worker.
+*    Parameters: int nRings - The number of rings, one per worker thread.
+* Preconditions: nRings is positive.
+*       Returns: The backend, or NULL if the kernel doesn't support io_uring
+*                or forbids it, in which case files are read with ordinary
+*                system calls.
+*******************************************************************************/
+
+struct Uring *initUring(int nRings) {
+    struct Uring *ur;
+    struct Ring *r;
+    int i;
+
+    ur = calloc(1, sizeof(struct Uring));
+    assert(ur);
+    pthread_mutex_init(&ur->lock, NULL);
+
+    for (i = 0; i < nRings; i++) {
+        r = _initRing();
+        if (!r) {
+            perror("ftserver: io_uring unavailable, using system calls");
+            while ((r = ur->free)) {
+                ur->free = r->next;
+                _freeRing(r);
+            }
+            free(ur);
+            return NULL;
+        }
+        r->next = ur->free;
+        ur->free = r;
+    }
+
+    return ur;
+}
+
+/*******************************************************************************
+*      Function: uringGet()
+*   Description: Borrows a ring for the calling worker.
+*    Parameters: struct Uring *ur - The backend.
+* Preconditions: None.
+*       Returns: The ring, or NULL if every ring is in use.
+*******************************************************************************/
+
+struct Ring *uringGet(struct Uring *ur) {
+    struct Ring *r;
+
+    pthread_mutex_lock(&ur->lock);
+    r = ur->free;
+    if (r) {
+        ur->free = r->next;
+    }
+    pthread_mutex_unlock(&ur->lock);
+
+    return r;
+}
+
+/*******************************************************************************
+*      Function: uringPut()
+*   Description: Returns a borrowed ring. A broken ring is freed instead,
+*                since its leftover completions would be taken for the next
+*                read's; the worker falls back to system calls once every
+*                ring is gone.
+*    Parameters: struct Uring *ur - The backend.
+*                struct Ring *r - The ring.
+* Preconditions: The caller has finished with the ring's buffer.
+*       Returns: None.
+*******************************************************************************/
+
+void uringPut(struct Uring *ur, struct Ring *r) {
+    if (r->broken) {
+        _freeRing(r);
+        return;
+    }
+    pthread_mutex_lock(&ur->lock);
+    r->next = ur->free;
+    ur->free = r;
+    pthread_mutex_unlock(&ur->lock);
+}
+
+/*******************************************************************************
+*      Function: uringReadFile()
+*   Description: Opens, reads and closes a file with one io_uring_enter()
+*                call. The open places the file in the ring's registered
+*                slot, the read fills the registered buffer from the slot,
+*                and the close empties the slot. The close is hard linked,
+*                so it runs even when the read is short.
+*    Parameters: struct Ring *r - The borrowed ring.
+*                const char *name - The file name.
+* Preconditions: None.
+*       Returns: The number of bytes read into r->buf, at most UR_BUF_LEN, or
+*                -1 with errno set if the file couldn't be opened or read.
+*                If io_uring_enter() itself fails, the ring is marked broken.
+*******************************************************************************/
+
+ssize_t uringReadFile(struct Ring *r, const char *name) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head;
+    int submitted = 0, reaped = 0, res[3] = { 0, 0, 0 };
+    long status;
+
+    tail = *r->sqTail;
+
+    sqe = _queue(r, &tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) name;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = 0;
+
+    sqe = _queue(r, &tail);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = 0;
+    sqe->addr = (unsigned long) r->buf;
+    sqe->len = UR_BUF_LEN;
+    sqe->buf_index = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->user_data = 1;
+
+    sqe = _queue(r, &tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    sqe->user_data = 2;
+
+    __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+
+    /* Submit the chain and wait for all three completions */
+    while (reaped < 3) {
+        status = syscall(__NR_io_uring_enter, r->fd, 3 - submitted,
+                         3 - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ftserver: io_uring_enter");
+            r->broken = 1;
+            return -1;
+        }
+        submitted += status;
+
+        head = *r->cqHead;
+        while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head & *r->cqMask];
+            if (cqe->user_data < 3) {
+                res[cqe->user_data] = cqe->res;
+            }
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (res[0] < 0 || res[1] < 0) {
+        errno = res[0] < 0 ? -res[0] : -res[1];
+        return -1;
+    }
+    return res[1];
+}
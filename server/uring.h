@@ -0,0 +1,63 @@
+/*******************************************************************************
+*      Filename: uring.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.17.26
+*   Description: The header file for uring.c. Please see uring.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define UR_ENTRIES  8           /* Submission queue entries per ring */
+#define UR_BUF_LEN  65536       /* Registered buffer length; files up to
+                                 * this size are read through the ring */
+
+/* One worker's ring, with its registered buffer and file slot */
+struct Ring {
+    int fd;                /* The io_uring file descriptor */
+    void *sqMap;           /* Submission ring mapping */
+    size_t sqMapLen;
+    void *cqMap;           /* Completion ring mapping, may equal sqMap */
+    size_t cqMapLen;
+    struct io_uring_sqe *sqes; /* Submission queue entries */
+    size_t sqesLen;
+    unsigned *sqHead;      /* Pointers into the shared rings */
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    char *buf;             /* The registered read buffer */
+    int broken;            /* Nonzero if requests may be left unsubmitted or
+                            * unreaped, so the ring can't be reused */
+    struct Ring *next;     /* Next free ring */
+};
+
+/* The io_uring backend: a ring per worker thread */
+struct Uring {
+    pthread_mutex_t lock;  /* Guards the free list */
+    struct Ring *free;     /* Rings not in use by a worker */
+};
+
+struct Uring *initUring(int);
+struct Ring *uringGet(struct Uring *);
+void uringPut(struct Uring *, struct Ring *);
+ssize_t uringReadFile(struct Ring *, const char *);
+
+#endif
@@ -2,33 +2,117 @@
 *      Filename: validate.c
 *        Author: Maxwell Goldberg
 * Last Modified: 3.11.17
-*   Description: Contains a utility function for validating ftserver command 
+*   Description: Contains utility functions for validating ftserver command 
 *                line arguments.
 *******************************************************************************/
 
 #include "validate.h"
 
+/*******************************************************************************
+*      Function: _usage()
+*   Description: Prints the ftserver usage message and exits with an error.
+*    Parameters: None.
+* Preconditions: None.
+*       Returns: None.
+*******************************************************************************/
+
+void _usage() {
+    fprintf(stderr, "ftserver: usage: ftserver [-t threads] [-q queue_depth] "
+                    "[-m cache_mb] [-r resolve_ttl] [-b buffer_mb] [-u] "
+                    "[-s rate_kb] [-c conn_rate_kb] [-n] <SERVER_PORT>\n");
+    exit(1);
+}
+
+/*******************************************************************************
+*      Function: _validateCount()
+*   Description: Validates an integer option argument.
+*    Parameters: const char *arg - The option argument.
+*                int min - The smallest allowed value.
+*                int max - The largest allowed value.
+*                const char *name - The option name used in error messages.
+* Preconditions: None.
+*       Returns: The validated value.
+*******************************************************************************/
+
+int _validateCount(const char *arg, int min, int max, const char *name) {
+    char *end;
+    long result;
+
+    result = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || result < min || result > max) {
+        fprintf(stderr, "ftserver: %s must be from %d to %d\n", name, min,
+                max);
+        exit(1);
+    }
+    return result;
+}
+
 /*******************************************************************************
 *      Function: validateArgs()
-*   Description: Validates the command line port argument.
+*   Description: Validates the command line options and port argument.
 *    Parameters: int argc - The number of command line arguments.
 *                char **argv - The command line arguments list.
+*                struct ServerOpts *opts - Destination for the options.
 * Preconditions: None.
-*       Returns: The validated port string.
+*       Returns: None. Exits with an error on invalid arguments.
 *******************************************************************************/
 
-const char *validateArgs(int argc, char **argv) {
+void validateArgs(int argc, char **argv, struct ServerOpts *opts) {
     int result = 0;
-    int i;
-    const char* port;
+    int i, c;
+    char *port;
+
+    opts->nThreads = DEFAULT_THREADS;
+    opts->queueDepth = DEFAULT_QUEUE_DEPTH;
+    opts->cacheBudget = (size_t) DEFAULT_CACHE_MB << 20;
+    opts->resolveTTL = DEFAULT_RESOLVE_TTL;
+    opts->bufferBudget = (size_t) DEFAULT_BUFFER_MB << 20;
+    opts->uring = 0;
+    opts->globalRate = 0;
+    opts->connRate = 0;
+    opts->hashing = 1;
+
+    /* Parse the options */
+    while ((c = getopt(argc, argv, "t:q:m:r:b:us:c:n")) != -1) {
+        if (c == 't') {
+            opts->nThreads = _validateCount(optarg, 1, MAX_THREADS,
+                                            "threads");
+        } else if (c == 'q') {
+            opts->queueDepth = _validateCount(optarg, 1, MAX_QUEUE_DEPTH,
+                                              "queue depth");
+        } else if (c == 'm') {
+            opts->cacheBudget = (size_t) _validateCount(optarg, 0,
+                                                        MAX_CACHE_MB,
+                                                        "cache size") << 20;
+        } else if (c == 'r') {
+            opts->resolveTTL = _validateCount(optarg, 0, MAX_RESOLVE_TTL,
+                                              "hostname cache time");
+        } else if (c == 'b') {
+            opts->bufferBudget = (size_t) _validateCount(optarg, 0,
+                                                         MAX_BUFFER_MB,
+                                                         "buffer memory") << 20;
+        } else if (c == 'u') {
+            opts->uring = 1;
+        } else if (c == 's') {
+            opts->globalRate = (unsigned long long)
+                _validateCount(optarg, 0, MAX_RATE_KB, "rate limit") << 10;
+        } else if (c == 'c') {
+            opts->connRate = (unsigned long long)
+                _validateCount(optarg, 0, MAX_RATE_KB,
+                               "connection rate limit") << 10;
+        } else if (c == 'n') {
+            opts->hashing = 0;
+        } else {
+            _usage();
+        }
+    }
    
-    /* Ensure that there are exactly 2 arguments. */ 
-    if (argc == 1 || argc > 2) {
-        fprintf(stderr, "ftserver: usage: ftserver <SERVER_PORT>\n");
-        exit(1);
+    /* Ensure that exactly the port argument remains. */ 
+    if (argc - optind != 1) {
+        _usage();
     }
 
-    port = argv[1];
+    port = argv[optind];
 
     /* Ensure that the port contains only digit characters. Obtain an 
        integer version of the port. */
@@ -48,7 +132,7 @@ const char *validateArgs(int argc, char **argv) {
         exit(1);
     }
     /* Remove leading zeroes from the valid port number */
-    snprintf(argv[1], 6, "%d", result);
+    snprintf(port, 6, "%d", result);
 
-    return port;
+    opts->port = port;
 }
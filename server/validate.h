@@ -13,11 +13,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MIN_PORT   1
 #define MAX_PORT   65535
 #define MSGBUFSIZE 256
 
-const char *validateArgs(int, char **);
+#define DEFAULT_THREADS     4     /* Default worker thread count */
+#define DEFAULT_QUEUE_DEPTH 256   /* Default worker queue depth */
+#define MAX_THREADS         1024  /* Largest allowed worker thread count */
+#define MAX_QUEUE_DEPTH     65536 /* Largest allowed worker queue depth */
+#define DEFAULT_CACHE_MB    64    /* Default hot file cache budget */
+#define MAX_CACHE_MB        1048576 /* Largest allowed cache budget */
+#define DEFAULT_RESOLVE_TTL 300   /* Default seconds a hostname is cached */
+#define MAX_RESOLVE_TTL     86400 /* Largest allowed hostname cache time */
+#define DEFAULT_BUFFER_MB   256   /* Default reply buffer memory cap */
+#define MAX_BUFFER_MB       1048576 /* Largest allowed reply buffer cap */
+#define MAX_RATE_KB         100000000 /* Largest allowed rate limit */
+
+/* Validated server command line options */
+struct ServerOpts {
+    const char *port;      /* Server listening port */
+    int nThreads;          /* Worker thread count */
+    int queueDepth;        /* Commands that may be queued or running at once */
+    size_t cacheBudget;    /* Hot file cache budget in bytes, 0 to disable */
+    int resolveTTL;        /* Seconds a client hostname is cached, 0 to
+                            * skip reverse lookups */
+    size_t bufferBudget;   /* Reply buffer memory at which new commands
+                            * wait, 0 for no limit */
+    int uring;             /* Nonzero to read small files with io_uring */
+    unsigned long long globalRate; /* Bytes per second sent by the whole
+                            * server, 0 for no limit */
+    unsigned long long connRate; /* Bytes per second sent to each client
+                            * connection, 0 for no limit */
+    int hashing;           /* Nonzero to hash files for conditional gets */
+};
+
+void validateArgs(int, char **, struct ServerOpts *);
 
 #endif